@@ -33,12 +33,15 @@
 */
 
 #include "apple_authenticate.h"
+#include "odnonce.h"
+#include "odverifier.h"
 
 #include <sys/types.h>
 #include <pwd.h>
 #include <Security/checkpw.h>
 
 #include <syslog.h>
+#include <pthread.h>
 #include <CoreServices/CoreServices.h>
 
 #include <CoreFoundation/CFData.h>
@@ -55,14 +58,41 @@
 #include <membershipPriv.h>
 
 #include "dserr.h"
+#include "odcache.h"
+#include "apple_backend.h"
+#include "odguard.h"
 
 enum { kLogErrors_disabled = 0, kLogErrors_enabled = 1 };
 enum { kValidate_AuthMethod = 0, kValidate_User = 1 };
 	
-static tDirReference		dirRef		= 0;
-static tDirNodeReference	searchNodeRef   = 0;
+/* The od_auth_* entry points may be called concurrently (c2s runs its
+ * authreg checks on a pool of worker threads).  Each thread opens its own
+ * directory references, so a worker that finds its reference broken and
+ * reopens it can't close one another worker is using.  The user-exists
+ * cache is guarded by its own lock. */
+typedef struct ODAuthDirectoryRefs {
+	tDirReference		dirRef;
+	tDirNodeReference	searchNodeRef;
+} ODAuthDirectoryRefs;
+
+static pthread_once_t		dirRefsOnce	= PTHREAD_ONCE_INIT;
+static pthread_key_t		dirRefsKey;
+static pthread_mutex_t		userExistsLock	= PTHREAD_MUTEX_INITIALIZER;
 static char			userExists[1024] = "";
 
+/* Which auth methods each user's directory node supports, learned from
+ * od_auth_supports_cram_md5() probes and from real authentications.
+ * Saves the probe dsDoDirNodeAuth before every iq:auth get. */
+typedef struct AuthMethodCacheValue {
+	int			known;		/* kODAuthMethod* bits we have an answer for */
+	int			supported;	/* ...and which of those are supported */
+} AuthMethodCacheValue;
+
+static pthread_once_t		methodCacheOnce	= PTHREAD_ONCE_INIT;
+static ODCache			*methodCache	= NULL;
+static int			methodCacheMaxEntries = kAuthMethodCacheDefaultSize;
+static int			methodCacheTTL	= kAuthMethodCacheDefaultTTL;
+
 /* forward declarations for internal functions */
 #if 0
 tDirStatus _od_auth_open_user_node(tDirReference inDirRef, const char *inUserLoc, 
@@ -82,8 +112,9 @@ int _od_auth_bytes_to_hex_chars(const void* inValue,  UInt32 inValueLen,
 
 #endif
 
-int _od_auth_check_user_exists(const char *inUserID);
-static int od_auth_configure_directory_references(void);
+static void _od_auth_method_cache_init(void);
+static int _od_auth_directory_checkpw(const char* userName, const char* password);
+static int od_auth_configure_directory_references(tDirReference *outDirRef, tDirNodeReference *outSearchNodeRef);
 
 /* -----------------------------------------------------------------
    PUBLIC FUNCTIONS
@@ -101,10 +132,11 @@ static int od_auth_configure_directory_references(void);
 		0 = failed
 		1 = user exists
 
+	Asked of the configured directory backend.
    ----------------------------------------------------------------- */
 int od_auth_check_user_exists(const char* userName)
 {
-    return( _od_auth_check_user_exists( userName ) );
+    return( od_auth_backend_user_exists( userName ) );
      
      return kFailed;
 }
@@ -120,15 +152,57 @@ int od_auth_check_user_exists(const char* userName)
 		0 = success
 		1 = failed
 
+	When the directory can't answer, answered from the plain
+	verifier cache if it's on.
    ----------------------------------------------------------------- */
 int od_auth_check_plain_password(const char* userName, const char* password)
 {
-    if (CHECKPW_SUCCESS == checkpw(userName, password))
+    switch (_od_auth_directory_checkpw(userName, password)) {
+    case kODVerifierAccepted:
+        ODVerifierStore(userName, password);
+        return kAuthenticated;
+    case kODVerifierRejected:
+        ODVerifierForget(userName);
+        return kFailed;
+    }
+
+    /* a password the directory accepted recently enough still works while it's down */
+    if (kODVerifierHit == ODVerifierCheck(userName, password, _od_auth_directory_checkpw))
         return kAuthenticated;
      
      return kFailed;
 }
 
+/* -----------------------------------------------------------------
+    static int _od_auth_directory_checkpw()
+
+	checkpw() behind the directory guard; also used by the plain
+	verifier cache to revalidate in the background.
+
+	RETURNS: kODVerifierAccepted, kODVerifierRejected (bad password
+		or no such user) or kODVerifierUnavailable
+   ----------------------------------------------------------------- */
+static int _od_auth_directory_checkpw(const char* userName, const char* password)
+{
+    ODGuardCall guard;
+    int result;
+
+    if (ODGuardBegin(&guard, "checkpw") != 0)
+        return kODVerifierUnavailable;
+    result = checkpw(userName, password);
+    ODGuardEnd(&guard, result == CHECKPW_FAILURE);
+
+    switch (result) {
+    case CHECKPW_SUCCESS:
+        od_auth_set_cached_auth_method(userName, kODAuthMethodPlain, 1);
+        return kODVerifierAccepted;
+    case CHECKPW_FAILURE:
+        return kODVerifierUnavailable;
+    default:
+        return kODVerifierRejected;
+    }
+}
+
 /* -----------------------------------------------------------------
 	int od_auth_supports_cram_md5()
 	
@@ -140,11 +214,21 @@ int od_auth_check_plain_password(const char* userName, const char* password)
    ----------------------------------------------------------------- */
 int od_auth_supports_cram_md5(const char *inUserID)
 {
+	int cached = od_auth_get_cached_auth_method(inUserID, kODAuthMethodCRAMMD5);
+	if (cached >= 0)
+		return cached;
+
 	int iResult = _od_auth_validate_response( inUserID, "", "", 
 	                                          kDSStdAuthCRAM_MD5, 
 											  kValidate_AuthMethod);
-    if (eDSAuthMethodNotSupported == iResult)
+    if (eDSAuthMethodNotSupported == iResult) {
+       od_auth_set_cached_auth_method(inUserID, kODAuthMethodCRAMMD5, 0);
        return 0;
+    }
+
+    /* only remember "supported" if the probe actually reached the user's node */
+    if (IS_EXPECTED_DS_ERROR(iResult))
+       od_auth_set_cached_auth_method(inUserID, kODAuthMethodCRAMMD5, 1);
 
     return 1;
 }
@@ -160,28 +244,17 @@ int od_auth_supports_cram_md5(const char *inUserID)
    ----------------------------------------------------------------- */
 int od_auth_create_crammd5_challenge(char *outChallenge, int destsize)
 {
-    int numchars = 0;
-    char randombytes[ 32 ];
-    UInt32 destChars = 0;
-		
     if (NULL != outChallenge)
         outChallenge[0] = 0;
 
-    if (destsize < 5) // just in case it changes type or becomes too small
+    if (destsize < kODNonceChallengeBufferSize)
         return 0;
-    
-    if (0 == RAND_bytes(randombytes, sizeof(randombytes) ) )
+
+    /* remembered until it's answered, so it can only be answered once */
+    if (0 != ODNonceIssueChallenge(outChallenge, (size_t) destsize))
         return 0;
-    
-    // test routine for ConvertBytesToHexChars
-    // numchars = testChallenge(m, &destChars);
 
-    numchars = _od_auth_bytes_to_hex_chars( randombytes,  sizeof(randombytes), outChallenge, (UInt32) destsize - 1, &destChars);
-    if (numchars != sizeof(randombytes) || destChars >= destsize) // failed to convert all the bytes or converted too many bytes
-        numchars = destChars = 0; 
-        
-    outChallenge[destChars] = 0; // c string terminate
-    return numchars;
+    return kODNonceChallengeBytes;
 }
 
 /* -----------------------------------------------------------------
@@ -196,12 +269,101 @@ int od_auth_create_crammd5_challenge(char *outChallenge, int destsize)
 int od_auth_check_crammd5_response(const char *inUserID, const char *inChallenge, 
                                    const char *inResponse)
 {
+	/* a challenge we didn't issue, or one that's been answered before, is a
+	 * replay; there's no need to ask the directory about it */
+	if (kODNonceValid != ODNonceRedeemChallenge(inChallenge))
+		return eDSAuthFailed;
+
 	int iResult =  _od_auth_validate_response( inUserID, inChallenge, inResponse, 
 									           kDSStdAuthCRAM_MD5, 
 											   kValidate_User );
+    if (eDSNoErr == iResult)
+        od_auth_set_cached_auth_method(inUserID, kODAuthMethodCRAMMD5, 1);
+    else if (eDSAuthMethodNotSupported == iResult)
+        od_auth_set_cached_auth_method(inUserID, kODAuthMethodCRAMMD5, 0);
+
     return( iResult );
 } 
 
+/* -----------------------------------------------------------------
+	int od_auth_get_cached_auth_method()
+
+	ARGS:
+		userName (IN) username as a UTF8 string
+		method   (IN) one kODAuthMethod* value
+
+	RETURNS:
+		-1 = not known
+		 0 = method not supported for this user
+		 1 = method supported for this user
+   ----------------------------------------------------------------- */
+int od_auth_get_cached_auth_method(const char *userName, int method)
+{
+	AuthMethodCacheValue value;
+
+	if (userName == NULL)
+		return -1;
+
+	pthread_once(&methodCacheOnce, _od_auth_method_cache_init);
+	if (ODCacheGet(methodCache, userName, strlen(userName), &value, sizeof(value), NULL) != 0)
+		return -1;
+
+	if ((value.known & method) == 0)
+		return -1;
+
+	return (value.supported & method) ? 1 : 0;
+}
+
+/* -----------------------------------------------------------------
+	void od_auth_set_cached_auth_method()
+
+	Record what a probe or a real authentication told us.  A later
+	eDSAuthMethodNotSupported simply overwrites a cached "supported".
+   ----------------------------------------------------------------- */
+void od_auth_set_cached_auth_method(const char *userName, int method, int supported)
+{
+	AuthMethodCacheValue value;
+	size_t userLen;
+
+	if (userName == NULL)
+		return;
+
+	pthread_once(&methodCacheOnce, _od_auth_method_cache_init);
+
+	userLen = strlen(userName);
+	if (ODCacheGet(methodCache, userName, userLen, &value, sizeof(value), NULL) != 0)
+		memset(&value, 0, sizeof(value));
+
+	value.known |= method;
+	if (supported)
+		value.supported |= method;
+	else
+		value.supported &= ~method;
+
+	ODCacheSet(methodCache, userName, userLen, &value, sizeof(value), methodCacheTTL);
+}
+
+void od_auth_configure_auth_method_cache(int maxEntries, int ttl)
+{
+	methodCacheMaxEntries = maxEntries > 0 ? maxEntries : 0;
+	methodCacheTTL = ttl > 0 ? ttl : 0;
+
+	pthread_once(&methodCacheOnce, _od_auth_method_cache_init);
+	ODCacheSetMaxEntries(methodCache, methodCacheMaxEntries);
+}
+
+void od_auth_flush_auth_method_cache(void)
+{
+	pthread_once(&methodCacheOnce, _od_auth_method_cache_init);
+	ODCacheFlush(methodCache);
+}
+
+static void _od_auth_method_cache_init(void)
+{
+	if (ODCacheCreate(methodCacheMaxEntries, &methodCache) != 0)
+		syslog( LOG_ERR, "od_auth: Unable to create auth method cache" );
+}
+
 /* -----------------------------------------------------------------
 	int _od_auth_bytes_to_hex_chars()
 	
@@ -453,31 +615,70 @@ tDirStatus _od_auth_lookup_user ( tDirReference inDirRef,
 } /* _od_auth_lookup_user */
 
 
+/* -----------------------------------------------------------------
+	per-thread directory references, closed when the thread exits
+   ----------------------------------------------------------------- */
+
+static void
+_od_auth_close_directory_references(void *arg)
+{
+	ODAuthDirectoryRefs *refs = (ODAuthDirectoryRefs *) arg;
+
+	if (refs->searchNodeRef != 0)
+		dsCloseDirNode(refs->searchNodeRef);
+	if (refs->dirRef != 0)
+		dsCloseDirService(refs->dirRef);
+	free(refs);
+}
+
+static void
+_od_auth_directory_references_init(void)
+{
+	pthread_key_create(&dirRefsKey, _od_auth_close_directory_references);
+}
+
 int
-od_auth_configure_directory_references()
+od_auth_configure_directory_references(tDirReference *outDirRef, tDirNodeReference *outSearchNodeRef)
 {
 	tDirStatus              dsStatus		= eDSNoErr;
-	
-	if (dirRef != 0 || searchNodeRef != 0) {
-		if (dsVerifyDirRefNum(dirRef) != eDSNoErr) {
-			dsCloseDirNode(searchNodeRef);
-			searchNodeRef = 0;
+	ODAuthDirectoryRefs	*refs			= NULL;
+
+	*outDirRef = 0;
+	*outSearchNodeRef = 0;
 
-			dsCloseDirService(dirRef);
-			dirRef = 0;
+	pthread_once(&dirRefsOnce, _od_auth_directory_references_init);
+
+	refs = (ODAuthDirectoryRefs *) pthread_getspecific(dirRefsKey);
+	if (refs == NULL) {
+		refs = (ODAuthDirectoryRefs *) calloc(1, sizeof(ODAuthDirectoryRefs));
+		if (refs == NULL)
+			return eMemoryAllocError;
+		if (pthread_setspecific(dirRefsKey, refs) != 0) {
+			free(refs);
+			return eMemoryAllocError;
+		}
+	}
+
+	if (refs->dirRef != 0 || refs->searchNodeRef != 0) {
+		if (dsVerifyDirRefNum(refs->dirRef) != eDSNoErr) {
+			dsCloseDirNode(refs->searchNodeRef);
+			refs->searchNodeRef = 0;
+
+			dsCloseDirService(refs->dirRef);
+			refs->dirRef = 0;
 		}
 	}
 
-	if (dirRef == 0) {
-		dsStatus = dsOpenDirService( &dirRef );
+	if (refs->dirRef == 0) {
+		dsStatus = dsOpenDirService( &refs->dirRef );
 		if (! IS_EXPECTED_DS_ERROR(dsStatus)) {
 			syslog( LOG_ERR, "od_auth: Unable to open directory. (Open Directory error: %d)", dsStatus );
 			goto done;
 		}
 	}
 
-	if (searchNodeRef == 0) {
-		dsStatus = _od_auth_get_search_node( dirRef, &searchNodeRef );
+	if (refs->searchNodeRef == 0) {
+		dsStatus = _od_auth_get_search_node( refs->dirRef, &refs->searchNodeRef );
 		if (! IS_EXPECTED_DS_ERROR(dsStatus)) {
 			syslog( LOG_ERR, "od_auth: Unable to open directory search node. (Open Directory error: %d)", dsStatus );
 			goto done;
@@ -485,6 +686,9 @@ od_auth_configure_directory_references()
 	}
 
 done:
+	*outDirRef = refs->dirRef;
+	*outSearchNodeRef = refs->searchNodeRef;
+
 	return dsStatus;
 }
 
@@ -510,6 +714,9 @@ int _od_auth_validate_response ( const char *inUserID, const char *inChallenge,
 	UInt32				uiCurr			= 0;
 	UInt32				uiLen			= 0;
 	int                     logErrors               = kLogErrors_disabled;
+	tDirReference		dirRef			= 0;
+	tDirNodeReference	searchNodeRef		= 0;
+	ODGuardCall		guard;
 	
 	if (kValidate_User == validateType) 
            logErrors = kLogErrors_enabled;
@@ -518,13 +725,17 @@ int _od_auth_validate_response ( const char *inUserID, const char *inChallenge,
 		return( -1 );
 	}
 
+	/* fail fast while the directory is considered down */
+	if (ODGuardBegin(&guard, "dsDoDirNodeAuth") != 0)
+		return( eDSCannotAccessSession );
+
 	uiNameLen = strlen( inUserID );
 	uiChalLen = strlen( inChallenge );
 	uiRespLen = strlen( inResponse );
 
 	uiBuffSzie = uiNameLen + uiChalLen + uiRespLen + 32;
 
-	if (od_auth_configure_directory_references() != eDSNoErr) {
+	if (od_auth_configure_directory_references(&dirRef, &searchNodeRef) != eDSNoErr) {
 		iResult = eDSInvalidReference;
 		goto done;
 	}
@@ -630,6 +841,8 @@ int _od_auth_validate_response ( const char *inUserID, const char *inChallenge,
 
 
 done:
+	ODGuardEnd(&guard, ! IS_EXPECTED_DS_ERROR(iResult));
+
 	if (userLoc != NULL) {
 		free(userLoc);
 		userLoc = NULL;
@@ -651,6 +864,9 @@ int _od_auth_check_user_exists(const char *inUserID)
 	UInt32				uiNameLen		= 0;
 	UInt32				uiBuffSzie		= 0;
 	int                     logErrors               = kLogErrors_disabled;
+	tDirReference		dirRef			= 0;
+	tDirNodeReference	searchNodeRef		= 0;
+	ODGuardCall		guard;
 	
 	if ( (inUserID == NULL) ) {
 		return( -1 );
@@ -664,15 +880,21 @@ int _od_auth_check_user_exists(const char *inUserID)
 	 * All this code does is ask: "If the last time this function was
 	 * called we found that this user exists, then assume the user
 	 * still exists" -- that should be a safe assumption. */
+	pthread_mutex_lock(&userExistsLock);
 	if (*userExists != (char)0 && strcmp(userExists, inUserID) == 0) {
+		pthread_mutex_unlock(&userExistsLock);
 		return 1; // user exists
 	}
+	pthread_mutex_unlock(&userExistsLock);
+
+	if (ODGuardBegin(&guard, "dsGetRecordList") != 0)
+		return( eDSCannotAccessSession );
    
 	uiNameLen = strlen( inUserID );
 
 	uiBuffSzie = uiNameLen + 32;
 
-	if (od_auth_configure_directory_references() != eDSNoErr) {
+	if (od_auth_configure_directory_references(&dirRef, &searchNodeRef) != eDSNoErr) {
 		iResult = eDSInvalidReference;
 		goto done;
 	}
@@ -699,6 +921,7 @@ int _od_auth_check_user_exists(const char *inUserID)
 	}
 
 done:
+	ODGuardEnd(&guard, iResult != 1 && ! IS_EXPECTED_DS_ERROR(iResult));
 
 	if (userLoc != NULL) {
 		free(userLoc);
@@ -707,10 +930,12 @@ done:
 
 	if (iResult == 1) {
 		/* user exists, so cache that result */
+		pthread_mutex_lock(&userExistsLock);
 		if (strlcpy(userExists, inUserID, sizeof(userExists)) >= sizeof(userExists)) {
 			/* something went wrong, user id specified was too long, don't cache it */
 			*userExists = (char)0;
 		}
+		pthread_mutex_unlock(&userExistsLock);
 	}
 
 	return( iResult );
@@ -57,4 +57,41 @@ int od_auth_check_crammd5_response(const char *inUserID, const char *inChallenge
 
 int od_auth_check_service_membership(const char* userName, const char* service);
 
+/* per-user auth method capability cache */
+enum {
+	kODAuthMethodCRAMMD5	= 1 << 0,
+	kODAuthMethodDIGESTMD5	= 1 << 1,
+	kODAuthMethodPlain	= 1 << 2
+};
+
+#define kAuthMethodCacheDefaultSize		4096
+#define kAuthMethodCacheDefaultTTL		600
+
+int od_auth_get_cached_auth_method(const char *userName, int method);
+void od_auth_set_cached_auth_method(const char *userName, int method, int supported);
+void od_auth_configure_auth_method_cache(int maxEntries, int ttl);
+void od_auth_flush_auth_method_cache(void);
+
+/* service membership cache defaults (entries, seconds) */
+#define kMembershipCacheDefaultSize		1024
+#define kMembershipCacheDefaultTTL		300
+#define kMembershipCacheDefaultNegativeTTL	60
+
+void od_auth_configure_membership_cache(int maxEntries, int positiveTTL, int negativeTTL);
+void od_auth_flush_membership_cache(void);
+
+/* directory backends (see apple_backend.c) */
+#define kODAuthBackendDirectory			"directory"
+#define kODAuthBackendSnapshot			"snapshot"
+#define kSnapshotDefaultRefresh			300
+
+int od_auth_configure_backend(const char *name, const char *path, int refreshInterval);
+void od_auth_refresh_backend(void);
+
+/* configuration (see apple_config.c) */
+typedef const char *(*od_auth_config_getter)(void *ctx, const char *key);
+
+void od_auth_configure(od_auth_config_getter get, void *ctx);
+void od_auth_reload(void);
+
 #endif /* __APPLE_AUTHENTICATE_H__ */
@@ -33,6 +33,7 @@
 */
 
 #include "apple_authorize.h"
+#include "apple_authenticate.h"
 
 #include <sys/stat.h>
 #include <membershipPriv.h>
@@ -54,26 +55,8 @@
    ----------------------------------------------------------------- */
 int	od_auth_check_sacl(const char *inUser)
 {
-	uuid_t	user_uuid;
-	
-	int	isMember = 0;
-	int	mbrErr = ENOENT;
-	
-	if( (mbrErr = mbr_user_name_to_uuid(inUser, user_uuid)) != 0)
-	{
-        	return kNotAuthorized;
-	}	
-	
-	if((mbrErr = mbr_check_service_membership(user_uuid, kChatService, &isMember)) != 0)
-	{
-		if(mbrErr == ENOENT){	// no ACL exists
-			return kAuthorized;	
-		} else {
-			return kNotAuthorized;
-		}
-	}
-
-	if(isMember == kAuthorized)
+	/* shares the service membership cache with od_auth_check_service_membership() */
+	if (od_auth_check_service_membership(inUser, kChatService) == 1)
 	{
 		return kAuthorized;
 	} else {
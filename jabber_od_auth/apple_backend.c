@@ -0,0 +1,447 @@
+/*
+ *
+ * Copyright (c) 2012, Apple Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ * 
+*/
+
+#include "apple_authenticate.h"
+#include "apple_backend.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <uuid/uuid.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <OpenDirectory/OpenDirectory.h>
+
+#include <membership.h>
+#include <membershipPriv.h>
+
+#include "odsnapshot.h"
+
+/* -----------------------------------------------------------------
+   Backend table
+
+   "directory" asks Open Directory and membershipd for every answer.
+   "snapshot" answers from a memory-mapped ODSnapshot file and falls
+   back to the directory for users that aren't in it, so a stale
+   snapshot never locks out a newly created user.
+   ----------------------------------------------------------------- */
+
+static int _od_auth_directory_user_exists(const char *userName);
+static int _od_auth_snapshot_user_exists(const char *userName);
+static int _od_auth_snapshot_check_service_membership(const char *userName, const char *service, int *outIsMember);
+static void *_od_auth_snapshot_refresher(void *arg);
+static int _od_auth_snapshot_lock(const char *path);
+static int _od_auth_snapshot_build(const char *path);
+
+static const od_auth_backend	directoryBackend = {
+	kODAuthBackendDirectory,
+	_od_auth_directory_user_exists,
+	_od_auth_directory_check_service_membership
+};
+
+static const od_auth_backend	snapshotBackend = {
+	kODAuthBackendSnapshot,
+	_od_auth_snapshot_user_exists,
+	_od_auth_snapshot_check_service_membership
+};
+
+static const od_auth_backend	*backends[] = { &directoryBackend, &snapshotBackend };
+
+static const od_auth_backend	*currentBackend	= &directoryBackend;
+static ODSnapshot		*snapshot	= NULL;
+static char			*snapshotPath	= NULL;
+static int			snapshotRefresh	= 0;
+static pthread_t		refresherThread;
+
+/* -----------------------------------------------------------------
+    int od_auth_configure_backend()
+
+	ARGS:
+		name            (IN) kODAuthBackendDirectory or kODAuthBackendSnapshot
+		path            (IN) snapshot file (snapshot backend only)
+		refreshInterval (IN) seconds between rebuilding the snapshot
+		                     from the directory; 0 means the file is
+		                     maintained by something else and is only
+		                     re-read when it changes
+
+	RETURNS: int
+		0 = OK
+		-1 = unknown backend or unable to set it up; the directory
+		     backend stays in use
+
+	Call once, before any lookups.
+   ----------------------------------------------------------------- */
+int od_auth_configure_backend(const char *name, const char *path, int refreshInterval)
+{
+	size_t i;
+
+	if (name == NULL)
+		return -1;
+
+	for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+		if (strcmp(backends[i]->name, name) == 0)
+			break;
+
+	if (i == sizeof(backends) / sizeof(backends[0])) {
+		syslog(LOG_ERR, "%s: unknown directory backend \"%s\"", __PRETTY_FUNCTION__, name);
+		return -1;
+	}
+
+	if (backends[i] == &snapshotBackend && snapshot == NULL) {
+		if (path == NULL || *path == '\0') {
+			syslog(LOG_ERR, "%s: no snapshot path configured", __PRETTY_FUNCTION__);
+			return -1;
+		}
+
+		snapshotPath = strdup(path);
+		if (snapshotPath == NULL)
+			return -1;
+		snapshotRefresh = refreshInterval > 0 ? refreshInterval : 0;
+
+		/* the file may not exist yet; lookups go to the directory
+		   until the refresher has written the first snapshot */
+		if (ODSnapshotOpen(snapshotPath, &snapshot) != 0) {
+			syslog(LOG_ERR, "%s: unable to open snapshot %s", __PRETTY_FUNCTION__, snapshotPath);
+			free(snapshotPath);
+			snapshotPath = NULL;
+			return -1;
+		}
+
+		if (snapshotRefresh > 0 && pthread_create(&refresherThread, NULL, _od_auth_snapshot_refresher, NULL) != 0)
+			syslog(LOG_ERR, "%s: unable to start snapshot refresher, %s will not be rebuilt",
+			       __PRETTY_FUNCTION__, snapshotPath);
+		else if (snapshotRefresh > 0)
+			pthread_detach(refresherThread);
+	}
+
+	currentBackend = backends[i];
+	syslog(LOG_USER | LOG_NOTICE, "%s: using the %s directory backend", __PRETTY_FUNCTION__, currentBackend->name);
+
+	return 0;
+}
+
+/* -----------------------------------------------------------------
+    void od_auth_refresh_backend()
+
+	Pick up a new snapshot file now rather than at the next periodic
+	check, e.g. on SIGHUP.
+   ----------------------------------------------------------------- */
+void od_auth_refresh_backend(void)
+{
+	if (snapshot != NULL)
+		ODSnapshotForceRefresh(snapshot);
+}
+
+int od_auth_backend_user_exists(const char *userName)
+{
+	int result = currentBackend->user_exists(userName);
+
+	if (result == -1 && currentBackend != &directoryBackend)
+		result = directoryBackend.user_exists(userName);
+
+	return result;
+}
+
+int od_auth_backend_check_service_membership(const char *userName, const char *service, int *outIsMember)
+{
+	int result = currentBackend->check_service_membership(userName, service, outIsMember);
+
+	if (result == -1 && currentBackend != &directoryBackend)
+		result = directoryBackend.check_service_membership(userName, service, outIsMember);
+
+	return result;
+}
+
+/* -----------------------------------------------------------------
+   directory backend
+   ----------------------------------------------------------------- */
+
+static int _od_auth_directory_user_exists(const char *userName)
+{
+	return _od_auth_check_user_exists(userName);
+}
+
+/* -----------------------------------------------------------------
+   snapshot backend
+   ----------------------------------------------------------------- */
+
+static int _od_auth_snapshot_user_exists(const char *userName)
+{
+	if (userName == NULL)
+		return -1;
+
+	ODSnapshotRefresh(snapshot);
+
+	return ODSnapshotFindUser(snapshot, userName, NULL) == 0 ? 1 : -1;
+}
+
+static int _od_auth_snapshot_check_service_membership(const char *userName, const char *service, int *outIsMember)
+{
+	char group[256];
+
+	if (userName == NULL || service == NULL)
+		return -1;
+
+	if ((size_t)snprintf(group, sizeof(group), "%s%s", kODSnapshotServiceGroupPrefix, service) >= sizeof(group))
+		return -1;
+
+	ODSnapshotRefresh(snapshot);
+
+	return ODSnapshotCheckGroupMembership(snapshot, userName, group, outIsMember);
+}
+
+static void *_od_auth_snapshot_refresher(void *arg)
+{
+	struct stat sb;
+	int lockFd;
+
+	(void)arg;
+
+	for (;;) {
+		/* c2s and the authreg module each have a refresher, but a
+		   build asks membershipd about every user in every service
+		   group, so only the one holding the lock builds; the other
+		   finds a fresh file next time round and just re-reads it */
+		if (stat(snapshotPath, &sb) == 0 && time(NULL) - sb.st_mtime < snapshotRefresh / 2)
+			ODSnapshotForceRefresh(snapshot);
+		else if ((lockFd = _od_auth_snapshot_lock(snapshotPath)) >= 0) {
+			if (stat(snapshotPath, &sb) == 0 && time(NULL) - sb.st_mtime < snapshotRefresh / 2)
+				ODSnapshotForceRefresh(snapshot);
+			else if (_od_auth_snapshot_build(snapshotPath) != 0)
+				syslog(LOG_ERR, "%s: unable to rebuild snapshot %s, keeping the previous one",
+				       __PRETTY_FUNCTION__, snapshotPath);
+			else
+				ODSnapshotForceRefresh(snapshot);
+			close(lockFd);
+		}
+
+		sleep(snapshotRefresh);
+	}
+
+	return NULL;
+}
+
+/* -----------------------------------------------------------------
+    _od_auth_snapshot_lock()
+
+	Take the snapshot's build lock (path.lock) without waiting.
+	Returns the locked descriptor, closing it releases the lock, or
+	-1 when another refresher is building.
+   ----------------------------------------------------------------- */
+static int _od_auth_snapshot_lock(const char *path)
+{
+	char lockPath[1024];
+	int fd;
+
+	if ((size_t)snprintf(lockPath, sizeof(lockPath), "%s.lock", path) >= sizeof(lockPath))
+		return -1;
+
+	fd = open(lockPath, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		syslog(LOG_ERR, "%s: unable to open %s: %s", __PRETTY_FUNCTION__, lockPath, strerror(errno));
+		return -1;
+	}
+
+	if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* -----------------------------------------------------------------
+    _od_auth_snapshot_build()
+
+	Write a snapshot of every user (all short names, with the user's
+	UUID) and every service ACL group.  ACL membership is resolved
+	through membershipd so nested groups come out flattened.
+   ----------------------------------------------------------------- */
+static int _od_auth_snapshot_build(const char *path)
+{
+	int			result		= -1;
+	CFErrorRef		cfError		= NULL;
+	CFArrayRef		cfAttrs		= NULL;
+	ODQueryRef		cfUserQuery	= NULL;
+	ODQueryRef		cfGroupQuery	= NULL;
+	CFArrayRef		cfUsers		= NULL;
+	CFArrayRef		cfGroups	= NULL;
+	ODSnapshotBuilder	*builder	= NULL;
+	uuid_t			*uuids		= NULL;
+	CFArrayRef		*names		= NULL;
+	CFIndex			userCount	= 0;
+	CFIndex			i, j, k;
+	CFTypeRef		attrs[2];
+	char			buf[1024];
+	int			users = 0, groups = 0;
+
+	attrs[0] = kODAttributeTypeRecordName;
+	attrs[1] = kODAttributeTypeGUID;
+	cfAttrs = CFArrayCreate(kCFAllocatorDefault, attrs, 2, &kCFTypeArrayCallBacks);
+	if (cfAttrs == NULL)
+		goto done;
+
+	cfUserQuery = ODQueryCreateWithNodeType(kCFAllocatorDefault, kODNodeTypeAuthentication,
+						kODRecordTypeUsers, NULL, kODMatchAny, NULL,
+						cfAttrs, 0, &cfError);
+	if (cfUserQuery == NULL || cfError != NULL)
+		goto done;
+
+	cfUsers = ODQueryCopyResults(cfUserQuery, false, &cfError);
+	if (cfUsers == NULL || cfError != NULL)
+		goto done;
+
+	cfGroupQuery = ODQueryCreateWithNodeType(kCFAllocatorDefault, kODNodeTypeAuthentication,
+						 kODRecordTypeGroups, kODAttributeTypeRecordName,
+						 kODMatchBeginsWith, CFSTR(kODSnapshotServiceGroupPrefix),
+						 kODAttributeTypeRecordName, 0, &cfError);
+	if (cfGroupQuery == NULL || cfError != NULL)
+		goto done;
+
+	cfGroups = ODQueryCopyResults(cfGroupQuery, false, &cfError);
+	if (cfGroups == NULL || cfError != NULL)
+		goto done;
+
+	if (ODSnapshotBuilderCreate(&builder) != 0)
+		goto done;
+
+	/* every short name of a user shares its UUID and memberships */
+	userCount = CFArrayGetCount(cfUsers);
+	uuids = calloc(userCount + 1, sizeof(*uuids));
+	names = calloc(userCount + 1, sizeof(*names));
+	if (uuids == NULL || names == NULL)
+		goto done;
+
+	for (i = 0; i < userCount; i++) {
+		ODRecordRef cfUser = (ODRecordRef)CFArrayGetValueAtIndex(cfUsers, i);
+		CFArrayRef cfGUIDs = ODRecordCopyValues(cfUser, kODAttributeTypeGUID, NULL);
+		int valid;
+
+		names[i] = ODRecordCopyValues(cfUser, kODAttributeTypeRecordName, NULL);
+		valid = (names[i] != NULL && cfGUIDs != NULL && CFArrayGetCount(cfGUIDs) > 0
+			 && CFGetTypeID(CFArrayGetValueAtIndex(cfGUIDs, 0)) == CFStringGetTypeID()
+			 && CFStringGetCString(CFArrayGetValueAtIndex(cfGUIDs, 0), buf, sizeof(buf), kCFStringEncodingUTF8)
+			 && uuid_parse(buf, uuids[i]) == 0);
+		if (cfGUIDs != NULL)
+			CFRelease(cfGUIDs);
+
+		if (!valid) {
+			if (names[i] != NULL)
+				CFRelease(names[i]);
+			names[i] = NULL;
+			continue;
+		}
+
+		for (j = 0; j < CFArrayGetCount(names[i]); j++) {
+			CFTypeRef cfName = CFArrayGetValueAtIndex(names[i], j);
+			if (CFGetTypeID(cfName) != CFStringGetTypeID()
+			    || !CFStringGetCString(cfName, buf, sizeof(buf), kCFStringEncodingUTF8))
+				continue;
+			if (ODSnapshotBuilderAddUser(builder, buf, uuids[i]) != 0)
+				goto done;
+		}
+		users++;
+	}
+
+	for (i = 0; i < CFArrayGetCount(cfGroups); i++) {
+		ODRecordRef cfGroup = (ODRecordRef)CFArrayGetValueAtIndex(cfGroups, i);
+		CFStringRef cfGroupName = ODRecordGetRecordName(cfGroup);
+		char group[1024];
+
+		if (cfGroupName == NULL || !CFStringGetCString(cfGroupName, group, sizeof(group), kCFStringEncodingUTF8))
+			continue;
+		if (ODSnapshotBuilderAddGroup(builder, group) != 0)
+			goto done;
+		groups++;
+
+		for (k = 0; k < userCount; k++) {
+			int isMember = 0;
+
+			if (names[k] == NULL)
+				continue;
+			if (mbr_check_service_membership(uuids[k], group + strlen(kODSnapshotServiceGroupPrefix), &isMember) != 0
+			    || !isMember)
+				continue;
+
+			for (j = 0; j < CFArrayGetCount(names[k]); j++) {
+				CFTypeRef cfName = CFArrayGetValueAtIndex(names[k], j);
+				if (CFGetTypeID(cfName) != CFStringGetTypeID()
+				    || !CFStringGetCString(cfName, buf, sizeof(buf), kCFStringEncodingUTF8))
+					continue;
+				if (ODSnapshotBuilderAddGroupMember(builder, group, buf) != 0)
+					goto done;
+			}
+		}
+	}
+
+	if (ODSnapshotBuilderWrite(builder, path) != 0)
+		goto done;
+
+	syslog(LOG_USER | LOG_NOTICE, "%s: wrote %s (%d users, %d service groups)",
+	       __PRETTY_FUNCTION__, path, users, groups);
+
+	result = 0;
+
+done:
+	if (cfError != NULL) {
+		syslog(LOG_ERR, "%s: directory query failed (%ld)", __PRETTY_FUNCTION__, (long)CFErrorGetCode(cfError));
+		CFRelease(cfError);
+	}
+	if (names != NULL) {
+		for (i = 0; i < userCount; i++)
+			if (names[i] != NULL)
+				CFRelease(names[i]);
+		free(names);
+	}
+	free(uuids);
+	ODSnapshotBuilderDelete(&builder);
+	if (cfGroups != NULL)
+		CFRelease(cfGroups);
+	if (cfGroupQuery != NULL)
+		CFRelease(cfGroupQuery);
+	if (cfUsers != NULL)
+		CFRelease(cfUsers);
+	if (cfUserQuery != NULL)
+		CFRelease(cfUserQuery);
+	if (cfAttrs != NULL)
+		CFRelease(cfAttrs);
+
+	return result;
+}
@@ -0,0 +1,65 @@
+/*
+ *
+ * Copyright (c) 2012, Apple Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ * 
+*/
+
+#ifndef __APPLE_BACKEND_H__
+#define __APPLE_BACKEND_H__
+
+/* -----------------------------------------------------------------
+   Directory backends
+
+   Every user existence and service membership question asked by
+   apple_authenticate.c and apple_membership.c goes through the
+   current backend.  A backend may decline to answer (return -1),
+   in which case the question is passed on to the directory.
+   ----------------------------------------------------------------- */
+
+typedef struct od_auth_backend {
+	const char	*name;
+
+	/* 1 = user exists, 0 = no such user, -1 = no answer */
+	int		(*user_exists)(const char *userName);
+
+	/* 0 = answered (*outIsMember set), ENOENT = no ACL for the service,
+	   -1 = no answer, any other value is an errno from the lookup */
+	int		(*check_service_membership)(const char *userName, const char *service, int *outIsMember);
+} od_auth_backend;
+
+int od_auth_backend_user_exists(const char *userName);
+int od_auth_backend_check_service_membership(const char *userName, const char *service, int *outIsMember);
+
+/* directory (Open Directory / membershipd) implementations */
+int _od_auth_check_user_exists(const char *inUserID);
+int _od_auth_directory_check_service_membership(const char *userName, const char *service, int *outIsMember);
+
+#endif /* __APPLE_BACKEND_H__ */
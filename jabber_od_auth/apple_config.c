@@ -0,0 +1,166 @@
+/*
+ *
+ * Copyright (c) 2012, Apple Inc. All rights reserved.
+ *
+ * @APPLE_BSD_LICENSE_HEADER_START@
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ * 1.  Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer. 
+ * 2.  Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution. 
+ * 3.  Neither the name of Apple Computer, Inc. ("Apple") nor the names of
+ *     its contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission. 
+ * 
+ * THIS SOFTWARE IS PROVIDED BY APPLE AND ITS CONTRIBUTORS "AS IS" AND ANY
+ * EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL APPLE OR ITS CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ * 
+ * @APPLE_BSD_LICENSE_HEADER_END@
+ * 
+*/
+
+#include "apple_authenticate.h"
+
+#include <stdlib.h>
+#include <syslog.h>
+
+#include "fasterauth.h"
+#include "odkerb.h"
+#include "odckit.h"
+#include "odguard.h"
+#include "odthrottle.h"
+#include "odtoken.h"
+#include "odnonce.h"
+#include "odverifier.h"
+#include "auth_event.h"
+
+/* -----------------------------------------------------------------
+   Configuration shared by every copy of this library
+
+   c2s and the authreg_apple_od module are linked separately against
+   this (static) library, so each has its own caches, backend and
+   circuit breaker.  Both call od_auth_configure() with the same
+   settings and od_auth_reload() on SIGHUP so they behave as one.
+   ----------------------------------------------------------------- */
+
+static int _od_auth_config_int(od_auth_config_getter get, void *ctx, const char *key, int def)
+{
+	const char *value = get(ctx, key);
+
+	return (value != NULL) ? atoi(value) : def;
+}
+
+/* -----------------------------------------------------------------
+    void od_auth_configure()
+
+	ARGS:
+		get (IN) returns the value of a configuration key (relative
+		         to <authreg/> in c2s.xml), or NULL if it isn't set
+		ctx (IN) passed through to get
+
+	Sets up the directory backend, circuit breaker, directory handle
+	pool, auth failure throttle, caches, DIGEST-MD5 session pool,
+	re-auth tokens, outstanding CRAM-MD5 challenges and PLAIN
+	verifiers.
+   ----------------------------------------------------------------- */
+void od_auth_configure(od_auth_config_getter get, void *ctx)
+{
+	const char *backend;
+
+	if (get == NULL)
+		return;
+
+	ODGuardConfigure(
+		_od_auth_config_int(get, ctx, "directory_guard.deadline", kODGuardDefaultDeadline),
+		_od_auth_config_int(get, ctx, "directory_guard.failure-rate", kODGuardDefaultFailureRate),
+		_od_auth_config_int(get, ctx, "directory_guard.min-calls", kODGuardDefaultMinCalls),
+		_od_auth_config_int(get, ctx, "directory_guard.window", kODGuardDefaultWindow),
+		_od_auth_config_int(get, ctx, "directory_guard.open-time", kODGuardDefaultOpenTime));
+
+	FasterAuthenticationSetHandlesPerNode(
+		_od_auth_config_int(get, ctx, "directory_handles.per-node", kFasterAuthDefaultHandlesPerNode));
+
+	ODThrottleConfigure(
+		_od_auth_config_int(get, ctx, "auth_throttle.address.failures", kODThrottleDefaultAddressFailures),
+		_od_auth_config_int(get, ctx, "auth_throttle.address.window", kODThrottleDefaultAddressWindow),
+		_od_auth_config_int(get, ctx, "auth_throttle.user.failures", kODThrottleDefaultUserFailures),
+		_od_auth_config_int(get, ctx, "auth_throttle.user.window", kODThrottleDefaultUserWindow),
+		_od_auth_config_int(get, ctx, "auth_throttle.size", kODThrottleDefaultSize));
+
+	backend = get(ctx, "directory_backend.type");
+	if (backend != NULL
+	    && od_auth_configure_backend(backend, get(ctx, "directory_backend.snapshot.path"),
+					 _od_auth_config_int(get, ctx, "directory_backend.snapshot.refresh", kSnapshotDefaultRefresh)) != 0)
+		syslog(LOG_ERR, "%s: unable to set up the %s directory backend, using the directory", __PRETTY_FUNCTION__, backend);
+
+	od_auth_configure_membership_cache(
+		_od_auth_config_int(get, ctx, "authorization_cache.size", kMembershipCacheDefaultSize),
+		_od_auth_config_int(get, ctx, "authorization_cache.ttl", kMembershipCacheDefaultTTL),
+		_od_auth_config_int(get, ctx, "authorization_cache.negative-ttl", kMembershipCacheDefaultNegativeTTL));
+
+	od_auth_configure_auth_method_cache(
+		_od_auth_config_int(get, ctx, "auth_method_cache.size", kAuthMethodCacheDefaultSize),
+		_od_auth_config_int(get, ctx, "auth_method_cache.ttl", kAuthMethodCacheDefaultTTL));
+
+	odkerb_configure_cache(
+		_od_auth_config_int(get, ctx, "im_handle_cache.size", kODKerbCacheDefaultSize),
+		_od_auth_config_int(get, ctx, "im_handle_cache.ttl", kODKerbCacheDefaultTTL),
+		_od_auth_config_int(get, ctx, "im_handle_cache.negative-ttl", kODKerbCacheDefaultNegativeTTL));
+
+	ODCKConfigureSessionPool(
+		_od_auth_config_int(get, ctx, "digest_session_pool.size", kODCKDefaultSessionPoolSize));
+
+	ODTokenConfigure(
+		_od_auth_config_int(get, ctx, "reauth_token.lifetime", kODTokenDefaultLifetime),
+		_od_auth_config_int(get, ctx, "reauth_token.size", kODTokenDefaultSize));
+
+	ODNonceConfigure(
+		_od_auth_config_int(get, ctx, "challenge_cache.ttl", kODNonceDefaultTTL),
+		_od_auth_config_int(get, ctx, "challenge_cache.size", kODNonceDefaultSize));
+
+	ODVerifierConfigure(
+		_od_auth_config_int(get, ctx, "plain_cache.size", kODVerifierDefaultSize),
+		_od_auth_config_int(get, ctx, "plain_cache.revalidate", kODVerifierDefaultRevalidate),
+		_od_auth_config_int(get, ctx, "plain_cache.max-stale", kODVerifierDefaultMaxStale),
+		_od_auth_config_int(get, ctx, "plain_cache.cost", kODVerifierDefaultCost));
+}
+
+/* -----------------------------------------------------------------
+    void od_auth_reload()
+
+	Pick up SACL and directory changes: flush the caches, PLAIN
+	verifiers and the DIGEST-MD5 session pool, re-read the snapshot
+	and log the directory call, auth throttle, session pool, re-auth
+	token, challenge, verifier and auth event counters.  Throttled
+	clients stay throttled and issued tokens and challenges stay
+	valid.
+   ----------------------------------------------------------------- */
+void od_auth_reload(void)
+{
+	od_auth_flush_membership_cache();
+	od_auth_flush_auth_method_cache();
+	odkerb_flush_cache();
+	ODVerifierFlush();
+	ODCKFlushSessionPool();
+	od_auth_refresh_backend();
+	ODGuardLogStats();
+	ODThrottleLogStats();
+	ODCKLogSessionPoolStats();
+	ODTokenLogStats();
+	ODNonceLogStats();
+	ODVerifierLogStats();
+	auth_event_log_stats();
+}
@@ -39,6 +39,7 @@
 #include <Security/checkpw.h>
 
 #include <syslog.h>
+#include <pthread.h>
 #include <CoreServices/CoreServices.h>
 
 #include <CoreFoundation/CFData.h>
@@ -54,6 +55,73 @@
 #include <membership.h>
 #include <membershipPriv.h>
 
+#include "odcache.h"
+#include "apple_backend.h"
+#include "odguard.h"
+
+/* -----------------------------------------------------------------
+   Service membership cache
+
+   Every login asks membershipd the same (user, service) question, and
+   with SASL c2s asks it twice.  Members and "no ACL" answers are kept
+   for the positive TTL, non-members for the (shorter) negative TTL.
+   Lookup errors are never cached.
+   ----------------------------------------------------------------- */
+
+static pthread_once_t		cacheOnce	= PTHREAD_ONCE_INIT;
+static ODCache			*cache		= NULL;
+static int			cacheMaxEntries	= kMembershipCacheDefaultSize;
+static int			cachePositiveTTL = kMembershipCacheDefaultTTL;
+static int			cacheNegativeTTL = kMembershipCacheDefaultNegativeTTL;
+
+static int _od_auth_check_service_membership(const char* userName, const char* service, int *outCacheable);
+
+static void
+MembershipCacheInit(void)
+{
+	if (ODCacheCreate(cacheMaxEntries, &cache) != 0)
+		syslog(LOG_ERR, "%s: unable to create membership cache", __PRETTY_FUNCTION__);
+}
+
+/* -----------------------------------------------------------------
+    void od_auth_configure_membership_cache()
+
+	ARGS:
+		maxEntries  (IN) cache size; 0 disables caching
+		positiveTTL (IN) seconds to remember "is member" / "no ACL"
+		negativeTTL (IN) seconds to remember "is not a member"
+
+	Changing the configuration flushes the cache.
+   ----------------------------------------------------------------- */
+void od_auth_configure_membership_cache(int maxEntries, int positiveTTL, int negativeTTL)
+{
+	cacheMaxEntries = maxEntries > 0 ? maxEntries : 0;
+	cachePositiveTTL = positiveTTL > 0 ? positiveTTL : 0;
+	cacheNegativeTTL = negativeTTL > 0 ? negativeTTL : 0;
+
+	pthread_once(&cacheOnce, MembershipCacheInit);
+	ODCacheSetMaxEntries(cache, cacheMaxEntries);
+}
+
+/* -----------------------------------------------------------------
+    void od_auth_flush_membership_cache()
+
+	Forget every cached membership decision, e.g. after the SACL
+	or group membership has been changed by an administrator.
+   ----------------------------------------------------------------- */
+void od_auth_flush_membership_cache(void)
+{
+	ODCacheStats stats;
+
+	pthread_once(&cacheOnce, MembershipCacheInit);
+	if (ODCacheGetStats(cache, &stats) != 0)
+		return;
+	ODCacheFlush(cache);
+
+	syslog(LOG_USER | LOG_NOTICE, "%s: flushed %d entries (hits: %lu, misses: %lu)",
+	       __PRETTY_FUNCTION__, stats.entries, stats.hits, stats.misses);
+}
+
 /* -----------------------------------------------------------------
     int od_auth_check_service_membership()
     
@@ -65,30 +133,65 @@
 		0 = Failed: user is not a service member OR unable to access service ACL
 		1 = OK: user is a member OR no restrictions for the selected service
 
+	Answers are served from the membership cache when possible.
    ----------------------------------------------------------------- */
 int od_auth_check_service_membership(const char* userName, const char* service)
 {
+	char keyBuf[512];
+	char *key = keyBuf;
+	size_t userLen, keyLen;
+	int result = 0;
+	int cacheable = 0;
+
+	if (userName == NULL || service == NULL)
+		return 0;
+
+	pthread_once(&cacheOnce, MembershipCacheInit);
+
+	/* key is "user\0service" */
+	userLen = strlen(userName);
+	keyLen = userLen + 1 + strlen(service);
+	if (keyLen > sizeof(keyBuf) && (key = malloc(keyLen)) == NULL)
+		return _od_auth_check_service_membership(userName, service, &cacheable);
+	memcpy(key, userName, userLen + 1);
+	memcpy(key + userLen + 1, service, keyLen - userLen - 1);
+
+	if (ODCacheGet(cache, key, keyLen, &result, sizeof(result), NULL) == 0)
+		goto done;
+
+	result = _od_auth_check_service_membership(userName, service, &cacheable);
+	if (cacheable)
+		ODCacheSet(cache, key, keyLen, &result, sizeof(result), result ? cachePositiveTTL : cacheNegativeTTL);
+
+done:
+	if (key != keyBuf)
+		free(key);
+
+	return result;
+}
+
+/* -----------------------------------------------------------------
+    _od_auth_check_service_membership()
+
+	Uncached lookup through the configured directory backend.
+	*outCacheable is set when the backend gave an answer rather
+	than an error.
+   ----------------------------------------------------------------- */
+static int _od_auth_check_service_membership(const char* userName, const char* service, int *outCacheable)
+{
+	*outCacheable = 0;
+
 	syslog(LOG_USER | LOG_NOTICE, "%s: checking user \"%s\" access for service \"%s\"", 
 	       __PRETTY_FUNCTION__, userName, service);
 
-	// get the uuid for the user
-	int mbrErr = 0;
-	uuid_t user_uuid;
-	if (mbrErr = mbr_user_name_to_uuid(userName, user_uuid)){
-		syslog(LOG_ERR, "%s: mbr_user_name_to_uuid returns %s", __PRETTY_FUNCTION__, strerror(mbrErr));
-		return 0;
-	}	
-	
 	// First check whether there is a access list defined for the service. If 
 	// none exists, then all users are permitted to access the service.
 	int isMember = 0;
-	mbrErr = mbr_check_service_membership(user_uuid, service, &isMember);
-	syslog(LOG_USER | LOG_NOTICE, "%s: mbr_check_service_membership returned %d", __PRETTY_FUNCTION__, mbrErr);
+	int mbrErr = od_auth_backend_check_service_membership(userName, service, &isMember);
 	if (0 != mbrErr) {
 		if (mbrErr == ENOENT)	// no ACL exists
 			syslog(LOG_USER | LOG_NOTICE, "%s: no access restrictions found", __PRETTY_FUNCTION__);
-		else
-			syslog(LOG_ERR, "%s: mbr_check_service_membership returns %s", __PRETTY_FUNCTION__, strerror(mbrErr));
+		*outCacheable = (mbrErr == ENOENT);
 		return (mbrErr == ENOENT) ? 1 : 0;
 	}
 
@@ -96,5 +199,42 @@ int od_auth_check_service_membership(const char* userName, const char* service)
 	syslog(LOG_ERR, "%s: user \"%s\" %s authorized to access service \"%s\"", 
 		   __PRETTY_FUNCTION__, userName, (1 == isMember ? "is" : "is not"), service);
 
+	*outCacheable = 1;
 	return (1 == isMember) ? 1 : 0;
 }
+
+/* -----------------------------------------------------------------
+    _od_auth_directory_check_service_membership()
+
+	Directory backend: ask membershipd.  Returns 0 with *outIsMember
+	set, ENOENT when the service has no ACL, or an errno.  A user
+	name membershipd can't resolve is not a member; ENOENT only ever
+	means the service has no ACL.
+   ----------------------------------------------------------------- */
+int _od_auth_directory_check_service_membership(const char* userName, const char* service, int *outIsMember)
+{
+	ODGuardCall guard;
+	if (ODGuardBegin(&guard, "mbr_check_service_membership") != 0)
+		return EAGAIN;
+
+	// get the uuid for the user
+	int mbrErr = 0;
+	uuid_t user_uuid;
+	if (mbrErr = mbr_user_name_to_uuid(userName, user_uuid)){
+		syslog(LOG_ERR, "%s: mbr_user_name_to_uuid returns %s", __PRETTY_FUNCTION__, strerror(mbrErr));
+		ODGuardEnd(&guard, mbrErr != ENOENT);
+		if (mbrErr == ENOENT) {
+			*outIsMember = 0;
+			return 0;
+		}
+		return mbrErr;
+	}	
+	
+	mbrErr = mbr_check_service_membership(user_uuid, service, outIsMember);
+	syslog(LOG_USER | LOG_NOTICE, "%s: mbr_check_service_membership returned %d", __PRETTY_FUNCTION__, mbrErr);
+	if (0 != mbrErr && ENOENT != mbrErr)
+		syslog(LOG_ERR, "%s: mbr_check_service_membership returns %s", __PRETTY_FUNCTION__, strerror(mbrErr));
+
+	ODGuardEnd(&guard, mbrErr != 0 && mbrErr != ENOENT);
+	return mbrErr;
+}
@@ -36,10 +36,69 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "auth_event.h"
 
 #include <CoreDaemon/CoreDaemon.h>
 
+/*
+ * Auth events are logged from the c2s main loop on every authentication
+ * attempt, so they are not written there.  Callers copy the event into a
+ * fixed-size record in a bounded lock-free ring and return; a writer thread
+ * drains the ring in batches and does the syslog and event port work.  If
+ * the ring is full (a brute-force burst faster than syslog can take it)
+ * the event is dropped and counted rather than blocking the caller.
+ *
+ * The ring is the usual bounded MPMC queue with a sequence number per
+ * slot: a producer claims a slot by advancing the tail with a compare and
+ * swap, fills it and publishes it by setting the slot's sequence.  There
+ * is only one consumer, the writer thread.
+ */
+
+#define AUTH_EVENT_QUEUE_SIZE       1024    /* records, must be a power of two */
+#define AUTH_EVENT_QUEUE_MASK       (AUTH_EVENT_QUEUE_SIZE - 1)
+#define AUTH_EVENT_BATCH_SIZE       64
+#define AUTH_EVENT_IDLE_WAIT        100     /* ms, bounds a missed wakeup */
+#define AUTH_EVENT_DROP_LOG_INTERVAL 60     /* seconds */
+
+typedef struct auth_event_record_st {
+    unsigned long   seq;
+    int             status;
+    unsigned int    client_port;
+    char            client_ip[64];
+    char            mech[32];
+    char            username[256];
+} auth_event_record;
+
+static auth_event_record    g_queue[AUTH_EVENT_QUEUE_SIZE];
+static unsigned long        g_queue_tail = 0;       /* next slot to claim */
+static unsigned long        g_queue_head = 0;       /* next slot to drain, writer only */
+static unsigned long        g_queue_drained = 0;    /* head after the last batch was written */
+
+static unsigned long        g_events_queued = 0;
+static unsigned long        g_events_logged = 0;
+static unsigned long        g_events_dropped = 0;
+
+static pthread_once_t       g_writer_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t      g_writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t       g_writer_cond = PTHREAD_COND_INITIALIZER;
+static int                  g_writer_running = 0;
+static int                  g_writer_idle = 0;
+static int                  g_writer_stop = 0;      /* protected by g_writer_lock */
+static pthread_t            g_writer_thread;
+
+static void _auth_event_start_writer(void);
+static void _auth_event_stop_writer(void);
+static void *_auth_event_writer(void *arg);
+static int _auth_event_enqueue(const char *username, const char *client_ip, unsigned int client_port, const char *mech, int status);
+static int _auth_event_dequeue(auth_event_record *batch, int max);
+static void _auth_event_write(const auth_event_record *rec);
+static void _auth_event_copy(char *dst, const char *src, size_t size);
+
 void auth_event_data_init(auth_event_data_t *data, char *client_ip, unsigned int client_port, char *mech)
 {
     if (client_ip == NULL || mech == NULL) {
@@ -74,104 +133,303 @@ void auth_event_data_dispose(auth_event_data_t *data)
 
 void auth_event_log_simple(char *username, char *client_ip, unsigned int client_port, char *mech, int status)
 {
-    // First, log the event
-    char log_buf[1024];
-
-    if (status == eAuthFailure)
-        snprintf(log_buf, sizeof(log_buf), "Authentication failed, mech: %s client IP: %s client port: %d username: %s",
-                (mech == NULL) ? "?" : mech,
-                (client_ip == NULL) ? "?" : client_ip,
-                client_port,
-                (username == NULL) ? "?" : username);
-    else if (status == eAuthSuccess)
-        snprintf(log_buf, sizeof(log_buf), "Authentication succeeded, mech: %s client IP: %s client port: %d username: %s",
-                (mech == NULL) ? "?" : mech,
-                (client_ip == NULL) ? "?" : client_ip,
-                client_port,
-                (username == NULL) ? "?" : username);
-    else
+    if (status != eAuthFailure && status != eAuthSuccess)
         return;
 
-    syslog(LOG_NOTICE, "%s", log_buf);
-    
-    // Now send an event for emond/Adaptive Firewall handling
-    send_server_event(status, client_ip);
+    _auth_event_enqueue(username, client_ip, client_port, mech, status);
     return;
 }
 
 void auth_event_log(auth_event_data_t data)
 {
-    // First, log the event
-    char log_buf[1024];
-
-    if (data->status == eAuthFailure)
-        snprintf(log_buf, sizeof(log_buf), "Authentication failed, mech: %s client IP: %s client port: %d username: %s",
-                (data->mech == NULL) ? "?" : data->mech,
-                (data->client_ip == NULL) ? "?" : data->client_ip,
-                data->client_port,
-                (data->username == NULL) ? "?" : data->username);
-    else if (data->status == eAuthSuccess)
-        snprintf(log_buf, sizeof(log_buf), "Authentication succeeded, mech: %s client IP: %s client port: %d username: %s",
-                (data->mech == NULL) ? "?" : data->mech,
-                (data->client_ip == NULL) ? "?" : data->client_ip,
-                data->client_port,
-                (data->username == NULL) ? "?" : data->username);
+    if (data == NULL)
+        return;
+
+    auth_event_log_simple(data->username, data->client_ip, data->client_port, data->mech, data->status);
+    return;
+}
+
+/* wait (up to timeout ms) for the writer to catch up with the ring */
+int auth_event_flush(int timeout)
+{
+    unsigned long tail;
+    int waited = 0;
+
+    if (!__atomic_load_n(&g_writer_running, __ATOMIC_ACQUIRE))
+        return 0;
+
+    tail = __atomic_load_n(&g_queue_tail, __ATOMIC_ACQUIRE);
+    while ((long)(tail - __atomic_load_n(&g_queue_drained, __ATOMIC_ACQUIRE)) > 0) {
+        if (waited >= timeout)
+            return -1;
+        pthread_mutex_lock(&g_writer_lock);
+        pthread_cond_signal(&g_writer_cond);
+        pthread_mutex_unlock(&g_writer_lock);
+        usleep(10 * 1000);
+        waited += 10;
+    }
+
+    return 0;
+}
+
+void auth_event_get_stats(auth_event_stats *stats)
+{
+    if (stats == NULL)
+        return;
+
+    stats->queued = __atomic_load_n(&g_events_queued, __ATOMIC_RELAXED);
+    stats->logged = __atomic_load_n(&g_events_logged, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&g_events_dropped, __ATOMIC_RELAXED);
+}
+
+void auth_event_log_stats(void)
+{
+    auth_event_stats stats;
+
+    auth_event_get_stats(&stats);
+    /* nothing to say in processes that never authenticate anyone */
+    if (stats.queued == 0 && stats.dropped == 0)
+        return;
+
+    syslog(LOG_NOTICE, "auth events: %lu queued, %lu logged, %lu dropped",
+           stats.queued, stats.logged, stats.dropped);
+}
+
+static void _auth_event_start_writer(void)
+{
+    int i;
+
+    for (i = 0; i < AUTH_EVENT_QUEUE_SIZE; ++i)
+        g_queue[i].seq = i;
+
+    if (pthread_create(&g_writer_thread, NULL, _auth_event_writer, NULL) == 0)
+        __atomic_store_n(&g_writer_running, 1, __ATOMIC_RELEASE);
     else
+        syslog(LOG_ERR, "auth events: unable to start writer thread (%s), logging synchronously", strerror(errno));
+}
+
+/* ask the writer to finish what it's doing and wait for it; events logged
+ * afterwards are written synchronously */
+static void _auth_event_stop_writer(void)
+{
+    if (!__atomic_exchange_n(&g_writer_running, 0, __ATOMIC_ACQ_REL))
         return;
 
-    syslog(LOG_NOTICE, "%s", log_buf);
+    pthread_mutex_lock(&g_writer_lock);
+    g_writer_stop = 1;
+    pthread_cond_signal(&g_writer_cond);
+    pthread_mutex_unlock(&g_writer_lock);
+
+    pthread_join(g_writer_thread, NULL);
+}
+
+static int _auth_event_enqueue(const char *username, const char *client_ip, unsigned int client_port, const char *mech, int status)
+{
+    auth_event_record *rec;
+    unsigned long pos, seq;
+    long diff;
+
+    pthread_once(&g_writer_once, _auth_event_start_writer);
+
+    if (!__atomic_load_n(&g_writer_running, __ATOMIC_ACQUIRE)) {
+        auth_event_record local;
+
+        local.status = status;
+        local.client_port = client_port;
+        _auth_event_copy(local.client_ip, client_ip, sizeof(local.client_ip));
+        _auth_event_copy(local.mech, mech, sizeof(local.mech));
+        _auth_event_copy(local.username, username, sizeof(local.username));
+        _auth_event_write(&local);
+        return 0;
+    }
+
+    pos = __atomic_load_n(&g_queue_tail, __ATOMIC_RELAXED);
+    for (;;) {
+        rec = &g_queue[pos & AUTH_EVENT_QUEUE_MASK];
+        seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+        diff = (long)(seq - pos);
+        if (diff == 0) {
+            /* free slot; on failure pos is reloaded with the current tail */
+            if (__atomic_compare_exchange_n(&g_queue_tail, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0) {
+            /* the writer hasn't drained this slot yet: full */
+            __atomic_fetch_add(&g_events_dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        }
+        else
+            pos = __atomic_load_n(&g_queue_tail, __ATOMIC_RELAXED);
+    }
+
+    rec->status = status;
+    rec->client_port = client_port;
+    _auth_event_copy(rec->client_ip, client_ip, sizeof(rec->client_ip));
+    _auth_event_copy(rec->mech, mech, sizeof(rec->mech));
+    _auth_event_copy(rec->username, username, sizeof(rec->username));
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&g_events_queued, 1, __ATOMIC_RELAXED);
+
+    /* pairs with the writer setting g_writer_idle before its last look at the ring */
+    if (__atomic_load_n(&g_writer_idle, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&g_writer_lock);
+        pthread_cond_signal(&g_writer_cond);
+        pthread_mutex_unlock(&g_writer_lock);
+    }
+
+    return 0;
+}
+
+/* writer thread only */
+static int _auth_event_dequeue(auth_event_record *batch, int max)
+{
+    auth_event_record *rec;
+    int n = 0;
+
+    while (n < max) {
+        rec = &g_queue[g_queue_head & AUTH_EVENT_QUEUE_MASK];
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != g_queue_head + 1)
+            break;
+        memcpy(&batch[n++], rec, sizeof(*rec));
+        /* hand the slot back to producers for the next lap */
+        __atomic_store_n(&rec->seq, g_queue_head + AUTH_EVENT_QUEUE_SIZE, __ATOMIC_RELEASE);
+        ++g_queue_head;
+    }
+
+    return n;
+}
+
+static void *_auth_event_writer(void *arg)
+{
+    static auth_event_record batch[AUTH_EVENT_BATCH_SIZE];
+    unsigned long dropped, reported = 0;
+    time_t lastReport = 0, now;
+    struct timeval tv;
+    struct timespec deadline;
+    int i, n;
+
+    (void)arg;
+
+    for (;;) {
+        n = _auth_event_dequeue(batch, AUTH_EVENT_BATCH_SIZE);
+        for (i = 0; i < n; ++i)
+            _auth_event_write(&batch[i]);
+        if (n > 0) {
+            __atomic_fetch_add(&g_events_logged, n, __ATOMIC_RELAXED);
+            __atomic_store_n(&g_queue_drained, g_queue_head, __ATOMIC_RELEASE);
+        }
+
+        now = time(NULL);
+        dropped = __atomic_load_n(&g_events_dropped, __ATOMIC_RELAXED);
+        if (dropped != reported && now - lastReport >= AUTH_EVENT_DROP_LOG_INTERVAL) {
+            syslog(LOG_WARNING, "auth events: queue full, %lu events dropped (%lu total)", dropped - reported, dropped);
+            reported = dropped;
+            lastReport = now;
+        }
+
+        if (n == AUTH_EVENT_BATCH_SIZE)
+            continue;
+
+        pthread_mutex_lock(&g_writer_lock);
+        if (g_writer_stop) {
+            pthread_mutex_unlock(&g_writer_lock);
+            break;
+        }
+        __atomic_store_n(&g_writer_idle, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&g_queue[g_queue_head & AUTH_EVENT_QUEUE_MASK].seq, __ATOMIC_SEQ_CST) != g_queue_head + 1) {
+            gettimeofday(&tv, NULL);
+            deadline.tv_sec = tv.tv_sec;
+            deadline.tv_nsec = tv.tv_usec * 1000 + AUTH_EVENT_IDLE_WAIT * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+                deadline.tv_nsec %= 1000000000L;
+            }
+            pthread_cond_timedwait(&g_writer_cond, &g_writer_lock, &deadline);
+        }
+        __atomic_store_n(&g_writer_idle, 0, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&g_writer_lock);
+    }
+
+    return NULL;
+}
+
+static void _auth_event_write(const auth_event_record *rec)
+{
+    const char *username = rec->username[0] ? rec->username : "?";
+    const char *mech = rec->mech[0] ? rec->mech : "?";
+    const char *client_ip = rec->client_ip[0] ? rec->client_ip : "?";
+
+    // First, log the event
+    syslog(LOG_NOTICE, "Authentication %s, mech: %s client IP: %s client port: %d username: %s",
+           rec->status == eAuthSuccess ? "succeeded" : "failed",
+           mech, client_ip, rec->client_port, username);
 
     // Now send an event for emond/Adaptive Firewall handling
-    send_server_event(data->status, data->client_ip);
-    return;
+    if (rec->client_ip[0])
+        send_server_event(rec->status, rec->client_ip);
+}
+
+static void _auth_event_copy(char *dst, const char *src, size_t size)
+{
+    if (src == NULL)
+        *dst = '\0';
+    else
+        strlcpy(dst, src, size);
 }
 
-char g_client_addr[16] = "";
+char g_client_addr[64] = "";
 XSEventPortRef	gEventPort = NULL;
 
+/* the address of the last event, reused while one client keeps failing */
+static CFStringRef	g_cfstr_addr = NULL;
+
 /* send server events
  *	event code 1: authentication failure
  *  event code 2: authentication success
+ *
+ *  Called from the auth event writer thread.
  */
 
 void send_server_event ( const eEventCode in_event_code, const char *in_addr )
 {
 	CFTypeRef keys[2];
 	CFTypeRef values[2];
-	CFStringRef cfstr_addr = NULL;
 	CFStringRef cfstr_event = NULL;
 
     if (in_addr == NULL)
         return;
 
-	if ( !strlen(g_client_addr) || (strcmp(g_client_addr, in_addr) != 0) ) {
-		strlcpy(g_client_addr, in_addr, sizeof g_client_addr);
-	}
-
-	/* create a port to the event server */
-	if ( gEventPort == NULL )
-		gEventPort = XSEventPortCreate(nil);
-
-	keys[0] = CFSTR("eventType");
-	keys[1] = CFSTR("host_address");
-
 	/* set event code string */
 	switch ( in_event_code ) {
 		case eAuthFailure:
-			cfstr_event = CFStringCreateWithCString(NULL, "auth.failure", kCFStringEncodingMacRoman);
+			cfstr_event = CFSTR("auth.failure");
 			break;
 		case eAuthSuccess:
-			cfstr_event = CFStringCreateWithCString(NULL, "auth.success", kCFStringEncodingMacRoman);
+			cfstr_event = CFSTR("auth.success");
 			break;
 		default:
 			syslog(LOG_WARNING, "Warning: unknown sever event: %d", in_event_code);
 			return;
 	}
 
-	cfstr_addr = CFStringCreateWithCString(NULL, in_addr, kCFStringEncodingMacRoman);
+	if ( g_cfstr_addr == NULL || (strcmp(g_client_addr, in_addr) != 0) ) {
+		if ( g_cfstr_addr != NULL )
+			CFRelease(g_cfstr_addr);
+		strlcpy(g_client_addr, in_addr, sizeof g_client_addr);
+		g_cfstr_addr = CFStringCreateWithCString(NULL, in_addr, kCFStringEncodingMacRoman);
+		if ( g_cfstr_addr == NULL )
+			return;
+	}
+
+	/* create a port to the event server */
+	if ( gEventPort == NULL )
+		gEventPort = XSEventPortCreate(nil);
+
+	keys[0] = CFSTR("eventType");
+	keys[1] = CFSTR("host_address");
 
 	values[0] = cfstr_event;
-	values[1] = cfstr_addr;
+	values[1] = g_cfstr_addr;
 
      CFDictionaryRef dict_event = CFDictionaryCreate(NULL, keys, values, 
                                                sizeof(keys) / sizeof(keys[0]), 
@@ -181,14 +439,19 @@ void send_server_event ( const eEventCode in_event_code, const char *in_addr )
 	/* send the event */
 	(void)XSEventPortPostEvent(gEventPort, cfstr_event, dict_event);
 
-	CFRelease(cfstr_addr);
-	CFRelease(cfstr_event);
 	CFRelease(dict_event);
 } /* send_server_event */
 
 
 void close_server_event_port ( void )
 {
-	if ( gEventPort != NULL )
+	/* let the writer post what is already queued, then make sure it's
+	   done with the port before it goes away */
+	auth_event_flush(1000);
+	_auth_event_stop_writer();
+
+	if ( gEventPort != NULL ) {
 		XSEventPortDelete(gEventPort);
-} /* close_server_event_port */
\ No newline at end of file
+		gEventPort = NULL;
+	}
+} /* close_server_event_port */
@@ -47,6 +47,12 @@ typedef enum {
 	eAuthSuccess		= 2
 } eEventCode;
 
+typedef struct auth_event_stats_st {
+	unsigned long	queued;		/* accepted into the queue */
+	unsigned long	logged;		/* written to syslog and the event port */
+	unsigned long	dropped;	/* lost because the queue was full */
+} auth_event_stats;
+
 void auth_event_data_init(auth_event_data_t *data, char *client_ip, unsigned int client_port, char *mech);
 void auth_event_data_dispose(auth_event_data_t *data);
 void auth_event_log(auth_event_data_t data);
@@ -54,3 +60,9 @@ void auth_event_log_simple(char *username, char *client_ip, unsigned int client_
 void send_server_event(const eEventCode in_code, const char *in_addr);
 void close_server_event_port(void);
 
+/* auth_event_log and auth_event_log_simple only queue the event; these
+   report on and wait for the writer thread */
+int auth_event_flush(int timeout);
+void auth_event_get_stats(auth_event_stats *stats);
+void auth_event_log_stats(void);
+
@@ -38,10 +38,13 @@
  * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+
 #include <string.h>
+#include <strings.h>
 #include "cyrus-sasl-digestmd5-parse.h"
 
-/* this code taken from cyrus-sasl */
+/* the grammar follows get_pair() from cyrus-sasl, but works on slices of
+   the caller's buffer instead of cutting it up in place */
 
 #define HT	(9)
 #define CR	(13)
@@ -49,154 +52,184 @@
 #define SP	(32)
 #define DEL	(127)
 
-static char *skip_lws (char *s)
-{
-    if (!s) return NULL;
-    
-    /* skipping spaces: */
-    while (s[0] == ' ' || s[0] == HT || s[0] == CR || s[0] == LF) {
-	if (s[0] == '\0') break;
-	s++;
-    }  
-    
-    return s;
-}
+static const char *skip_lws(const char *s, const char *end);
+static const char *skip_token(const char *s, const char *end);
+static int is_separator(unsigned char c);
 
-static char *skip_token (char *s, int caseinsensitive)
+static const char *
+skip_lws(const char *s, const char *end)
 {
-    if(!s) return NULL;
-    
-    while (s[0]>SP) {
-	if (s[0]==DEL || s[0]=='(' || s[0]==')' || s[0]=='<' || s[0]=='>' ||
-	    s[0]=='@' || s[0]==',' || s[0]==';' || s[0]==':' || s[0]=='\\' ||
-	    s[0]=='\'' || s[0]=='/' || s[0]=='[' || s[0]==']' || s[0]== '?' ||
-	    s[0]=='=' || s[0]== '{' || s[0]== '}') {
-	    if (caseinsensitive == 1) {
-		if (!isupper((unsigned char) s[0]))
-		    break;
-	    } else {
-		break;
-	    }
-	}
-	s++;
-    }  
+    while (s < end && (*s == SP || *s == HT || *s == CR || *s == LF))
+        s++;
+
     return s;
 }
 
-/* NULL - error (unbalanced quotes), 
-   otherwise pointer to the first character after the value.
-   The function performs work in place. */
-static char *unquote (char *qstr)
+static int
+is_separator(unsigned char c)
 {
-    char *endvalue;
-    int   escaped = 0;
-    char *outptr;
-    
-    if(!qstr) return NULL;
-    
-    if (qstr[0] == '"') {
-	qstr++;
-	outptr = qstr;
-	
-	for (endvalue = qstr; endvalue[0] != '\0'; endvalue++, outptr++) {
-	    if (escaped) {
-		outptr[0] = endvalue[0];
-		escaped = 0;
-	    }
-	    else if (endvalue[0] == '\\') {
-		escaped = 1;
-		outptr--; /* Will be incremented at the end of the loop */
-	    }
-	    else if (endvalue[0] == '"') {
-		break;
-	    }      
-	    else {
-		outptr[0] = endvalue[0];      
-	    }
-	}
-	
-	if (endvalue[0] != '"') {
-	    return NULL;
-	}
-	
-	while (outptr <= endvalue) {
-	    outptr[0] = '\0';
-	    outptr++;
-	}
-	endvalue++;
+    switch (c) {
+    case '(': case ')': case '<': case '>': case '@':
+    case ',': case ';': case ':': case '\\': case '"':
+    case '/': case '[': case ']': case '?': case '=':
+    case '{': case '}': case '\'':
+        return 1;
     }
-    else { /* not qouted value (token) */
-	/* qstr already contains output */
-	endvalue = skip_token(qstr,0);
-    };
-    
-    return endvalue;  
+
+    return 0;
 }
 
-static void get_pair(char **in, char **name, char **value)
+static const char *
+skip_token(const char *s, const char *end)
 {
-    char  *endpair;
-    char  *curp = *in;
-    *name = NULL;
-    *value = NULL;
-
-    if (curp == NULL) return;
-    if (curp[0] == '\0') return;
-
-    /* skipping spaces: */
-    curp = skip_lws(curp);
+    while (s < end) {
+        unsigned char c = (unsigned char) *s;
 
-    *name = curp;
-
-    curp = skip_token(curp,1);
+        if (c <= SP || c >= DEL || is_separator(c))
+            break;
+        s++;
+    }
 
-    /* strip wierd chars */
-    if (curp[0] != '=' && curp[0] != '\0') {
-    *curp++ = '\0';
-    };
+    return s;
+}
 
-    curp = skip_lws(curp);
+void
+ODKDigestParserInit(ODKDigestParser *parser, const char *in, size_t inLen)
+{
+    parser->cur = in;
+    parser->end = in + inLen;
+}
 
-    if (curp[0] != '=') { /* No '=' sign */
-    *name = NULL;
-    return;
+/* 1 and a pair, 0 at the end of the list, -1 if the rest of the buffer
+   isn't a directive list; once it has failed it keeps failing */
+int
+ODKDigestNextPair(ODKDigestParser *parser, ODKDigestPair *pair)
+{
+    const char *cur = parser->cur;
+    const char *end = parser->end;
+
+    memset(pair, 0, sizeof(*pair));
+
+    if (cur == NULL)
+        return -1;
+
+    /* empty list elements are allowed */
+    for (;;) {
+        cur = skip_lws(cur, end);
+        if (cur == end) {
+            parser->cur = cur;
+            return 0;
+        }
+        if (*cur != ',')
+            break;
+        cur++;
     }
 
-    curp[0] = '\0';
-    curp++;
+    pair->name = cur;
+    cur = skip_token(cur, end);
+    pair->nameLen = cur - pair->name;
+    if (pair->nameLen == 0)
+        goto malformed;
+
+    cur = skip_lws(cur, end);
+    if (cur == end || *cur != '=')
+        goto malformed;
+    cur = skip_lws(cur + 1, end);
+
+    if (cur < end && *cur == '"') {
+        pair->quoted = 1;
+        pair->value = ++cur;
+        for (;;) {
+            if (cur == end || *cur == '\0')
+                goto malformed;
+            if (*cur == '"')
+                break;
+            if (*cur == '\\') {
+                pair->escaped = 1;
+                if (++cur == end || *cur == '\0')
+                    goto malformed;
+            }
+            cur++;
+        }
+        pair->valueLen = cur - pair->value;
+        cur++;
+    } else {
+        /* cyrus lets a token value be empty, so do we */
+        pair->value = cur;
+        cur = skip_token(cur, end);
+        pair->valueLen = cur - pair->value;
+    }
 
-    curp = skip_lws(curp);
+    cur = skip_lws(cur, end);
+    if (cur < end) {
+        if (*cur != ',')
+            goto malformed;
+        cur++;
+    }
 
-    *value = (curp[0] == '"') ? curp+1 : curp;
+    parser->cur = cur;
+    return 1;
 
-    endpair = unquote (curp);
-    if (endpair == NULL) { /* Unbalanced quotes */
-    *name = NULL;
-    return;
-    }
-    if (endpair[0] != ',') {
-    if (endpair[0]!='\0') {
-        *endpair++ = '\0';
-    }
-    }
+malformed:
+    memset(pair, 0, sizeof(*pair));
+    parser->cur = NULL;
+    return -1;
+}
 
-    endpair = skip_lws(endpair);
+int
+ODKDigestPairNameIs(const ODKDigestPair *pair, const char *name)
+{
+    return strlen(name) == pair->nameLen && strncasecmp(pair->name, name, pair->nameLen) == 0;
+}
 
-    /* syntax check: MUST be '\0' or ',' */
-    if (endpair[0] == ',') {
-    endpair[0] = '\0';
-    endpair++; /* skipping <,> */
-    } else if (endpair[0] != '\0') {
-    *name = NULL;
-    return;
+/* unescapes and terminates the value; its length, or -1 (and an empty
+   string) if out is too small */
+int
+ODKDigestCopyValue(const ODKDigestPair *pair, char *out, size_t outLen)
+{
+    const char *in = pair->value;
+    const char *end = pair->value + pair->valueLen;
+    size_t len = 0;
+
+    if (outLen == 0)
+        return -1;
+
+    if (!pair->escaped) {
+        if (pair->valueLen >= outLen) {
+            out[0] = '\0';
+            return -1;
+        }
+        memcpy(out, in, pair->valueLen);
+        len = pair->valueLen;
+    } else {
+        for (; in < end; in++) {
+            if (*in == '\\')
+                in++;   /* the parser guarantees something follows */
+            if (len + 1 >= outLen) {
+                out[0] = '\0';
+                return -1;
+            }
+            out[len++] = *in;
+        }
     }
 
-    *in = endpair;
+    out[len] = '\0';
+    return (int) len;
 }
 
-void
-ODKGetPair(char **in, char **name, char **value)
+/* 1 and the first pair called name, 0 if there isn't one, -1 if the
+   directives before it (or after it, when there isn't one) are malformed */
+int
+ODKDigestFindPair(const char *in, size_t inLen, const char *name, ODKDigestPair *pairOut)
 {
-    return get_pair(in, name, value);
-}
+    ODKDigestParser parser;
+    int result;
 
+    ODKDigestParserInit(&parser, in, inLen);
+    while ((result = ODKDigestNextPair(&parser, pairOut)) == 1) {
+        if (ODKDigestPairNameIs(pairOut, name))
+            return 1;
+    }
+
+    return result;
+}
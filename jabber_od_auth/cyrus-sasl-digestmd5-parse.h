@@ -9,6 +9,38 @@
 #ifndef __CYRUS_SASL_DIGESTMD5_PARSE_H__
 #define __CYRUS_SASL_DIGESTMD5_PARSE_H__
 
-void ODKGetPair(char **in, char **name, char **value);
+#include <stddef.h>
+
+/* walks a DIGEST-MD5 directive list (RFC 2831) without modifying it or
+   allocating; the buffer needn't be nul terminated */
+typedef struct ODKDigestParser {
+    const char *cur;
+    const char *end;
+} ODKDigestParser;
+
+/* slices of the parsed buffer; a quoted value is the text between the
+   quotes with any quoted-pairs still escaped */
+typedef struct ODKDigestPair {
+    const char *name;
+    size_t nameLen;
+    const char *value;
+    size_t valueLen;
+    int quoted;
+    int escaped;    /* value has backslashes that ODKDigestCopyValue removes */
+} ODKDigestPair;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void ODKDigestParserInit(ODKDigestParser *parser, const char *in, size_t inLen);
+int ODKDigestNextPair(ODKDigestParser *parser, ODKDigestPair *pair);
+int ODKDigestPairNameIs(const ODKDigestPair *pair, const char *name);
+int ODKDigestCopyValue(const ODKDigestPair *pair, char *out, size_t outLen);
+int ODKDigestFindPair(const char *in, size_t inLen, const char *name, ODKDigestPair *pairOut);
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
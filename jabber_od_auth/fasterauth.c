@@ -30,6 +30,10 @@
 #include <syslog.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <CoreServices/CoreServices.h>
 #include <CoreFoundation/CFData.h>
@@ -41,38 +45,65 @@
 #include <DirectoryService/DirServicesConst.h>
 
 #include "fasterauth.h"
+#include "apple_authenticate.h"
 #include "dserr.h"
+#include "odguard.h"
 
-/* this code is not thread safe:
+/* FasterDirectoryService handles are pooled per node name so that several
+ * auth workers can be inside dsDoDirNodeAuth at the same time:
  *
- *   . dunno if the tDirReference and/or tDirNodeReference are thread safe
- *   . RemoveCachedFasterDirectoryService operates on a FasterDirectoryService without a mutex
- *
- * probably the way to fix that would be to create a dictionary of nodes per thread
+ *   . a handle (tDirReference + tDirNodeReference) is only ever used by the
+ *     thread that checked it out, so no two threads share a node reference
+ *   . the pool dictionary and each pool's idle list are protected by mutexes
+ *   . dsVerifyDirRefNum is run on idle handles by a background thread, not
+ *     on every checkout
  */
 
 typedef struct FasterDirectoryService {
     char                 *mNodeName;
     tDirReference         mDir;
     tDirNodeReference     mNode;
+    time_t                mLastVerified;
+    struct FasterDirectoryService *mNext;
 } FasterDirectoryService;
 
+typedef struct FasterDirectoryServicePool {
+    char                 *mNodeName;
+    pthread_mutex_t       mLock;
+    pthread_cond_t        mAvailable;
+    FasterDirectoryService *mIdle;      /* singly linked list of idle handles */
+    int                   mIdleCount;
+    int                   mTotalCount;  /* idle + checked out */
+    int                   mMaxCount;    /* fixed when the pool is made */
+} FasterDirectoryServicePool;
+
 static CFDictionaryValueCallBacks  kNoOpValueCallBacks = { 0 };
 
-static CFMutableDictionaryRef nodes = NULL;
+static CFMutableDictionaryRef pools = NULL;
+static pthread_mutex_t poolsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t verifierOnce = PTHREAD_ONCE_INIT;
+
+static int gMaxHandlesPerNode = kFasterAuthDefaultHandlesPerNode;   /* protected by poolsLock */
 
 const int cBufferSize = 32 * 1024;        // 32K buffer for Directory Services operations
 
+#define kFasterAuthVerifyInterval       30      /* seconds between health checks of an idle handle */
+#define kFasterAuthCheckoutTimeout      10      /* seconds to wait for a free handle */
+
 
 static int CreateFasterDirectoryService(FasterDirectoryService **out, char *nodename);
 static int DeleteFasterDirectoryService(FasterDirectoryService **out);
 
-static int GetCachedFasterDirectoryService(char *nodename, FasterDirectoryService **out);
-static int RemoveCachedFasterDirectoryService(char *nodename);
+static int GetFasterDirectoryServicePool(char *nodename, FasterDirectoryServicePool **out);
+static int CheckoutFasterDirectoryService(FasterDirectoryServicePool *pool, long timeout, FasterDirectoryService **out);
+static void CheckinFasterDirectoryService(FasterDirectoryServicePool *pool, FasterDirectoryService **svc, int discard);
+
+static void StartFasterDirectoryServiceVerifier(void);
+static void *FasterDirectoryServiceVerifier(void *arg);
+static void VerifyFasterDirectoryServicePool(FasterDirectoryServicePool *pool);
 
 static int GetFasterDirectoryServiceDirReference(FasterDirectoryService *svc, tDirReference *out);
 static int GetFasterDirectoryServiceDirNodeReference(FasterDirectoryService *svc, tDirNodeReference *out);
-static int GetFasterDirectoryServiceDataBufferPtr(FasterDirectoryService *svc, tDataBufferPtr *out);
 
 
 #define CF_SAFE_RELEASE(cfobj) \
@@ -80,6 +111,19 @@ static int GetFasterDirectoryServiceDataBufferPtr(FasterDirectoryService *svc, t
 
 
 
+int
+FasterAuthenticationSetHandlesPerNode(int count)
+{
+    if (count < 1)
+        return -1;
+
+    /* only affects pools made from now on; existing pools keep their size */
+    pthread_mutex_lock(&poolsLock);
+    gMaxHandlesPerNode = count;
+    pthread_mutex_unlock(&poolsLock);
+
+    return 0;
+}
 
 int
 FasterAuthentication(char *nodename, char *user,
@@ -91,21 +135,47 @@ FasterAuthentication(char *nodename, char *user,
     tDataNodePtr authType = NULL;
     tDataBufferPtr authData = NULL;
     tContextData context = 0;
+    FasterDirectoryServicePool *pool = 0;
     FasterDirectoryService *svc = 0;
     tDirReference dir = 0;
     tDataBufferPtr data = NULL;
     tDirStatus dirStatus = eDSNoErr;
+    ODGuardCall guard;
+    int guarded = 0;
 
     if (nodename == 0 || user == 0 || challenge == 0 || response == 0 || serverresponse == 0)
         goto done;
 
     *serverresponse = 0;
 
-    if (GetCachedFasterDirectoryService(nodename, &svc) != 0)
+    /* don't bother the directory if we already know DIGEST-MD5 won't work */
+    if (od_auth_get_cached_auth_method(user, kODAuthMethodDIGESTMD5) == 0) {
+        dirStatus = eDSAuthMethodNotSupported;
+        goto done;
+    }
+
+    if (ODGuardBegin(&guard, "dsDoDirNodeAuth") != 0) {
+        dirStatus = eDSCannotAccessSession;
+        goto done;
+    }
+    guarded = 1;
+
+    if (GetFasterDirectoryServicePool(nodename, &pool) != 0) {
+        dirStatus = eDSOpenNodeFailed;
+        goto done;
+    }
+
+    /* waiting for a handle is part of the call's deadline */
+    if (CheckoutFasterDirectoryService(pool, ODGuardRemaining(&guard), &svc) != 0) {
+        dirStatus = eDSCannotAccessSession;
         goto done;
+    }
 
-    if (GetFasterDirectoryServiceDirReference(svc, &dir) != 0)
+    /* a handle that can't give us a reference is broken, and the guard should know */
+    if (GetFasterDirectoryServiceDirReference(svc, &dir) != 0) {
+        dirStatus = eDSOpenFailed;
         goto done;
+    }
 
     // First, specify the type of authentication.
     authType = dsDataNodeAllocateString(dir, kDSStdAuthDIGEST_MD5);
@@ -130,8 +200,10 @@ FasterAuthentication(char *nodename, char *user,
                      strlen(challenge), challenge,
                      strlen(response), response);
 
-    if (GetFasterDirectoryServiceDirNodeReference(svc, &node) != 0)
+    if (GetFasterDirectoryServiceDirNodeReference(svc, &node) != 0) {
+        dirStatus = eDSOpenNodeFailed;
         goto done;
+    }
 
     data = dsDataBufferAllocate(dir, cBufferSize);
     if (data == NULL)
@@ -139,6 +211,10 @@ FasterAuthentication(char *nodename, char *user,
 
     // Do authentication
     dirStatus = dsDoDirNodeAuth(node, authType, true, authData, data, &context);
+    if (dirStatus == eDSNoErr)
+        od_auth_set_cached_auth_method(user, kODAuthMethodDIGESTMD5, 1);
+    else if (dirStatus == eDSAuthMethodNotSupported)
+        od_auth_set_cached_auth_method(user, kODAuthMethodDIGESTMD5, 0);
     if (dirStatus != eDSNoErr)
         goto done;
 
@@ -162,88 +238,254 @@ done:
         dsDataNodeDeAllocate(dir, authType);
     authType = NULL;
 
-    if (retval != 0) { 
-        if (! IS_EXPECTED_DS_ERROR(dirStatus)) {
-            /* something went wrong, invalidate that service */
-            (void)RemoveCachedFasterDirectoryService(nodename);
-        }
+    if (svc != 0) {
+        /* something went wrong (not just a bad password), so throw that handle away */
+        CheckinFasterDirectoryService(pool, &svc,
+                                      retval != 0 && ! IS_EXPECTED_DS_ERROR(dirStatus));
     }
 
+    if (guarded)
+        ODGuardEnd(&guard, ! IS_EXPECTED_DS_ERROR(dirStatus));
+
     return retval;
 }
 
 int
-GetCachedFasterDirectoryService(char *nodename, FasterDirectoryService **out)
+GetFasterDirectoryServicePool(char *nodename, FasterDirectoryServicePool **out)
 {
     int retval = -1;
-    FasterDirectoryService *svc = 0;
+    FasterDirectoryServicePool *pool = 0;
     CFStringRef cfNodeName = NULL;
 
     *out = 0;
 
-    if (nodes == NULL) {
-        nodes = CFDictionaryCreateMutable(kCFAllocatorDefault, 4,
+    pthread_once(&verifierOnce, StartFasterDirectoryServiceVerifier);
+
+    cfNodeName = CFStringCreateWithCString(kCFAllocatorDefault, nodename, kCFStringEncodingUTF8);
+    if (cfNodeName == NULL)
+        return -1;
+
+    pthread_mutex_lock(&poolsLock);
+
+    if (pools == NULL) {
+        pools = CFDictionaryCreateMutable(kCFAllocatorDefault, 4,
                                           &kCFTypeDictionaryKeyCallBacks,
                                           &kNoOpValueCallBacks);
 
-        if (nodes == NULL)
+        if (pools == NULL)
             goto done;
     }
 
-    cfNodeName = CFStringCreateWithCString(kCFAllocatorDefault, nodename, kCFStringEncodingUTF8);
-    if (cfNodeName == NULL)
-        goto done;
+    /* pools are never removed, so the pointer stays valid once the lock is dropped */
+    pool = (FasterDirectoryServicePool*)CFDictionaryGetValue(pools, cfNodeName);
+    if (pool == 0) {
+        pool = (FasterDirectoryServicePool*)calloc(1, sizeof(*pool));
+        if (pool == 0)
+            goto done;
 
-    svc = (FasterDirectoryService*)CFDictionaryGetValue(nodes, cfNodeName);
-    if (svc != 0) {
-        /* verify that the cached directory reference is still good */
-        if (dsVerifyDirRefNum(svc->mDir) != eDSNoErr) {
-            /* it's no longer good, destroy it so that it'll be re-created below */
-            svc = 0;
-            RemoveCachedFasterDirectoryService(nodename);
+        pool->mNodeName = strdup(nodename);
+        if (pool->mNodeName == 0) {
+            free(pool);
+            pool = 0;
+            goto done;
         }
-    }
 
-    if (svc == 0) {
-        if (CreateFasterDirectoryService(&svc, nodename) != 0)
-            goto done;
+        pool->mMaxCount = gMaxHandlesPerNode;
+        pthread_mutex_init(&pool->mLock, NULL);
+        pthread_cond_init(&pool->mAvailable, NULL);
 
-        CFDictionarySetValue(nodes, cfNodeName, svc);
+        CFDictionarySetValue(pools, cfNodeName, pool);
     }
 
-    *out = svc;
+    *out = pool;
 
     retval = 0;
 done:
+    pthread_mutex_unlock(&poolsLock);
     CF_SAFE_RELEASE(cfNodeName);
     return retval;
 }
 
 int
-RemoveCachedFasterDirectoryService(char *nodename)
+CheckoutFasterDirectoryService(FasterDirectoryServicePool *pool, long timeout, FasterDirectoryService **out)
 {
     int retval = -1;
-    CFStringRef cfNodeName = NULL;
-    FasterDirectoryService *svc = 0;
+    int create = 0;
+    struct timeval now;
+    struct timespec deadline;
 
-    cfNodeName = CFStringCreateWithCString(kCFAllocatorDefault, nodename, kCFStringEncodingUTF8);
-    if (cfNodeName == NULL)
-        goto done;
+    *out = 0;
 
-    svc = (FasterDirectoryService*)CFDictionaryGetValue(nodes, cfNodeName);
+    /* timeout is in milliseconds */
+    if (timeout > kFasterAuthCheckoutTimeout * 1000)
+        timeout = kFasterAuthCheckoutTimeout * 1000;
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + timeout / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&pool->mLock);
+
+    while (pool->mIdle == 0 && pool->mTotalCount >= pool->mMaxCount) {
+        if (pthread_cond_timedwait(&pool->mAvailable, &pool->mLock, &deadline) == ETIMEDOUT) {
+            syslog(LOG_ERR, "FasterAuthentication: timed out waiting for a handle to %s", pool->mNodeName);
+            pthread_mutex_unlock(&pool->mLock);
+            goto done;
+        }
+    }
 
-    CFDictionaryRemoveValue(nodes, cfNodeName);
+    if (pool->mIdle != 0) {
+        *out = pool->mIdle;
+        pool->mIdle = (*out)->mNext;
+        pool->mIdleCount--;
+        (*out)->mNext = 0;
+    }
+    else {
+        /* reserve the slot now, open the handle outside of the lock */
+        pool->mTotalCount++;
+        create = 1;
+    }
 
-    /* now it's been removed from the dictionary, so it's safe to delete it */
+    pthread_mutex_unlock(&pool->mLock);
 
-    (void)DeleteFasterDirectoryService(&svc);
+    if (create) {
+        if (CreateFasterDirectoryService(out, pool->mNodeName) != 0) {
+            pthread_mutex_lock(&pool->mLock);
+            pool->mTotalCount--;
+            pthread_cond_signal(&pool->mAvailable);
+            pthread_mutex_unlock(&pool->mLock);
+            goto done;
+        }
+    }
 
     retval = 0;
 done:
-    CF_SAFE_RELEASE(cfNodeName);
     return retval;
 }
 
+void
+CheckinFasterDirectoryService(FasterDirectoryServicePool *pool, FasterDirectoryService **svc, int discard)
+{
+    pthread_mutex_lock(&pool->mLock);
+
+    if (discard) {
+        pool->mTotalCount--;
+        pthread_cond_signal(&pool->mAvailable);
+        pthread_mutex_unlock(&pool->mLock);
+
+        /* closing the references may talk to DirectoryService, keep it out of the lock */
+        (void)DeleteFasterDirectoryService(svc);
+        return;
+    }
+
+    (*svc)->mNext = pool->mIdle;
+    pool->mIdle = *svc;
+    pool->mIdleCount++;
+    *svc = 0;
+
+    pthread_cond_signal(&pool->mAvailable);
+    pthread_mutex_unlock(&pool->mLock);
+}
+
+void
+StartFasterDirectoryServiceVerifier(void)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    if (pthread_create(&thread, &attr, FasterDirectoryServiceVerifier, NULL) != 0)
+        syslog(LOG_ERR, "FasterAuthentication: unable to start handle verifier, stale handles will only be dropped on error");
+
+    pthread_attr_destroy(&attr);
+}
+
+void *
+FasterDirectoryServiceVerifier(void *arg)
+{
+    const void **values = 0;
+    CFIndex count, i;
+
+    for (;;) {
+        sleep(kFasterAuthVerifyInterval);
+
+        /* snapshot the pools so the dictionary lock isn't held across DS calls */
+        pthread_mutex_lock(&poolsLock);
+        count = (pools != NULL) ? CFDictionaryGetCount(pools) : 0;
+        if (count > 0) {
+            values = (const void**)calloc(count, sizeof(*values));
+            if (values != 0)
+                CFDictionaryGetKeysAndValues(pools, NULL, values);
+        }
+        pthread_mutex_unlock(&poolsLock);
+
+        if (values == 0)
+            continue;
+
+        for (i = 0; i < count; ++i)
+            VerifyFasterDirectoryServicePool((FasterDirectoryServicePool*)values[i]);
+
+        free(values);
+        values = 0;
+    }
+
+    return NULL;
+}
+
+void
+VerifyFasterDirectoryServicePool(FasterDirectoryServicePool *pool)
+{
+    FasterDirectoryService *idle = 0;
+    FasterDirectoryService *keep = 0;
+    FasterDirectoryService *svc = 0;
+    int kept = 0;
+    time_t now = time(0);
+
+    /* take the whole idle list so that the checks run without holding the pool
+     * lock; meanwhile an auth worker that finds the list empty opens a new handle
+     * if the pool is below its limit, and otherwise waits (up to
+     * kFasterAuthCheckoutTimeout) until we or another worker hand one back */
+    pthread_mutex_lock(&pool->mLock);
+    idle = pool->mIdle;
+    pool->mIdle = 0;
+    pool->mIdleCount = 0;
+    pthread_mutex_unlock(&pool->mLock);
+
+    while (idle != 0) {
+        svc = idle;
+        idle = idle->mNext;
+        svc->mNext = 0;
+
+        if (svc->mDir != 0 && difftime(now, svc->mLastVerified) >= kFasterAuthVerifyInterval) {
+            if (dsVerifyDirRefNum(svc->mDir) != eDSNoErr) {
+                CheckinFasterDirectoryService(pool, &svc, 1);
+                continue;
+            }
+            svc->mLastVerified = now;
+        }
+
+        svc->mNext = keep;
+        keep = svc;
+        kept++;
+    }
+
+    if (keep != 0) {
+        pthread_mutex_lock(&pool->mLock);
+        for (svc = keep; svc->mNext != 0; svc = svc->mNext)
+            ;
+        svc->mNext = pool->mIdle;
+        pool->mIdle = keep;
+        pool->mIdleCount += kept;
+        pthread_cond_broadcast(&pool->mAvailable);
+        pthread_mutex_unlock(&pool->mLock);
+    }
+}
+
 int
 CreateFasterDirectoryService(FasterDirectoryService **out, char *nodename)
 {
@@ -257,8 +499,12 @@ CreateFasterDirectoryService(FasterDirectoryService **out, char *nodename)
         goto done;
 
     svc->mNodeName = strdup(nodename);
-    if (svc->mNodeName == 0)
+    if (svc->mNodeName == 0) {
+        free(svc);
         goto done;
+    }
+
+    svc->mLastVerified = time(0);
    
     *out = svc;
 
@@ -9,6 +9,14 @@
 #ifndef __FASTER_AUTH_H__
 #define __FASTER_AUTH_H__
 
+/* maximum number of directory handles kept open per node name; this bounds
+ * how many dsDoDirNodeAuth calls can be in flight against one node */
+#define kFasterAuthDefaultHandlesPerNode    4
+
+/* set from <authreg><directory_handles><per-node/>; applies to nodes not yet
+ * seen, so call it before the first authentication */
+int FasterAuthenticationSetHandlesPerNode(int count);
+
 int FasterAuthentication(char *nodename, char *user,
                          char *challenge, char *response,
                          char **serverresponse);
@@ -0,0 +1,674 @@
+/*
+ *  auth_bench.c
+ *
+ *  auth throughput and latency benchmark against a stand-in directory
+ *
+ *  N client threads run PLAIN, CRAM-MD5 or DIGEST-MD5 exchanges (DIGEST-MD5
+ *  through the jabberd scod code in jabberd/) against a server side that
+ *  looks passwords up in a stub directory.  The stub adds scripted latency,
+ *  latency tails and failures, and has a limited number of slots like the
+ *  pooled directory connections.  The directory calls go through the same
+ *  circuit breaker, and each attempt through the same failure throttle,
+ *  as the real auth path, so changes to either show up in the numbers.
+ *  Only needs POSIX:
+ *
+ *      cc -O2 -o auth_bench auth_bench.c -lpthread
+ *
+ *  "make check" builds it and does a short run of each mechanism.
+ *
+ *  Script lines (all optional, # starts a comment):
+ *
+ *      users <count> <name format> <password format>
+ *      at <seconds> latency <ms> [jitter <ms>] [failure <percent>] [tail <percent> <ms>]
+ *      slots <n>
+ *      guard <deadline ms> <failure rate> <min calls> <window> <open time>
+ *      throttle <address failures> <address window> <user failures> <user window>
+ *
+ *  The throttle is off unless the script turns it on.
+ *  Each "at" line starts a phase that lasts until the next one, so an
+ *  outage or a slow directory in the middle of a run can be scripted.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "../odguard.c"
+#include "../odthrottle.c"
+
+/* override some of the stuff from the jabber files that we pull in */
+#define log_debug if(0)(void)
+#define ZONE 0
+#include "jabberd/pool.h"
+#include "jabberd/util.h"
+#include "jabberd/hex.c"
+#include "jabberd/md5.c"
+#include "jabberd/sha1.c"
+#include "jabberd/str.c"
+#include "jabberd/xhash.c"
+#include "jabberd/pool.c"
+#include "jabberd/mech_digest_md5.c"
+#include "jabberd/scod.c"
+
+#define kBenchRealm         "bench.example.com"
+#define kBenchMaxPhases     64
+
+enum {
+    kMechPlain = 0,
+    kMechCramMD5,
+    kMechDigestMD5
+};
+
+enum {
+    kResultSuccess = 0,
+    kResultBadPassword,
+    kResultDirectory,       /* the stub directory failed the call */
+    kResultBreaker,         /* the circuit breaker refused the call */
+    kResultThrottled,
+    kResultCount
+};
+
+typedef struct StubPhase {
+    double at;              /* seconds into the run */
+    int latency;            /* ms */
+    int jitter;             /* ms, uniform on top of latency */
+    double failure;         /* percent of calls that fail */
+    double tail;            /* percent of calls that take tailLatency */
+    int tailLatency;        /* ms */
+} StubPhase;
+
+typedef struct StubDirectory {
+    int userCount;
+    char *nameFormat;
+    char *passwordFormat;
+
+    StubPhase phases[kBenchMaxPhases];
+    int phaseCount;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int slots;              /* 0 = unlimited */
+    int busy;
+
+    struct timeval start;
+} StubDirectory;
+
+typedef struct BenchClient {
+    int index;
+    unsigned int seed;
+    char address[32];
+    char password[256];     /* what the stub directory returned */
+    int directoryResult;
+    pthread_t thread;
+} BenchClient;
+
+static char *argv0 = 0;
+static StubDirectory gDirectory;
+static int gMech = kMechDigestMD5;
+static int gAuths = 10000;
+static double gBadPasswords = 0;
+
+static pthread_mutex_t gLock = PTHREAD_MUTEX_INITIALIZER;
+static int gNext = 0;
+static unsigned long *gLatencies = NULL;    /* microseconds, one per auth */
+static unsigned long gResults[kResultCount];
+
+static const char *kResultNames[kResultCount] = {
+    "succeeded", "bad password", "directory errors", "refused by the breaker", "throttled"
+};
+
+static double
+BenchElapsed(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static double
+BenchRandom(BenchClient *client)
+{
+    return rand_r(&client->seed) / ((double)RAND_MAX + 1);
+}
+
+static void
+BenchSleep(int ms, double fraction)
+{
+    long usecs = (long)(ms * 1000 * fraction);
+    struct timespec ts;
+
+    if (usecs <= 0)
+        return;
+    ts.tv_sec = usecs / 1000000;
+    ts.tv_nsec = (usecs % 1000000) * 1000;
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+/* stub directory */
+
+static int
+StubDirectoryAddPhase(StubDirectory *dir, const StubPhase *phase)
+{
+    int i;
+
+    /* a phase at the same time replaces the earlier one */
+    for (i = 0; i < dir->phaseCount; ++i) {
+        if (dir->phases[i].at == phase->at) {
+            dir->phases[i] = *phase;
+            return 0;
+        }
+    }
+
+    if (dir->phaseCount >= kBenchMaxPhases)
+        return -1;
+
+    for (i = dir->phaseCount; i > 0 && dir->phases[i - 1].at > phase->at; --i)
+        dir->phases[i] = dir->phases[i - 1];
+    dir->phases[i] = *phase;
+    ++dir->phaseCount;
+
+    return 0;
+}
+
+static const StubPhase *
+StubDirectoryCurrentPhase(StubDirectory *dir)
+{
+    double now = BenchElapsed(&dir->start);
+    int i;
+
+    for (i = dir->phaseCount - 1; i > 0; --i)
+        if (dir->phases[i].at <= now)
+            break;
+
+    return &dir->phases[i];
+}
+
+/* 0 and the password, ENOENT for an unknown user, EIO for a directory
+ * failure, EAGAIN if the breaker is open */
+static int
+StubDirectoryGetPassword(StubDirectory *dir, BenchClient *client, const char *username, char *password, size_t passwordLen)
+{
+    const StubPhase *phase = StubDirectoryCurrentPhase(dir);
+    ODGuardCall guard;
+    char name[256];
+    int retval = ENOENT;
+    int i;
+
+    if (ODGuardBegin(&guard, "stub directory") != 0)
+        return EAGAIN;
+
+    pthread_mutex_lock(&dir->lock);
+    while (dir->slots > 0 && dir->busy >= dir->slots)
+        pthread_cond_wait(&dir->cond, &dir->lock);
+    ++dir->busy;
+    pthread_mutex_unlock(&dir->lock);
+
+    if (phase->tail > 0 && BenchRandom(client) * 100 < phase->tail)
+        BenchSleep(phase->tailLatency, 1);
+    else
+        BenchSleep(phase->latency, 1);
+    BenchSleep(phase->jitter, BenchRandom(client));
+
+    if (phase->failure > 0 && BenchRandom(client) * 100 < phase->failure)
+        retval = EIO;
+    else if (sscanf(username, dir->nameFormat, &i) == 1 && i >= 0 && i < dir->userCount) {
+        /* make sure the name round-trips, so "user01" isn't "user1" */
+        snprintf(name, sizeof(name), dir->nameFormat, i);
+        if (strcmp(name, username) == 0) {
+            snprintf(password, passwordLen, dir->passwordFormat, i);
+            retval = 0;
+        }
+    }
+
+    pthread_mutex_lock(&dir->lock);
+    --dir->busy;
+    pthread_cond_signal(&dir->cond);
+    pthread_mutex_unlock(&dir->lock);
+
+    ODGuardEnd(&guard, retval == EIO);
+
+    return retval;
+}
+
+static int
+StubDirectoryLoadScript(StubDirectory *dir, const char *path)
+{
+    FILE *fp;
+    char line[1024], name[256], password[256];
+    char *word, *last;
+    int lineNumber = 0;
+    int a, b, c, d, e;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        ++lineNumber;
+        if ((word = strchr(line, '#')) != NULL)
+            *word = '\0';
+        if ((word = strtok_r(line, " \t\r\n", &last)) == NULL)
+            continue;
+
+        if (strcmp(word, "users") == 0
+            && sscanf(last, "%d %255s %255s", &a, name, password) == 3) {
+            dir->userCount = a;
+            dir->nameFormat = strdup(name);
+            dir->passwordFormat = strdup(password);
+        }
+        else if (strcmp(word, "at") == 0) {
+            StubPhase phase;
+            char *value;
+
+            memset(&phase, 0, sizeof(phase));
+            if ((word = strtok_r(NULL, " \t\r\n", &last)) == NULL)
+                goto bad;
+            phase.at = atof(word);
+            while ((word = strtok_r(NULL, " \t\r\n", &last)) != NULL) {
+                if ((value = strtok_r(NULL, " \t\r\n", &last)) == NULL)
+                    goto bad;
+                if (strcmp(word, "latency") == 0)
+                    phase.latency = atoi(value);
+                else if (strcmp(word, "jitter") == 0)
+                    phase.jitter = atoi(value);
+                else if (strcmp(word, "failure") == 0)
+                    phase.failure = atof(value);
+                else if (strcmp(word, "tail") == 0) {
+                    phase.tail = atof(value);
+                    if ((value = strtok_r(NULL, " \t\r\n", &last)) == NULL)
+                        goto bad;
+                    phase.tailLatency = atoi(value);
+                }
+                else
+                    goto bad;
+            }
+            if (StubDirectoryAddPhase(dir, &phase) != 0)
+                goto bad;
+        }
+        else if (strcmp(word, "slots") == 0 && sscanf(last, "%d", &a) == 1)
+            dir->slots = a;
+        else if (strcmp(word, "guard") == 0 && sscanf(last, "%d %d %d %d %d", &a, &b, &c, &d, &e) == 5)
+            ODGuardConfigure(a, b, c, d, e);
+        else if (strcmp(word, "throttle") == 0 && sscanf(last, "%d %d %d %d", &a, &b, &c, &d) == 4)
+            ODThrottleConfigure(a, b, c, d, kODThrottleDefaultSize);
+        else
+            goto bad;
+    }
+
+    fclose(fp);
+    return 0;
+
+bad:
+    fprintf(stderr, "%s:%d: can't parse this line\n", path, lineNumber);
+    fclose(fp);
+    return -1;
+}
+
+/* PLAIN: the directory checks the password */
+
+static int
+BenchPlain(BenchClient *client, const char *username, const char *password)
+{
+    int err = StubDirectoryGetPassword(&gDirectory, client, username, client->password, sizeof(client->password));
+
+    if (err == EAGAIN)
+        return kResultBreaker;
+    if (err == EIO)
+        return kResultDirectory;
+    if (err != 0 || strcmp(client->password, password) != 0)
+        return kResultBadPassword;
+
+    return kResultSuccess;
+}
+
+/* CRAM-MD5: the client sends HMAC-MD5(password, challenge) and the
+ * directory works out the same thing */
+
+static void
+BenchHmacMD5(const char *key, const char *text, char *hexOut)
+{
+    md5_state_t md5;
+    md5_byte_t hash[16], pad[64], keyHash[16];
+    size_t keyLen = strlen(key);
+    int i;
+
+    if (keyLen > sizeof(pad)) {
+        md5_init(&md5);
+        md5_append(&md5, (const md5_byte_t *)key, keyLen);
+        md5_finish(&md5, keyHash);
+        key = (const char *)keyHash;
+        keyLen = sizeof(keyHash);
+    }
+
+    memset(pad, 0, sizeof(pad));
+    memcpy(pad, key, keyLen);
+    for (i = 0; i < sizeof(pad); ++i)
+        pad[i] ^= 0x36;
+    md5_init(&md5);
+    md5_append(&md5, pad, sizeof(pad));
+    md5_append(&md5, (const md5_byte_t *)text, strlen(text));
+    md5_finish(&md5, hash);
+
+    for (i = 0; i < sizeof(pad); ++i)
+        pad[i] ^= 0x36 ^ 0x5c;
+    md5_init(&md5);
+    md5_append(&md5, pad, sizeof(pad));
+    md5_append(&md5, hash, sizeof(hash));
+    md5_finish(&md5, hash);
+
+    hex_from_raw((char *)hash, sizeof(hash), hexOut);
+}
+
+static int
+BenchCramMD5(BenchClient *client, const char *username, const char *password)
+{
+    char challenge[128], response[33], expected[33];
+    struct timeval now;
+    int err;
+
+    gettimeofday(&now, NULL);
+    snprintf(challenge, sizeof(challenge), "<%u.%ld.%ld@%s>",
+             (unsigned int)rand_r(&client->seed), (long)now.tv_sec, (long)now.tv_usec, kBenchRealm);
+
+    BenchHmacMD5(password, challenge, response);
+
+    err = StubDirectoryGetPassword(&gDirectory, client, username, client->password, sizeof(client->password));
+    if (err == EAGAIN)
+        return kResultBreaker;
+    if (err == EIO)
+        return kResultDirectory;
+    if (err != 0)
+        return kResultBadPassword;
+
+    BenchHmacMD5(client->password, challenge, expected);
+
+    return strcmp(response, expected) == 0 ? kResultSuccess : kResultBadPassword;
+}
+
+/* DIGEST-MD5: the jabberd scod client and server */
+
+static int
+BenchScodCallback(scod_t sd, int cb, void *arg, void **res, void *cbarg)
+{
+    BenchClient *client = (BenchClient *)cbarg;
+
+    switch (cb) {
+    case sd_cb_DIGEST_MD5_CHOOSE_REALM:
+        *res = (void *)((xht)arg)->iter_node->key;
+        return 0;
+
+    case sd_cb_GET_PASS:
+        client->directoryResult = StubDirectoryGetPassword(&gDirectory, client, ((scod_cb_creds_t)arg)->authnid,
+                                                           client->password, sizeof(client->password));
+        if (client->directoryResult != 0)
+            return 1;
+        *(char **)res = client->password;
+        return 0;
+
+    case sd_cb_CHECK_AUTHZID:
+        return 0;
+    }
+
+    return 1;
+}
+
+static int
+BenchDigestMD5(BenchClient *client, scod_ctx_t ctx, const char *username, const char *password)
+{
+    scod_t server = NULL, client_sd = NULL;
+    char *challenge = NULL, *fullChallenge = NULL, *response = NULL, *rspauth = NULL, *ignore = NULL;
+    int challengeLen = 0, responseLen = 0, rspauthLen = 0, ignoreLen = 0;
+    int retval = kResultBadPassword;
+    size_t len;
+
+    client->directoryResult = 0;
+
+    if ((server = scod_new(ctx, sd_type_SERVER)) == NULL || (client_sd = scod_new(ctx, sd_type_CLIENT)) == NULL)
+        goto done;
+
+    if (scod_server_start(server, "DIGEST-MD5", kBenchRealm, "", 0, &challenge, &challengeLen) != sd_CONTINUE)
+        goto done;
+
+    /* the scod client wants a digest-uri, which the server doesn't send */
+    len = challengeLen + sizeof(",digest-uri=\"xmpp/" kBenchRealm "\"");
+    if ((fullChallenge = malloc(len)) == NULL)
+        goto done;
+    snprintf(fullChallenge, len, "%.*s,digest-uri=\"xmpp/%s\"", challengeLen, challenge, kBenchRealm);
+
+    if (scod_client_start(client_sd, "DIGEST-MD5", NULL, (char *)username, (char *)password, &ignore, &ignoreLen) != sd_CONTINUE)
+        goto done;
+    if (scod_client_step(client_sd, fullChallenge, strlen(fullChallenge), &response, &responseLen) != sd_CONTINUE)
+        goto done;
+
+    if (scod_server_step(server, response, responseLen, &rspauth, &rspauthLen) != sd_CONTINUE) {
+        if (client->directoryResult == EAGAIN)
+            retval = kResultBreaker;
+        else if (client->directoryResult == EIO)
+            retval = kResultDirectory;
+        goto done;
+    }
+
+    /* finish both ends so the mechanism state is freed */
+    free(response);
+    response = NULL;
+    if (scod_client_step(client_sd, rspauth, rspauthLen, &response, &responseLen) != sd_SUCCESS)
+        goto done;
+    if (scod_server_step(server, "", 0, &ignore, &ignoreLen) != sd_SUCCESS)
+        goto done;
+
+    retval = kResultSuccess;
+done:
+    free(challenge);
+    free(fullChallenge);
+    free(response);
+    free(rspauth);
+    if (server != NULL)
+        scod_free(server);
+    if (client_sd != NULL)
+        scod_free(client_sd);
+
+    return retval;
+}
+
+static void *
+BenchClientThread(void *arg)
+{
+    BenchClient *client = (BenchClient *)arg;
+    scod_ctx_t ctx = scod_ctx_new(BenchScodCallback, client);
+    struct timeval start;
+    char username[256], password[256];
+    int auth, user, result;
+
+    for (;;) {
+        pthread_mutex_lock(&gLock);
+        auth = gNext < gAuths ? gNext++ : -1;
+        pthread_mutex_unlock(&gLock);
+        if (auth < 0)
+            break;
+
+        user = rand_r(&client->seed) % gDirectory.userCount;
+        snprintf(username, sizeof(username), gDirectory.nameFormat, user);
+        if (gBadPasswords > 0 && BenchRandom(client) * 100 < gBadPasswords)
+            snprintf(password, sizeof(password), "wrong%d", user);
+        else
+            snprintf(password, sizeof(password), gDirectory.passwordFormat, user);
+
+        gettimeofday(&start, NULL);
+
+        if (ODThrottleCheck(client->address, username) != kODThrottleAllow)
+            result = kResultThrottled;
+        else {
+            switch (gMech) {
+            case kMechPlain:
+                result = BenchPlain(client, username, password);
+                break;
+            case kMechCramMD5:
+                result = BenchCramMD5(client, username, password);
+                break;
+            default:
+                result = BenchDigestMD5(client, ctx, username, password);
+                break;
+            }
+            ODThrottleRecord(client->address, username, result == kResultSuccess);
+        }
+
+        gLatencies[auth] = (unsigned long)(BenchElapsed(&start) * 1e6);
+
+        pthread_mutex_lock(&gLock);
+        ++gResults[result];
+        pthread_mutex_unlock(&gLock);
+    }
+
+    scod_ctx_free(ctx);
+    return NULL;
+}
+
+static int
+BenchCompareLatency(const void *a, const void *b)
+{
+    unsigned long la = *(const unsigned long *)a, lb = *(const unsigned long *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+static double
+BenchPercentile(double percentile)
+{
+    int i = (int)(gAuths * percentile / 100);
+
+    if (i >= gAuths)
+        i = gAuths - 1;
+    return gLatencies[i] / 1000.0;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s [-m PLAIN|CRAM-MD5|DIGEST-MD5] [-c clients] [-n auths] [-b bad password %%]\n", argv0);
+    fprintf(stderr, "       [-l latency ms] [-j jitter ms] [-f failure %%] [-d directory slots] [script]\n");
+    fprintf(stderr, "       see the top of auth_bench.c for the script format\n");
+    exit(1);
+}
+
+int
+main(int argc, char * const argv[])
+{
+    BenchClient *clients;
+    StubPhase phase;
+    ODGuardStats guardStats;
+    ODThrottleStats throttleStats;
+    struct timeval start;
+    const char *mechName = "DIGEST-MD5";
+    double secs;
+    int clientCount = 8;
+    int ch, i;
+
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    memset(&phase, 0, sizeof(phase));
+    pthread_mutex_init(&gDirectory.lock, NULL);
+    pthread_cond_init(&gDirectory.cond, NULL);
+    gDirectory.userCount = 1000;
+    gDirectory.nameFormat = "user%d";
+    gDirectory.passwordFormat = "pass%d";
+
+    while ((ch = getopt(argc, argv, "m:c:n:b:l:j:f:d:")) != -1) {
+        switch (ch) {
+        case 'm':
+            mechName = optarg;
+            if (strcasecmp(optarg, "PLAIN") == 0)
+                gMech = kMechPlain;
+            else if (strcasecmp(optarg, "CRAM-MD5") == 0)
+                gMech = kMechCramMD5;
+            else if (strcasecmp(optarg, "DIGEST-MD5") == 0)
+                gMech = kMechDigestMD5;
+            else
+                usage();
+            break;
+        case 'c': clientCount = atoi(optarg); break;
+        case 'n': gAuths = atoi(optarg); break;
+        case 'b': gBadPasswords = atof(optarg); break;
+        case 'l': phase.latency = atoi(optarg); break;
+        case 'j': phase.jitter = atoi(optarg); break;
+        case 'f': phase.failure = atof(optarg); break;
+        case 'd': gDirectory.slots = atoi(optarg); break;
+        default: usage();
+        }
+    }
+    if (clientCount <= 0 || gAuths <= 0 || optind < argc - 1)
+        usage();
+
+    /* a handful of bench clients making thousands of attempts each would
+     * trip the throttle at once, so it is off unless the script says so */
+    ODThrottleConfigure(0, 0, 0, 0, kODThrottleDefaultSize);
+
+    /* the command line sets the first phase, a script can add more */
+    StubDirectoryAddPhase(&gDirectory, &phase);
+    if (optind == argc - 1 && StubDirectoryLoadScript(&gDirectory, argv[optind]) != 0)
+        return 1;
+    if (gDirectory.userCount <= 0)
+        usage();
+
+    gLatencies = calloc(gAuths, sizeof(*gLatencies));
+    clients = calloc(clientCount, sizeof(*clients));
+    if (gLatencies == NULL || clients == NULL) {
+        fprintf(stderr, "%s: out of memory\n", argv0);
+        return 1;
+    }
+
+    gettimeofday(&start, NULL);
+    gDirectory.start = start;
+    srand((unsigned int)start.tv_usec);
+
+    for (i = 0; i < clientCount; ++i) {
+        clients[i].index = i;
+        clients[i].seed = (unsigned int)start.tv_usec + i;
+        /* every client is its own host, so the throttle sees them apart */
+        snprintf(clients[i].address, sizeof(clients[i].address), "10.%d.%d.%d", (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+        if (pthread_create(&clients[i].thread, NULL, BenchClientThread, &clients[i]) != 0) {
+            fprintf(stderr, "%s: unable to start client %d\n", argv0, i);
+            return 1;
+        }
+    }
+    for (i = 0; i < clientCount; ++i)
+        pthread_join(clients[i].thread, NULL);
+
+    secs = BenchElapsed(&start);
+    qsort(gLatencies, gAuths, sizeof(*gLatencies), BenchCompareLatency);
+
+    printf("%s: %s, %d clients, %d auths in %.2fs: %.0f auths/sec\n",
+           argv0, mechName, clientCount, gAuths, secs, secs > 0 ? gAuths / secs : 0);
+    printf("%s:", argv0);
+    for (i = 0; i < kResultCount; ++i)
+        printf("%s %lu %s", i ? "," : "", gResults[i], kResultNames[i]);
+    printf("\n");
+    printf("%s: latency ms: p50 %.3f, p99 %.3f, p999 %.3f, max %.3f\n",
+           argv0, BenchPercentile(50), BenchPercentile(99), BenchPercentile(99.9), gLatencies[gAuths - 1] / 1000.0);
+
+    ODGuardGetStats(&guardStats);
+    printf("%s: directory: %lu calls, %lu failures, %lu overruns, %lu refused, %lu breaker trips\n",
+           argv0, guardStats.calls, guardStats.failures, guardStats.overruns, guardStats.rejected, guardStats.trips);
+    ODThrottleGetStats(&throttleStats);
+    printf("%s: throttle: %lu refused by address, %lu refused by user\n",
+           argv0, throttleStats.addressThrottled, throttleStats.userThrottled);
+
+    free(clients);
+    free(gLatencies);
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/*
+ *  digestmd5_parse_fuzz.c
+ *
+ *  libFuzzer target for the DIGEST-MD5 directive parser:
+ *
+ *      clang -g -fsanitize=fuzzer,address,undefined digestmd5_parse_fuzz.c
+ *
+ *  Built with -DDIGESTMD5_FUZZ_MAIN it has its own main() instead, which
+ *  runs the files named on the command line, or with none a fixed number
+ *  of mutations of a few recorded responses; "make check" runs it that way.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../cyrus-sasl-digestmd5-parse.c"
+
+#define fuzz_assert(e)  ((e) ? (void) 0 : abort())
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    const char *in = (const char *) data;
+    const char *end = in + size;
+    ODKDigestParser parser;
+    ODKDigestPair pair;
+    char value[256];
+    int copied;
+    int result;
+
+    ODKDigestParserInit(&parser, in, size);
+    while ((result = ODKDigestNextPair(&parser, &pair)) == 1) {
+        /* every pair is a slice of the input, in order */
+        fuzz_assert(pair.nameLen > 0);
+        fuzz_assert(pair.name >= in && pair.name + pair.nameLen <= end);
+        fuzz_assert(pair.value >= pair.name + pair.nameLen && pair.value + pair.valueLen <= end);
+        fuzz_assert(pair.value + pair.valueLen <= parser.cur);
+        fuzz_assert(memchr(pair.name, '\0', pair.nameLen) == NULL);
+        fuzz_assert(!pair.escaped || pair.quoted);
+
+        copied = ODKDigestCopyValue(&pair, value, sizeof(value));
+        if (copied >= 0) {
+            fuzz_assert((size_t) copied <= pair.valueLen);
+            fuzz_assert(value[copied] == '\0');
+            fuzz_assert(pair.escaped || memcmp(value, pair.value, copied) == 0);
+        } else {
+            fuzz_assert(value[0] == '\0');
+        }
+
+        fuzz_assert(ODKDigestPairNameIs(&pair, "username") ==
+                    (pair.nameLen == 8 && strncasecmp(pair.name, "username", 8) == 0));
+    }
+
+    /* done means done, malformed stays malformed */
+    fuzz_assert(result == 0 || result == -1);
+    fuzz_assert(ODKDigestNextPair(&parser, &pair) == result);
+
+    return 0;
+}
+
+#ifdef DIGESTMD5_FUZZ_MAIN
+
+static const char *seeds[] = {
+    "username=\"alice\",realm=\"example.com\",nonce=\"OA6MG9tEQGm2hh\",cnonce=\"OA6MHXh6VqTrRk\","
+        "nc=00000001,qop=auth,digest-uri=\"xmpp/example.com\","
+        "response=d388dad90d4bbd760a152321f2143af7,charset=utf-8",
+    "username=\"d\\\"q\\\\u\",realm=\"e\",nc=00000001,qop=auth, ,",
+    "realm=\"\",  nonce = \"a,b\" ,,authzid=\"bob@chat.example.com\"",
+};
+
+/* bytes a mutation puts in, weighted toward the ones the parser cares about */
+static const char alphabet[] = "ab=\",\\ \t\r\nxyz/;uU";
+
+static int
+run_file(const char *path)
+{
+    uint8_t *data;
+    FILE *fp;
+    long size;
+
+    if ((fp = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    data = malloc(size > 0 ? size : 1);
+    if (data == NULL || fread(data, 1, size, fp) != (size_t) size) {
+        perror(path);
+        fclose(fp);
+        free(data);
+        return 1;
+    }
+    fclose(fp);
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+static void
+run_mutations(int iterations)
+{
+    uint8_t buf[512], *copy;
+    size_t n, pos;
+    int i, k;
+
+    srand(1);
+    for (i = 0; i < iterations; i++) {
+        const char *seed = seeds[i % (sizeof(seeds) / sizeof(seeds[0]))];
+
+        n = strlen(seed);
+        memcpy(buf, seed, n);
+        for (k = rand() % 6; k > 0; k--) {
+            pos = (n > 0) ? rand() % n : 0;
+            switch (rand() % 3) {
+            case 0:
+                if (n > 0)
+                    buf[pos] = alphabet[rand() % (sizeof(alphabet) - 1)];
+                break;
+            case 1:
+                if (n < sizeof(buf)) {
+                    memmove(buf + pos + 1, buf + pos, n - pos);
+                    buf[pos] = (rand() % 4 == 0) ? rand() % 256 : alphabet[rand() % (sizeof(alphabet) - 1)];
+                    n++;
+                }
+                break;
+            default:
+                if (n > 0) {
+                    memmove(buf + pos, buf + pos + 1, n - pos - 1);
+                    n--;
+                }
+                break;
+            }
+        }
+        if (rand() % 3 == 0)
+            n = rand() % (n + 1);
+
+        /* an exact sized copy, so reading past the end is caught by the allocator */
+        copy = malloc(n > 0 ? n : 1);
+        memcpy(copy, buf, n);
+        LLVMFuzzerTestOneInput(copy, n);
+        free(copy);
+    }
+}
+
+int
+main(int argc, const char * argv[])
+{
+    int i, result = 0;
+
+    if (argc == 1) {
+        run_mutations(200000);
+        printf("%s: 200000 inputs parsed\n", argv[0]);
+        return 0;
+    }
+
+    for (i = 1; i < argc; i++)
+        result |= run_file(argv[i]);
+
+    return result;
+}
+
+#endif /* DIGESTMD5_FUZZ_MAIN */
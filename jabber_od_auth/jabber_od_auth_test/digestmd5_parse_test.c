@@ -0,0 +1,195 @@
+/*
+ *  digestmd5_parse_test.c
+ *
+ *  test harness and microbenchmark for the DIGEST-MD5 directive parser;
+ *  only needs POSIX
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../cyrus-sasl-digestmd5-parse.c"
+
+static char *argv0 = 0;
+static int failures = 0;
+
+#define test_assert(e)  \
+    ((void) ((e) ? 0 : __test_assert(#e, __FILE__, __LINE__)))
+
+void __test_assert(char *e, char *file, unsigned int line);
+void
+__test_assert(char *e, char *file, unsigned int line)
+{
+    fprintf(stderr, "%s:%u: failed test '%s'\n", file, line, e);
+    ++failures;
+}
+
+/* client responses recorded from iChat, Adium, Pidgin, Psi and Gajim */
+static const char *responses[] = {
+    "username=\"alice\",realm=\"example.com\",nonce=\"OA6MG9tEQGm2hh\",cnonce=\"OA6MHXh6VqTrRk\","
+        "nc=00000001,qop=auth,digest-uri=\"xmpp/example.com\","
+        "response=d388dad90d4bbd760a152321f2143af7,charset=utf-8",
+    "charset=utf-8,username=\"bob\",realm=\"chat.example.com\",nonce=\"3495703012\","
+        "nc=00000001,cnonce=\"a4b5dd59b2df8c8ec9d2b34bd2d2cf42\",digest-uri=\"xmpp/chat.example.com\","
+        "maxbuf=65536,response=87ea43d6fbcc26bba14c0a3e5ea9f5e4,qop=auth,authzid=\"bob@chat.example.com\"",
+    "username=\"carol\",realm=\"example.com\",nonce=\"+Ulv8Z3yz6/8Ky9lrTNj3w==\",cnonce=\"RlUf9/Ie4ld1mTnnjPz8zg==\","
+        "nc=00000001,qop=auth,digest-uri=\"xmpp/example.com\",response=3e58aea7d0bc24aab1b49cb0d82d15ef",
+    "username=\"d\\\"quoted\\\\user\",realm=\"example.com\",nonce=\"MTI5NjE2NTQxNw==\",cnonce=\"ZGJhZGJhZGJhZA==\","
+        "nc=00000001,qop=auth,digest-uri=\"xmpp/example.com\",response=5a0bbf7d1aa9f2f1c3bde3cdf4d5e9ab,charset=utf-8",
+    "username=\"eve\", realm=\"example.com\", nonce=\"5c36ae0a\", cnonce=\"b2d1a7e8\", nc=00000001, "
+        "qop=auth, digest-uri=\"xmpp/example.com\", response=ff1c4c6d0fcd60c4c5b2d4e6e2b7a8c9, charset=utf-8",
+};
+
+static int
+count_pairs(const char *in, size_t inLen)
+{
+    ODKDigestParser parser;
+    ODKDigestPair pair;
+    int n = 0;
+    int result;
+
+    ODKDigestParserInit(&parser, in, inLen);
+    while ((result = ODKDigestNextPair(&parser, &pair)) == 1)
+        ++n;
+
+    return result == 0 ? n : -1;
+}
+
+int
+unit_test(void)
+{
+    ODKDigestParser parser;
+    ODKDigestPair pair;
+    char value[64];
+    const char *in;
+    size_t i;
+
+    for (i = 0; i < sizeof(responses) / sizeof(responses[0]); ++i) {
+        in = responses[i];
+        test_assert(count_pairs(in, strlen(in)) >= 8);
+        test_assert(ODKDigestFindPair(in, strlen(in), "username", &pair) == 1);
+        test_assert(pair.quoted);
+        test_assert(pair.value > in && pair.value + pair.valueLen < in + strlen(in));
+        test_assert(ODKDigestFindPair(in, strlen(in), "NONCE", &pair) == 1);
+        test_assert(ODKDigestFindPair(in, strlen(in), "missing", &pair) == 0);
+    }
+
+    /* values stay escaped until they're copied */
+    in = responses[3];
+    test_assert(ODKDigestFindPair(in, strlen(in), "username", &pair) == 1);
+    test_assert(pair.escaped && pair.valueLen == 15);
+    test_assert(ODKDigestCopyValue(&pair, value, sizeof(value)) == 13);
+    test_assert(strcmp(value, "d\"quoted\\user") == 0);
+    test_assert(ODKDigestCopyValue(&pair, value, 13) == -1 && value[0] == '\0');
+    test_assert(ODKDigestCopyValue(&pair, value, 14) == 13);
+
+    /* tokens, empty elements and white space */
+    in = " , nc = 00000001 ,, qop=auth ,\tmaxbuf=65536 ,";
+    ODKDigestParserInit(&parser, in, strlen(in));
+    test_assert(ODKDigestNextPair(&parser, &pair) == 1);
+    test_assert(ODKDigestPairNameIs(&pair, "nc") && !pair.quoted && pair.valueLen == 8);
+    test_assert(ODKDigestNextPair(&parser, &pair) == 1 && ODKDigestPairNameIs(&pair, "qop"));
+    test_assert(ODKDigestNextPair(&parser, &pair) == 1 && ODKDigestPairNameIs(&pair, "maxbuf"));
+    test_assert(ODKDigestNextPair(&parser, &pair) == 0);
+    test_assert(ODKDigestNextPair(&parser, &pair) == 0);
+    test_assert(count_pairs("", 0) == 0);
+    test_assert(count_pairs("a=", 2) == 1);
+
+    /* the length is what counts, not a nul */
+    in = "realm=\"example.com\",username=\"alice\"";
+    test_assert(ODKDigestFindPair(in, 19, "username", &pair) == 0);
+    test_assert(ODKDigestFindPair(in, strlen(in), "username", &pair) == 1);
+    test_assert(ODKDigestCopyValue(&pair, value, sizeof(value)) == 5 && strcmp(value, "alice") == 0);
+
+    /* anything else is refused, and stays refused */
+    test_assert(count_pairs("username", 8) == -1);
+    test_assert(count_pairs("=alice", 6) == -1);
+    test_assert(count_pairs("username=\"alice", 15) == -1);
+    test_assert(count_pairs("username=\"alice\\", 16) == -1);
+    test_assert(count_pairs("username=\"al\0ce\"", 16) == -1);
+    test_assert(count_pairs("username=\"alice\" realm=x", 24) == -1);
+    test_assert(count_pairs("user name=alice", 15) == -1);
+    test_assert(count_pairs("nc=1,username=al/ice", 20) == -1);
+    ODKDigestParserInit(&parser, "a=b,c", 5);
+    test_assert(ODKDigestNextPair(&parser, &pair) == 1);
+    test_assert(ODKDigestNextPair(&parser, &pair) == -1 && pair.name == NULL);
+    test_assert(ODKDigestNextPair(&parser, &pair) == -1);
+
+    return failures == 0 ? 0 : -1;
+}
+
+/* responses parsed per second, looking up every directive as the mechanism does */
+int
+load_test(int iterations)
+{
+    struct timeval start, end;
+    size_t lengths[sizeof(responses) / sizeof(responses[0])];
+    size_t n = sizeof(responses) / sizeof(responses[0]);
+    char value[256];
+    unsigned long pairs = 0;
+    int rejected = 0;
+    ODKDigestParser parser;
+    ODKDigestPair pair;
+    double secs;
+    size_t j;
+    int i;
+
+    for (j = 0; j < n; ++j)
+        lengths[j] = strlen(responses[j]);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; ++i) {
+        j = i % n;
+        ODKDigestParserInit(&parser, responses[j], lengths[j]);
+        while (ODKDigestNextPair(&parser, &pair) == 1) {
+            if (ODKDigestCopyValue(&pair, value, sizeof(value)) < 0)
+                ++rejected;
+            ++pairs;
+        }
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d responses, %lu directives, %d rejected, %.0f responses/sec\n",
+           argv0, iterations, pairs, rejected, secs > 0 ? iterations / secs : 0);
+
+    return rejected == 0 ? 0 : 1;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s test\n", argv0);
+    fprintf(stderr, "       %s load iterations\n", argv0);
+    exit(1);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        if (unit_test() != 0) {
+            fprintf(stderr, "%s: %d failures\n", argv0, failures);
+            return 1;
+        }
+        printf("%s: all tests passed\n", argv0);
+        return 0;
+    }
+
+    if (argc == 3 && strcmp(argv[1], "load") == 0) {
+        if (atoi(argv[2]) <= 0)
+            usage();
+        return load_test(atoi(argv[2]));
+    }
+
+    usage();
+    return 1;
+}
@@ -13,6 +13,11 @@ static char *argv0 = 0;
 #include <ctype.h>
 
 #include "../apple_membership.c"
+#include "../apple_authenticate.c"
+#include "../apple_backend.c"
+#include "../odcache.c"
+#include "../odguard.c"
+#include "../odsnapshot.c"
 
 
 // APPLE_CHAT_SACL_NAME is defined in apple_patch/pre_configure/jabberd2/c2s/c2s.h.patch,
@@ -48,9 +53,10 @@ membership_test(int iterations, const char *username_fmt, const char *service)
 int
 usage()
 {
-    fprintf(stderr, "usage: %s iterations username [service]\n", argv0);
+    fprintf(stderr, "usage: %s [-s snapshot] iterations username [service]\n", argv0);
     fprintf(stderr, "       username is passed to sprintf, where %%d is the index (1..iterations)\n");
     fprintf(stderr, "       (eg %s 1000 'testuser%%d')\n", argv0);
+    fprintf(stderr, "       -s answers from the given snapshot file instead of the directory\n");
     exit(1);
 }
 
@@ -61,6 +67,15 @@ main(int argc, const char * argv[])
     if (strrchr(argv0, '/'))
         argv0 = strrchr(argv0, '/') + 1;
 
+    if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+        if (od_auth_configure_backend(kODAuthBackendSnapshot, argv[2], 0) != 0) {
+            fprintf(stderr, "%s: unable to open snapshot %s\n", argv0, argv[2]);
+            exit(1);
+        }
+        argc -= 2;
+        argv += 2;
+    }
+
     if (argc != 3 && argc != 4)
         usage();
 
@@ -24,6 +24,8 @@ test_vsyslog(int priority, const char *fmt, va_list ap)
 #define vsyslog test_vsyslog
 #include "../odkerb.c"
 #undef vsyslog
+#include "../odcache.c"
+#include "../odguard.c"
 
 
 
@@ -51,20 +53,39 @@ unit_test(void)
     ODNodeRef node = NULL;
     char  jid[1024];
     CFStringRef short_name = CFSTR("korver");
-
-    test_assert(! odkerb_has_foreign_realm("foo@bar"));
-    test_assert(odkerb_has_foreign_realm("foo@bar@baz"));
-
-    test_assert(odkerb_copy_user_record_with_alt_security_identity(bogus_id, &record) != 0);
-    test_assert(odkerb_copy_user_record_with_alt_security_identity(good_id, &record) == 0);
+    odkerb_principal principal;
+    ODNodeRef node2 = NULL;
+
+    test_assert(odkerb_parse_principal("foo@bar", 7, &principal) == 0);
+    test_assert(principal.short_name_len == 3 && strncmp(principal.short_name, "foo", 3) == 0);
+    test_assert(principal.default_realm_len == 3 && strncmp(principal.default_realm, "bar", 3) == 0);
+    test_assert(principal.foreign_realm == NULL);
+    test_assert(odkerb_parse_principal("foo@bar@baz", 11, &principal) == 0);
+    test_assert(principal.short_name_len == 3 && strncmp(principal.short_name, "foo", 3) == 0);
+    test_assert(principal.foreign_realm_len == 3 && strncmp(principal.foreign_realm, "bar", 3) == 0);
+    test_assert(principal.default_realm_len == 3 && strncmp(principal.default_realm, "baz", 3) == 0);
+    test_assert(odkerb_parse_principal("foo@bar@baz", 7, &principal) == 0 && principal.foreign_realm == NULL);
+    test_assert(odkerb_parse_principal("@bar", 4, &principal) != 0);
+    test_assert(odkerb_parse_principal("", 0, &principal) != 0);
+
+    test_assert(odkerb_copy_user_record_with_alt_security_identity(bogus_id, &record, NULL) != 0);
+    test_assert(odkerb_copy_user_record_with_alt_security_identity(good_id, &record, NULL) == 0);
     test_assert(record != 0);
     test_assert(odkerb_get_im_handle_with_user_record(record, CFSTR(kIMTypeJABBER), CFSTR("ichatserver.apple.com"), short_name, jid, sizeof(jid)) == 0);
     test_assert(strsame(jid, "korver@ichatserver.apple.com"));
     record = 0;
 
-    CFStringRef config_record_name = odkerb_create_config_record_name(good_id);
-    test_assert(odkerb_copy_search_node_with_config_record_name(config_record_name, &node) == 0);
+    CFStringRef config_record_name = odkerb_create_config_record_name("ODSNOWLEO.APPLE.COM", 19);
+    test_assert(odkerb_copy_search_node_with_config_record_name(config_record_name, &node, NULL) == 0);
     test_assert(node != 0);
+
+    /* the second time a realm's node comes from the realm table */
+    test_assert(odkerb_copy_search_node_for_realm("ODSNOWLEO.APPLE.COM", 19, &node2, NULL) == 0);
+    test_assert(node2 != 0);
+    CF_SAFE_RELEASE(node2);
+    test_assert(odkerb_copy_search_node_for_realm("ODSNOWLEO.APPLE.COM", 19, &node2, NULL) == 0);
+    test_assert(node2 != 0 && node2 == gRealms[0].search_node);
+    CF_SAFE_RELEASE(node2);
     test_assert(odkerb_copy_user_record_with_short_name(short_name, node, &record) == 0);
     test_assert(record != 0);
     test_assert(odkerb_get_im_handle_with_user_record(record, CFSTR(kIMTypeJABBER), CFSTR("ichatserver.apple.com"), short_name, jid, sizeof(jid)) == 0);
@@ -79,6 +100,28 @@ unit_test(void)
     test_assert(strsame(jid, "okay@ichatserver.apple.com"));
 
     test_assert(odkerb_get_im_handle("BOGUSBOGUS@ODSNOWLEO.APPLE.COM@SOMEWHERE.ORG", "ichatserver.apple.com", kIMTypeJABBER, jid, sizeof(jid)) != 0);
+
+    /* a parsed principal shares the cache with its string */
+    test_assert(odkerb_parse_principal("korver@ODSNOWLEO.APPLE.COM@SOMEWHERE.ORG", 39, &principal) == 0);
+    test_assert(odkerb_get_im_handle_for_principal(&principal, "ichatserver.apple.com", kIMTypeJABBER, jid, sizeof(jid)) == 0);
+    test_assert(strsame(jid, "korver@ichatserver.apple.com"));
+
+    /* repeated lookups, good and bad, are answered from the cache */
+    unsigned long hits = 0, misses = 0, hits2 = 0, misses2 = 0;
+    test_assert(odkerb_get_cache_stats(&hits, &misses) == 0);
+    test_assert(odkerb_get_im_handle("korver@ODSNOWLEO.APPLE.COM@SOMEWHERE.ORG", "ichatserver.apple.com", kIMTypeJABBER, jid, sizeof(jid)) == 0);
+    test_assert(strsame(jid, "korver@ichatserver.apple.com"));
+    test_assert(odkerb_get_im_handle("BOGUSBOGUS@ODSNOWLEO.APPLE.COM@SOMEWHERE.ORG", "ichatserver.apple.com", kIMTypeJABBER, jid, sizeof(jid)) != 0);
+    test_assert(odkerb_get_cache_stats(&hits2, &misses2) == 0);
+    test_assert(hits2 == hits + 2);
+    test_assert(misses2 == misses);
+
+    /* a flush forces the next lookup back to the directory */
+    test_assert(odkerb_flush_cache() == 0);
+    test_assert(odkerb_get_im_handle("korver@ODSNOWLEO.APPLE.COM@SOMEWHERE.ORG", "ichatserver.apple.com", kIMTypeJABBER, jid, sizeof(jid)) == 0);
+    test_assert(strsame(jid, "korver@ichatserver.apple.com"));
+    test_assert(odkerb_get_cache_stats(&hits, &misses) == 0);
+    test_assert(misses == misses2 + 1);
 }
 
 int
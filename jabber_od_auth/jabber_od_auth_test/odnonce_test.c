@@ -0,0 +1,195 @@
+/*
+ *  odnonce_test.c
+ *
+ *  test harness for the nonce service and CRAM-MD5 challenge record;
+ *  only needs POSIX
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../odnonce.c"
+
+static char *argv0 = 0;
+static int failures = 0;
+
+#define test_assert(e)  \
+    ((void) ((e) ? 0 : __test_assert(#e, __FILE__, __LINE__)))
+
+void __test_assert(char *e, char *file, unsigned int line);
+void
+__test_assert(char *e, char *file, unsigned int line)
+{
+    fprintf(stderr, "%s:%u: failed test '%s'\n", file, line, e);
+    ++failures;
+}
+
+int
+unit_test(void)
+{
+    static const struct {
+        const char *in;
+        const char *hex;
+        const char *base64;
+    } vectors[] = {
+        { "",       "",             "" },
+        { "f",      "66",           "Zg==" },
+        { "fo",     "666f",         "Zm8=" },
+        { "foo",    "666f6f",       "Zm9v" },
+        { "foob",   "666f6f62",     "Zm9vYg==" },
+        { "fooba",  "666f6f6261",   "Zm9vYmE=" },
+        { "foobar", "666f6f626172", "Zm9vYmFy" },
+    };
+    unsigned char bytes[5000], zero[sizeof(bytes)];
+    char out[128], challenge[kODNonceChallengeBufferSize], other[kODNonceChallengeBufferSize];
+    char (*challenges)[kODNonceChallengeBufferSize];
+    ODNonceStats stats;
+    size_t len;
+    int i, valid;
+
+    /* encoding */
+    for (i = 0; i < (int) (sizeof(vectors) / sizeof(vectors[0])); ++i) {
+        len = strlen(vectors[i].in);
+        test_assert(ODNonceHexEncode(vectors[i].in, len, out, sizeof(out)) == (int) strlen(vectors[i].hex));
+        test_assert(strcmp(out, vectors[i].hex) == 0);
+        test_assert(ODNonceBase64Encode(vectors[i].in, len, out, sizeof(out)) == (int) strlen(vectors[i].base64));
+        test_assert(strcmp(out, vectors[i].base64) == 0);
+    }
+    test_assert(ODNonceHexEncode("\x00\x7f\x80\xff", 4, out, sizeof(out)) == 8 && strcmp(out, "007f80ff") == 0);
+    test_assert(ODNonceBase64Encode("\xfb\xff", 2, out, sizeof(out)) == 4 && strcmp(out, "+/8=") == 0);
+    test_assert(ODNonceHexEncode("foo", 3, out, 6) == -1);
+    test_assert(ODNonceBase64Encode("foo", 3, out, 4) == -1);
+
+    /* random bytes, within the buffer and past it */
+    memset(zero, 0, sizeof(zero));
+    test_assert(ODNonceBytes(NULL, 16) == -1);
+    test_assert(ODNonceBytes(bytes, 0) == 0);
+    for (i = 0; i < 3000; ++i)
+        test_assert(ODNonceBytes(bytes, 7) == 0);
+    test_assert(ODNonceBytes(bytes, 1000) == 0 && memcmp(bytes, zero, 1000) != 0);
+    test_assert(ODNonceBytes(bytes, sizeof(bytes)) == 0 && memcmp(bytes, zero, sizeof(bytes)) != 0);
+    test_assert(ODNonceGetStats(&stats) == 0 && stats.refills >= 5);
+
+    test_assert(ODNonceHex(out, 41, 20) == 40 && strlen(out) == 40);
+    test_assert(strspn(out, "0123456789abcdef") == 40);
+    test_assert(ODNonceHex(out, 40, 20) == -1);
+
+    /* a challenge is good once */
+    test_assert(ODNonceConfigure(2, 64) == 0);
+    test_assert(ODNonceIssueChallenge(challenge, sizeof(challenge) - 1) == -1);
+    test_assert(ODNonceIssueChallenge(challenge, sizeof(challenge)) == 0);
+    test_assert(strlen(challenge) == kODNonceChallengeBufferSize - 1);
+    test_assert(ODNonceIssueChallenge(other, sizeof(other)) == 0);
+    test_assert(strcmp(challenge, other) != 0);
+    test_assert(ODNonceRedeemChallenge(challenge) == kODNonceValid);
+    test_assert(ODNonceRedeemChallenge(challenge) == kODNonceUnknown);
+
+    /* and only if we issued it */
+    test_assert(ODNonceRedeemChallenge(NULL) == kODNonceUnknown);
+    test_assert(ODNonceRedeemChallenge("") == kODNonceUnknown);
+    strcpy(challenge, other);
+    challenge[0] = (challenge[0] == '0') ? '1' : '0';
+    test_assert(ODNonceRedeemChallenge(challenge) == kODNonceUnknown);
+
+    /* challenges expire */
+    sleep(3);
+    test_assert(ODNonceRedeemChallenge(other) == kODNonceExpired);
+
+    /* more challenges than the table holds forgets the oldest, never too many */
+    challenges = calloc(1000, sizeof(*challenges));
+    test_assert(challenges != NULL);
+    if (challenges == NULL)
+        return -1;
+    test_assert(ODNonceConfigure(60, 64) == 0);
+    for (i = 0; i < 1000; ++i)
+        test_assert(ODNonceIssueChallenge(challenges[i], sizeof(challenges[i])) == 0);
+    for (i = 0, valid = 0; i < 1000; ++i)
+        if (ODNonceRedeemChallenge(challenges[i]) == kODNonceValid)
+            ++valid;
+    test_assert(valid >= 64 && valid <= 256);
+    test_assert(ODNonceRedeemChallenge(challenges[999]) == kODNonceUnknown);
+    free(challenges);
+
+    test_assert(ODNonceGetStats(&stats) == 0);
+    test_assert(stats.issued == 1002 && stats.expired == 1 && stats.evicted > 0);
+    test_assert(stats.redeemed == 1 + (unsigned long) valid);
+
+    /* resizing forgets what's outstanding */
+    test_assert(ODNonceIssueChallenge(challenge, sizeof(challenge)) == 0);
+    test_assert(ODNonceConfigure(60, 128) == 0);
+    test_assert(ODNonceRedeemChallenge(challenge) == kODNonceUnknown);
+
+    return failures == 0 ? 0 : -1;
+}
+
+/* challenges issued and redeemed per second */
+int
+load_test(int iterations, int outstanding)
+{
+    struct timeval start, end;
+    char (*challenges)[kODNonceChallengeBufferSize];
+    int rejected = 0;
+    double secs;
+    int i;
+
+    challenges = calloc(outstanding, sizeof(*challenges));
+    if (challenges == NULL)
+        return 1;
+
+    ODNonceConfigure(kODNonceDefaultTTL, outstanding);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; ++i) {
+        if (i >= outstanding && ODNonceRedeemChallenge(challenges[i % outstanding]) != kODNonceValid)
+            ++rejected;
+        ODNonceIssueChallenge(challenges[i % outstanding], sizeof(challenges[i % outstanding]));
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d challenges with %d outstanding, %d rejected, %.0f challenges/sec\n",
+           argv0, iterations, outstanding, rejected, secs > 0 ? iterations / secs : 0);
+
+    free(challenges);
+
+    return rejected == 0 ? 0 : 1;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s test\n", argv0);
+    fprintf(stderr, "       %s load iterations outstanding\n", argv0);
+    exit(1);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        if (unit_test() != 0) {
+            fprintf(stderr, "%s: %d failures\n", argv0, failures);
+            return 1;
+        }
+        printf("%s: all tests passed\n", argv0);
+        return 0;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "load") == 0) {
+        if (atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0)
+            usage();
+        return load_test(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    usage();
+    return 1;
+}
@@ -0,0 +1,200 @@
+/*
+ *  odsnapshot_test.c
+ *
+ *  test harness for the directory snapshot file; only needs POSIX, so
+ *  it also builds snapshots for load testing on hosts without OD
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "../odsnapshot.c"
+
+static char *argv0 = 0;
+static int failures = 0;
+
+#define test_assert(e)  \
+    ((void) ((e) ? 0 : __test_assert(#e, __FILE__, __LINE__)))
+
+void __test_assert(char *e, char *file, unsigned int line);
+void
+__test_assert(char *e, char *file, unsigned int line)
+{
+    fprintf(stderr, "%s:%u: failed test '%s'\n", file, line, e);
+    ++failures;
+}
+
+int
+unit_test(const char *path)
+{
+    FILE *fp;
+    ODSnapshot *snapshot = NULL;
+    ODSnapshotBuilder *builder = NULL;
+    unsigned char uuid[16];
+    char name[64];
+    int isMember = -1;
+    int i;
+
+    fp = tmpfile();
+    test_assert(fp != NULL);
+    if (fp == NULL)
+        return -1;
+    fputs("# users\n"
+          "user alice 11111111-2222-3333-4444-555555555555\n"
+          "user bob 66666666777788889999AAAAAAAAAAAA\n"
+          "\n"
+          "group com.apple.access_chat\n"
+          "member com.apple.access_chat alice\n"
+          "member com.apple.access_chat nobody\n"
+          "group com.apple.access_empty\n", fp);
+    rewind(fp);
+    test_assert(ODSnapshotBuildFromText(fp, path) == 0);
+    fclose(fp);
+
+    test_assert(ODSnapshotOpen(path, &snapshot) == 0);
+    test_assert(ODSnapshotFindUser(snapshot, "alice", uuid) == 0 && uuid[0] == 0x11 && uuid[15] == 0x55);
+    test_assert(ODSnapshotFindUser(snapshot, "bob", uuid) == 0 && uuid[15] == 0xaa);
+    test_assert(ODSnapshotFindUser(snapshot, "carol", uuid) == -1);
+
+    test_assert(ODSnapshotCheckGroupMembership(snapshot, "alice", "com.apple.access_chat", &isMember) == 0 && isMember == 1);
+    test_assert(ODSnapshotCheckGroupMembership(snapshot, "bob", "com.apple.access_chat", &isMember) == 0 && isMember == 0);
+    test_assert(ODSnapshotCheckGroupMembership(snapshot, "alice", "com.apple.access_empty", &isMember) == 0 && isMember == 0);
+    test_assert(ODSnapshotCheckGroupMembership(snapshot, "alice", "com.apple.access_none", &isMember) == ENOENT);
+    test_assert(ODSnapshotCheckGroupMembership(snapshot, "carol", "com.apple.access_chat", &isMember) == -1);
+
+    /* replace the file and make sure the new one is picked up */
+    test_assert(ODSnapshotBuilderCreate(&builder) == 0);
+    for (i = 0; i < 10000; ++i) {
+        snprintf(name, sizeof(name), "user%d", i);
+        memset(uuid, i & 0xff, sizeof(uuid));
+        test_assert(ODSnapshotBuilderAddUser(builder, name, uuid) == 0);
+        if (i % 3 == 0)
+            test_assert(ODSnapshotBuilderAddGroupMember(builder, "com.apple.access_chat", name) == 0);
+    }
+    test_assert(ODSnapshotBuilderWrite(builder, path) == 0);
+    ODSnapshotBuilderDelete(&builder);
+
+    test_assert(ODSnapshotForceRefresh(snapshot) == 0);
+    test_assert(ODSnapshotFindUser(snapshot, "alice", uuid) == -1);
+    for (i = 0; i < 10000; ++i) {
+        snprintf(name, sizeof(name), "user%d", i);
+        test_assert(ODSnapshotFindUser(snapshot, name, uuid) == 0 && uuid[0] == (i & 0xff));
+        test_assert(ODSnapshotCheckGroupMembership(snapshot, name, "com.apple.access_chat", &isMember) == 0
+                    && isMember == (i % 3 == 0));
+    }
+
+    /* a bad file must not replace a good snapshot; like the builder,
+     * never rewrite a mapped snapshot in place */
+    snprintf(name, sizeof(name), "%s.bad", path);
+    fp = fopen(name, "w");
+    test_assert(fp != NULL);
+    if (fp != NULL) {
+        fputs("not a snapshot\n", fp);
+        fclose(fp);
+        test_assert(rename(name, path) == 0);
+    }
+    test_assert(ODSnapshotForceRefresh(snapshot) == -1);
+    test_assert(ODSnapshotFindUser(snapshot, "user1", uuid) == 0);
+
+    ODSnapshotClose(&snapshot);
+    unlink(path);
+
+    return failures == 0 ? 0 : -1;
+}
+
+/* lookups per second against an existing snapshot */
+int
+load_test(const char *path, int iterations, const char *username_fmt, const char *group)
+{
+    ODSnapshot *snapshot = NULL;
+    struct timeval start, end;
+    char username[1024];
+    int found = 0, members = 0, isMember;
+    double secs;
+    int i;
+
+    if (ODSnapshotOpen(path, &snapshot) != 0)
+        return -1;
+
+    gettimeofday(&start, NULL);
+    for (i = 1; i <= iterations; ++i) {
+        snprintf(username, sizeof(username), username_fmt, i, i, i, i, i, i);
+        if (ODSnapshotFindUser(snapshot, username, NULL) == 0)
+            ++found;
+        if (ODSnapshotCheckGroupMembership(snapshot, username, group, &isMember) == 0 && isMember)
+            ++members;
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d lookups, %d users found, %d members of %s, %.0f lookups/sec\n",
+           argv0, iterations, found, members, group, secs > 0 ? iterations / secs : 0);
+
+    ODSnapshotClose(&snapshot);
+    return 0;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s test\n", argv0);
+    fprintf(stderr, "       %s build textfile snapshot\n", argv0);
+    fprintf(stderr, "       %s load snapshot iterations username [group]\n", argv0);
+    fprintf(stderr, "       username is passed to sprintf, where %%d is the index (1..iterations)\n");
+    exit(1);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        char path[] = "/tmp/odsnapshot_test.XXXXXX";
+        int fd = mkstemp(path);
+        if (fd < 0) {
+            perror(path);
+            return 1;
+        }
+        close(fd);
+        if (unit_test(path) != 0) {
+            fprintf(stderr, "%s: %d failures\n", argv0, failures);
+            return 1;
+        }
+        printf("%s: all tests passed\n", argv0);
+        return 0;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "build") == 0) {
+        FILE *fp = fopen(argv[2], "r");
+        if (fp == NULL) {
+            perror(argv[2]);
+            return 1;
+        }
+        if (ODSnapshotBuildFromText(fp, argv[3]) != 0) {
+            fprintf(stderr, "%s: unable to build %s from %s\n", argv0, argv[3], argv[2]);
+            return 1;
+        }
+        fclose(fp);
+        return 0;
+    }
+
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "load") == 0) {
+        if (load_test(argv[2], atoi(argv[3]), argv[4],
+                      argc == 6 ? argv[5] : kODSnapshotServiceGroupPrefix "chat") != 0) {
+            fprintf(stderr, "%s: unable to open %s\n", argv0, argv[2]);
+            return 1;
+        }
+        return 0;
+    }
+
+    usage();
+    return 1;
+}
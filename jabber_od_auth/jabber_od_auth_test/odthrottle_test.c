@@ -0,0 +1,155 @@
+/*
+ *  odthrottle_test.c
+ *
+ *  test harness for the authentication failure throttle; only needs POSIX
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../odthrottle.c"
+
+static char *argv0 = 0;
+static int failures = 0;
+
+#define test_assert(e)  \
+    ((void) ((e) ? 0 : __test_assert(#e, __FILE__, __LINE__)))
+
+void __test_assert(char *e, char *file, unsigned int line);
+void
+__test_assert(char *e, char *file, unsigned int line)
+{
+    fprintf(stderr, "%s:%u: failed test '%s'\n", file, line, e);
+    ++failures;
+}
+
+int
+unit_test(void)
+{
+    ODThrottleStats stats;
+    char address[64];
+    int i;
+
+    /* 3 failures per address, 2 per user from an address, 1 second windows */
+    test_assert(ODThrottleConfigure(3, 1, 2, 1, 64) == 0);
+
+    test_assert(ODThrottleCheck("10.0.0.1", "alice") == kODThrottleAllow);
+    ODThrottleRecord("10.0.0.1", "alice", 0);
+    test_assert(ODThrottleCheck("10.0.0.1", "alice") == kODThrottleAllow);
+    ODThrottleRecord("10.0.0.1", "Alice", 0);
+    test_assert(ODThrottleCheck("10.0.0.1", "alice") == kODThrottleUser);
+    test_assert(ODThrottleCheck("10.0.0.1", "ALICE") == kODThrottleUser);
+    test_assert(ODThrottleCheck("10.0.0.1", "bob") == kODThrottleAllow);
+    test_assert(ODThrottleCheck("10.0.0.1", NULL) == kODThrottleAllow);
+
+    /* someone else's failures don't lock alice out from where she is */
+    test_assert(ODThrottleCheck("10.0.0.2", "alice") == kODThrottleAllow);
+
+    /* a success clears the user but not the address */
+    ODThrottleRecord("10.0.0.1", "bob", 0);
+    test_assert(ODThrottleCheck("10.0.0.1", NULL) == kODThrottleAddress);
+    ODThrottleRecord("10.0.0.3", "alice", 0);
+    ODThrottleRecord("10.0.0.3", "alice", 0);
+    test_assert(ODThrottleCheck("10.0.0.3", "alice") == kODThrottleUser);
+    ODThrottleRecord("10.0.0.3", "alice", 1);
+    test_assert(ODThrottleCheck("10.0.0.3", "alice") == kODThrottleAllow);
+    test_assert(ODThrottleCheck("10.0.0.1", "alice") == kODThrottleAddress);
+
+    /* the previous window still counts for part of the next one, and
+     * after two windows everything is forgotten */
+    sleep(1);
+    test_assert(ODThrottleCheck(NULL, "bob") == kODThrottleAllow);
+    sleep(2);
+    test_assert(ODThrottleCheck("10.0.0.1", "alice") == kODThrottleAllow);
+
+    /* more offenders than entries: the table stays bounded and the most
+     * recent offenders are still tracked */
+    for (i = 0; i < 1000; ++i) {
+        snprintf(address, sizeof(address), "192.168.%d.%d", i / 256, i % 256);
+        ODThrottleRecord(address, NULL, 0);
+        ODThrottleRecord(address, NULL, 0);
+        ODThrottleRecord(address, NULL, 0);
+    }
+    test_assert(ODThrottleCheck(address, NULL) == kODThrottleAddress);
+    test_assert(ODThrottleGetStats(&stats) == 0 && stats.evictions > 0);
+
+    /* turning a limit off */
+    test_assert(ODThrottleConfigure(0, 1, 2, 1, 64) == 0);
+    test_assert(ODThrottleCheck(address, NULL) == kODThrottleAllow);
+
+    ODThrottleFlush();
+    test_assert(ODThrottleConfigure(3, 1, 2, 1, 64) == 0);
+    test_assert(ODThrottleCheck(address, NULL) == kODThrottleAllow);
+
+    return failures == 0 ? 0 : -1;
+}
+
+/* checks and failures per second with many distinct addresses */
+int
+load_test(int iterations, int addresses)
+{
+    struct timeval start, end;
+    char address[64], username[64];
+    int throttled = 0;
+    double secs;
+    int i;
+
+    ODThrottleConfigure(kODThrottleDefaultAddressFailures, kODThrottleDefaultAddressWindow,
+                        kODThrottleDefaultUserFailures, kODThrottleDefaultUserWindow, kODThrottleDefaultSize);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; ++i) {
+        snprintf(address, sizeof(address), "10.%d.%d.%d", (i % addresses) >> 16 & 0xff, (i % addresses) >> 8 & 0xff, (i % addresses) & 0xff);
+        snprintf(username, sizeof(username), "user%d", i % addresses);
+        if (ODThrottleCheck(address, username) != kODThrottleAllow)
+            ++throttled;
+        else
+            ODThrottleRecord(address, username, 0);
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d attempts from %d addresses, %d throttled, %.0f attempts/sec\n",
+           argv0, iterations, addresses, throttled, secs > 0 ? iterations / secs : 0);
+
+    return 0;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s test\n", argv0);
+    fprintf(stderr, "       %s load iterations addresses\n", argv0);
+    exit(1);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        if (unit_test() != 0) {
+            fprintf(stderr, "%s: %d failures\n", argv0, failures);
+            return 1;
+        }
+        printf("%s: all tests passed\n", argv0);
+        return 0;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "load") == 0) {
+        if (atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0)
+            usage();
+        return load_test(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    usage();
+    return 1;
+}
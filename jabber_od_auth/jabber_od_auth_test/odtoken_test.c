@@ -0,0 +1,178 @@
+/*
+ *  odtoken_test.c
+ *
+ *  test harness for the fast re-authentication tokens; only needs POSIX
+ *  and CommonCrypto
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../odnonce.c"
+#include "../odtoken.c"
+
+static char *argv0 = 0;
+static int failures = 0;
+
+#define test_assert(e)  \
+    ((void) ((e) ? 0 : __test_assert(#e, __FILE__, __LINE__)))
+
+void __test_assert(char *e, char *file, unsigned int line);
+void
+__test_assert(char *e, char *file, unsigned int line)
+{
+    fprintf(stderr, "%s:%u: failed test '%s'\n", file, line, e);
+    ++failures;
+}
+
+int
+unit_test(void)
+{
+    char token[kODTokenBufferSize], other[kODTokenBufferSize], later[kODTokenBufferSize];
+    char username[64];
+    ODTokenStats stats;
+    time_t expires;
+    int i;
+
+    test_assert(ODTokenConfigure(2, 64) == 0);
+
+    test_assert(ODTokenIssue("alice", token, sizeof(token) - 1, &expires) == -1);
+    test_assert(ODTokenIssue("", token, sizeof(token), &expires) == -1);
+    test_assert(ODTokenIssue("alice", token, sizeof(token), &expires) == 0);
+    test_assert(strlen(token) == kODTokenBufferSize - 1);
+    test_assert(expires >= time(NULL) + 1 && expires <= time(NULL) + 2);
+
+    /* bound to the user, not to the case of the username */
+    test_assert(ODTokenVerify("alice", token, strlen(token)) == kODTokenValid);
+    test_assert(ODTokenVerify("ALICE", token, strlen(token)) == kODTokenValid);
+    test_assert(ODTokenVerify("bob", token, strlen(token)) == kODTokenBadSignature);
+
+    /* anything else is refused */
+    test_assert(ODTokenVerify("alice", token, strlen(token) - 1) == kODTokenMalformed);
+    test_assert(ODTokenVerify("alice", "not a token", 11) == kODTokenMalformed);
+    strcpy(other, token);
+    other[40] = (other[40] == '0') ? '1' : '0';
+    test_assert(ODTokenVerify("alice", other, strlen(other)) == kODTokenBadSignature);
+    other[0] = 'z';
+    test_assert(ODTokenVerify("alice", other, strlen(other)) == kODTokenMalformed);
+
+    /* revoking covers everything issued so far, but not what comes after */
+    test_assert(ODTokenIssue("bob", other, sizeof(other), NULL) == 0);
+    ODTokenRevoke("Alice");
+    test_assert(ODTokenVerify("alice", token, strlen(token)) == kODTokenRevoked);
+    test_assert(ODTokenVerify("bob", other, strlen(other)) == kODTokenValid);
+    test_assert(ODTokenIssue("alice", later, sizeof(later), NULL) == 0);
+    test_assert(ODTokenVerify("alice", later, strlen(later)) == kODTokenValid);
+    ODTokenRevoke("alice");
+    test_assert(ODTokenVerify("alice", later, strlen(later)) == kODTokenRevoked);
+
+    /* tokens expire */
+    sleep(3);
+    test_assert(ODTokenVerify("bob", other, strlen(other)) == kODTokenExpired);
+
+    /* a shorter lifetime applies to tokens already issued */
+    test_assert(ODTokenConfigure(60, 64) == 0);
+    test_assert(ODTokenIssue("bob", other, sizeof(other), NULL) == 0);
+    test_assert(ODTokenConfigure(1, 64) == 0);
+    sleep(2);
+    test_assert(ODTokenVerify("bob", other, strlen(other)) == kODTokenExpired);
+
+    /* more revocations than the table holds revokes everything */
+    test_assert(ODTokenConfigure(60, 64) == 0);
+    test_assert(ODTokenIssue("bob", other, sizeof(other), NULL) == 0);
+    for (i = 0; i < 1000; ++i) {
+        snprintf(username, sizeof(username), "user%d", i);
+        ODTokenRevoke(username);
+    }
+    test_assert(ODTokenVerify("bob", other, strlen(other)) == kODTokenBadSignature);
+    test_assert(ODTokenGetStats(&stats) == 0 && stats.keyChanges > 0);
+
+    test_assert(ODTokenIssue("bob", other, sizeof(other), NULL) == 0);
+    ODTokenRevokeAll();
+    test_assert(ODTokenVerify("bob", other, strlen(other)) == kODTokenBadSignature);
+
+    /* turning tokens off */
+    test_assert(ODTokenIssue("bob", other, sizeof(other), NULL) == 0);
+    test_assert(ODTokenConfigure(0, 64) == 0);
+    test_assert(ODTokenIssue("bob", token, sizeof(token), NULL) == -1);
+    test_assert(ODTokenVerify("bob", other, strlen(other)) == kODTokenExpired);
+
+    return failures == 0 ? 0 : -1;
+}
+
+/* verifications per second */
+int
+load_test(int iterations, int users)
+{
+    struct timeval start, end;
+    char (*tokens)[kODTokenBufferSize];
+    char username[64];
+    int rejected = 0;
+    double secs;
+    int i;
+
+    tokens = calloc(users, sizeof(*tokens));
+    if (tokens == NULL)
+        return 1;
+
+    ODTokenConfigure(kODTokenDefaultLifetime, kODTokenDefaultSize);
+    for (i = 0; i < users; ++i) {
+        snprintf(username, sizeof(username), "user%d", i);
+        ODTokenIssue(username, tokens[i], sizeof(tokens[i]), NULL);
+    }
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; ++i) {
+        snprintf(username, sizeof(username), "user%d", i % users);
+        if (ODTokenVerify(username, tokens[i % users], kODTokenBufferSize - 1) != kODTokenValid)
+            ++rejected;
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d verifications for %d users, %d rejected, %.0f verifications/sec\n",
+           argv0, iterations, users, rejected, secs > 0 ? iterations / secs : 0);
+
+    free(tokens);
+
+    return rejected == 0 ? 0 : 1;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s test\n", argv0);
+    fprintf(stderr, "       %s load iterations users\n", argv0);
+    exit(1);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        if (unit_test() != 0) {
+            fprintf(stderr, "%s: %d failures\n", argv0, failures);
+            return 1;
+        }
+        printf("%s: all tests passed\n", argv0);
+        return 0;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "load") == 0) {
+        if (atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0)
+            usage();
+        return load_test(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    usage();
+    return 1;
+}
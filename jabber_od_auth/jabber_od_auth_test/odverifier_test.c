@@ -0,0 +1,224 @@
+/*
+ *  odverifier_test.c
+ *
+ *  test harness for the PLAIN verifier cache; only needs POSIX and
+ *  CommonCrypto
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "../odcache.c"
+#include "../odnonce.c"
+#include "../odverifier.c"
+
+static char *argv0 = 0;
+static int failures = 0;
+
+/* what the pretend directory says, and how often it's been asked */
+static int directoryAnswer = kODVerifierAccepted;
+static int directoryCalls = 0;
+
+#define test_assert(e)  \
+    ((void) ((e) ? 0 : __test_assert(#e, __FILE__, __LINE__)))
+
+void __test_assert(char *e, char *file, unsigned int line);
+void
+__test_assert(char *e, char *file, unsigned int line)
+{
+    fprintf(stderr, "%s:%u: failed test '%s'\n", file, line, e);
+    ++failures;
+}
+
+int
+directory(const char *username, const char *password)
+{
+    ++directoryCalls;
+    return directoryAnswer;
+}
+
+/* waits for the background thread to drain its queue; new verifiers are
+ * made there too */
+void
+wait_for_worker(void)
+{
+    int i, count;
+
+    for (i = 0; i < 500; ++i) {
+        pthread_mutex_lock(&gVerifier.lock);
+        count = gVerifier.count;
+        pthread_mutex_unlock(&gVerifier.lock);
+        if (count == 0)
+            break;
+        usleep(10000);
+    }
+    usleep(50000);
+}
+
+int
+unit_test(void)
+{
+    /* RFC 7914 section 12 */
+    static const unsigned char empty[64] = {
+        0x77, 0xd6, 0x57, 0x62, 0x38, 0x65, 0x7b, 0x20, 0x3b, 0x19, 0xca, 0x42, 0xc1, 0x8a, 0x04, 0x97,
+        0xf1, 0x6b, 0x48, 0x44, 0xe3, 0x07, 0x4a, 0xe8, 0xdf, 0xdf, 0xfa, 0x3f, 0xed, 0xe2, 0x14, 0x42,
+        0xfc, 0xd0, 0x06, 0x9d, 0xed, 0x09, 0x48, 0xf8, 0x32, 0x6a, 0x75, 0x3a, 0x0f, 0xc8, 0x1f, 0x17,
+        0xe8, 0xd3, 0xe0, 0xfb, 0x2e, 0x0d, 0x36, 0x28, 0xcf, 0x35, 0xe2, 0x0c, 0x38, 0xd1, 0x89, 0x06
+    };
+    static const unsigned char nacl[64] = {
+        0xfd, 0xba, 0xbe, 0x1c, 0x9d, 0x34, 0x72, 0x00, 0x78, 0x56, 0xe7, 0x19, 0x0d, 0x01, 0xe9, 0xfe,
+        0x7c, 0x6a, 0xd7, 0xcb, 0xc8, 0x23, 0x78, 0x30, 0xe7, 0x73, 0x76, 0x63, 0x4b, 0x37, 0x31, 0x62,
+        0x2e, 0xaf, 0x30, 0xd9, 0x2e, 0x22, 0xa3, 0x88, 0x6f, 0xf1, 0x09, 0x27, 0x9d, 0x98, 0x30, 0xda,
+        0xc7, 0x27, 0xaf, 0xb9, 0x4a, 0x83, 0xee, 0x6d, 0x83, 0x60, 0xcb, 0xdf, 0xa2, 0xcc, 0x06, 0x40
+    };
+    unsigned char out[64];
+    ODVerifierStats stats;
+
+    test_assert(ODVerifierScrypt("", 0, (const unsigned char *) "", 0, 4, 1, 1, out, sizeof(out)) == 0);
+    test_assert(memcmp(out, empty, sizeof(out)) == 0);
+    test_assert(ODVerifierScrypt("password", 8, (const unsigned char *) "NaCl", 4, 10, 8, 16, out, sizeof(out)) == 0);
+    test_assert(memcmp(out, nacl, sizeof(out)) == 0);
+
+    /* off until it's given a size */
+    ODVerifierStore("alice", "secret");
+    wait_for_worker();
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierMiss);
+    test_assert(ODVerifierGetStats(&stats) == 0 && stats.stored == 0 && stats.misses == 0);
+
+    /* a stored password matches, nothing else does */
+    test_assert(ODVerifierConfigure(64, 1, 3, 4) == 0);
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierMiss);
+    ODVerifierStore("alice", "secret");
+    wait_for_worker();
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierHit);
+    test_assert(ODVerifierCheck("alice", "Secret", directory) == kODVerifierMiss);
+    test_assert(ODVerifierCheck("alice", "", directory) == kODVerifierMiss);
+    test_assert(ODVerifierCheck("bob", "secret", directory) == kODVerifierMiss);
+    test_assert(ODVerifierCheck(NULL, "secret", directory) == kODVerifierMiss);
+    test_assert(ODVerifierGetStats(&stats) == 0);
+    test_assert(stats.hits == 1 && stats.mismatches == 2 && stats.stored == 1 && stats.entries == 1);
+    test_assert(directoryCalls == 0);
+
+    /* an older hit is rechecked in the background, once */
+    sleep(2);
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierHit);
+    wait_for_worker();
+    test_assert(directoryCalls == 1);
+    test_assert(ODVerifierGetStats(&stats) == 0 && stats.revalidated == 1);
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierHit);
+    wait_for_worker();
+    test_assert(directoryCalls == 1);
+
+    /* the directory changing its mind drops the verifier */
+    sleep(2);
+    directoryAnswer = kODVerifierRejected;
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierHit);
+    wait_for_worker();
+    test_assert(directoryCalls == 2);
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierMiss);
+    test_assert(ODVerifierGetStats(&stats) == 0 && stats.revoked == 1);
+
+    /* without the directory's agreement a verifier only lasts max-stale */
+    directoryAnswer = kODVerifierUnavailable;
+    ODVerifierStore("alice", "secret");
+    wait_for_worker();
+    sleep(2);
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierHit);
+    wait_for_worker();
+    test_assert(directoryCalls == 3);
+    sleep(2);
+    test_assert(ODVerifierCheck("alice", "secret", directory) == kODVerifierMiss);
+
+    /* forgetting, flushing and resizing */
+    directoryAnswer = kODVerifierAccepted;
+    ODVerifierStore("alice", "secret");
+    ODVerifierStore("bob", "hunter2");
+    wait_for_worker();
+    ODVerifierForget("alice");
+    test_assert(ODVerifierCheck("alice", "secret", NULL) == kODVerifierMiss);
+
+    /* forgetting beats a verifier that's still being made */
+    ODVerifierStore("carol", "secret");
+    ODVerifierForget("carol");
+    wait_for_worker();
+    test_assert(ODVerifierCheck("carol", "secret", NULL) == kODVerifierMiss);
+    test_assert(ODVerifierCheck("bob", "hunter2", NULL) == kODVerifierHit);
+    ODVerifierFlush();
+    test_assert(ODVerifierCheck("bob", "hunter2", NULL) == kODVerifierMiss);
+    ODVerifierStore("bob", "hunter2");
+    wait_for_worker();
+    test_assert(ODVerifierConfigure(128, 1, 3, 4) == 0);
+    test_assert(ODVerifierCheck("bob", "hunter2", NULL) == kODVerifierMiss);
+    test_assert(ODVerifierConfigure(0, 1, 3, 4) == 0);
+    ODVerifierStore("bob", "hunter2");
+    wait_for_worker();
+    test_assert(ODVerifierCheck("bob", "hunter2", NULL) == kODVerifierMiss);
+
+    return failures == 0 ? 0 : -1;
+}
+
+/* cached checks per second at a given cost */
+int
+load_test(int iterations, int cost)
+{
+    struct timeval start, end;
+    int rejected = 0;
+    double secs;
+    int i;
+
+    if (ODVerifierConfigure(16, kODVerifierDefaultRevalidate, kODVerifierDefaultMaxStale, cost) != 0)
+        return 1;
+    ODVerifierStore("alice", "correct horse battery staple");
+    wait_for_worker();
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; ++i)
+        if (ODVerifierCheck("alice", "correct horse battery staple", directory) != kODVerifierHit)
+            ++rejected;
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%s: %d checks at cost %d, %d rejected, %.1f ms/check\n",
+           argv0, iterations, gVerifier.cost, rejected, iterations > 0 ? secs * 1000 / iterations : 0);
+
+    return rejected == 0 ? 0 : 1;
+}
+
+int
+usage()
+{
+    fprintf(stderr, "usage: %s test\n", argv0);
+    fprintf(stderr, "       %s load iterations cost\n", argv0);
+    exit(1);
+}
+
+int
+main(int argc, const char * argv[])
+{
+    argv0 = (char*)argv[0];
+    if (strrchr(argv0, '/'))
+        argv0 = strrchr(argv0, '/') + 1;
+
+    if (argc == 2 && strcmp(argv[1], "test") == 0) {
+        if (unit_test() != 0) {
+            fprintf(stderr, "%s: %d failures\n", argv0, failures);
+            return 1;
+        }
+        printf("%s: all tests passed\n", argv0);
+        return 0;
+    }
+
+    if (argc == 4 && strcmp(argv[1], "load") == 0) {
+        if (atoi(argv[2]) <= 0 || atoi(argv[3]) <= 0)
+            usage();
+        return load_test(atoi(argv[2]), atoi(argv[3]));
+    }
+
+    usage();
+    return 1;
+}
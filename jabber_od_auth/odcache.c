@@ -0,0 +1,358 @@
+/*
+ *  odcache.c
+ *
+ *  small thread-safe TTL/LRU cache for directory answers
+ *
+ *  Entries live in a chained hash table and on a doubly linked LRU list.
+ *  Expired entries are dropped when they are looked up; when the cache is
+ *  full the least recently used entry is evicted.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "odcache.h"
+
+typedef struct ODCacheEntry {
+    void *key;
+    size_t keyLen;
+    void *value;
+    size_t valueLen;
+    time_t expires;
+    unsigned int hash;
+    struct ODCacheEntry *hashNext;
+    struct ODCacheEntry *lruPrev;   /* towards most recently used */
+    struct ODCacheEntry *lruNext;   /* towards least recently used */
+} ODCacheEntry;
+
+struct ODCache {
+    pthread_mutex_t lock;
+    ODCacheEntry **buckets;
+    int bucketCount;
+    ODCacheEntry *mru;
+    ODCacheEntry *lru;
+    int count;
+    int maxEntries;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+};
+
+static unsigned int ODCacheHash(const void *key, size_t keyLen);
+static ODCacheEntry *ODCacheFind(ODCache *cache, const void *key, size_t keyLen, unsigned int hash);
+static void ODCacheUnlinkLRU(ODCache *cache, ODCacheEntry *entry);
+static void ODCachePushMRU(ODCache *cache, ODCacheEntry *entry);
+static void ODCacheRemoveEntry(ODCache *cache, ODCacheEntry *entry);
+static void ODCacheFlushLocked(ODCache *cache);
+
+unsigned int
+ODCacheHash(const void *key, size_t keyLen)
+{
+    const unsigned char *p = key;
+    unsigned int h = 5381;
+    size_t i;
+
+    for (i = 0; i < keyLen; ++i)
+        h = ((h << 5) + h) + p[i];
+
+    return h;
+}
+
+ODCacheEntry *
+ODCacheFind(ODCache *cache, const void *key, size_t keyLen, unsigned int hash)
+{
+    ODCacheEntry *entry;
+
+    if (cache->buckets == NULL)
+        return NULL;
+
+    for (entry = cache->buckets[hash % cache->bucketCount]; entry != NULL; entry = entry->hashNext)
+        if (entry->hash == hash && entry->keyLen == keyLen && memcmp(entry->key, key, keyLen) == 0)
+            return entry;
+
+    return NULL;
+}
+
+void
+ODCacheUnlinkLRU(ODCache *cache, ODCacheEntry *entry)
+{
+    if (entry->lruPrev != NULL)
+        entry->lruPrev->lruNext = entry->lruNext;
+    else
+        cache->mru = entry->lruNext;
+
+    if (entry->lruNext != NULL)
+        entry->lruNext->lruPrev = entry->lruPrev;
+    else
+        cache->lru = entry->lruPrev;
+
+    entry->lruPrev = entry->lruNext = NULL;
+}
+
+void
+ODCachePushMRU(ODCache *cache, ODCacheEntry *entry)
+{
+    entry->lruPrev = NULL;
+    entry->lruNext = cache->mru;
+    if (cache->mru != NULL)
+        cache->mru->lruPrev = entry;
+    cache->mru = entry;
+    if (cache->lru == NULL)
+        cache->lru = entry;
+}
+
+void
+ODCacheRemoveEntry(ODCache *cache, ODCacheEntry *entry)
+{
+    ODCacheEntry **pp = &cache->buckets[entry->hash % cache->bucketCount];
+
+    for (; *pp != NULL; pp = &(*pp)->hashNext) {
+        if (*pp == entry) {
+            *pp = entry->hashNext;
+            break;
+        }
+    }
+
+    ODCacheUnlinkLRU(cache, entry);
+    --cache->count;
+
+    free(entry->key);
+    free(entry->value);
+    free(entry);
+}
+
+void
+ODCacheFlushLocked(ODCache *cache)
+{
+    while (cache->lru != NULL)
+        ODCacheRemoveEntry(cache, cache->lru);
+
+    free(cache->buckets);
+    cache->buckets = NULL;
+    cache->bucketCount = 0;
+}
+
+int
+ODCacheCreate(int maxEntries, ODCache **cacheOut)
+{
+    int retval = -1;
+    ODCache *cache = NULL;
+
+    if (cacheOut == NULL)
+        goto failure;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        goto failure;
+
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache);
+        cache = NULL;
+        goto failure;
+    }
+
+    cache->maxEntries = maxEntries > 0 ? maxEntries : 0;
+
+    *cacheOut = cache;
+    retval = 0;
+failure:
+    return retval;
+}
+
+int
+ODCacheDelete(ODCache **cacheOut)
+{
+    if (cacheOut == NULL || *cacheOut == NULL)
+        return -1;
+
+    ODCacheFlushLocked(*cacheOut);
+    pthread_mutex_destroy(&(*cacheOut)->lock);
+    free(*cacheOut);
+    *cacheOut = NULL;
+
+    return 0;
+}
+
+int
+ODCacheSetMaxEntries(ODCache *cache, int maxEntries)
+{
+    if (cache == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    ODCacheFlushLocked(cache);
+    cache->maxEntries = maxEntries > 0 ? maxEntries : 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
+
+int
+ODCacheGet(ODCache *cache, const void *key, size_t keyLen, void *valueOut, size_t valueSize, size_t *valueLenOut)
+{
+    int retval = -1;
+    unsigned int hash;
+    ODCacheEntry *entry;
+
+    if (cache == NULL || key == NULL)
+        return -1;
+
+    hash = ODCacheHash(key, keyLen);
+
+    pthread_mutex_lock(&cache->lock);
+
+    entry = ODCacheFind(cache, key, keyLen, hash);
+    if (entry != NULL && entry->expires <= time(NULL)) {
+        ODCacheRemoveEntry(cache, entry);
+        entry = NULL;
+    }
+
+    if (entry == NULL || entry->valueLen > valueSize) {
+        ++cache->misses;
+        goto failure;
+    }
+
+    if (entry->valueLen > 0)
+        memcpy(valueOut, entry->value, entry->valueLen);
+    if (valueLenOut != NULL)
+        *valueLenOut = entry->valueLen;
+
+    ODCacheUnlinkLRU(cache, entry);
+    ODCachePushMRU(cache, entry);
+    ++cache->hits;
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&cache->lock);
+    return retval;
+}
+
+int
+ODCacheSet(ODCache *cache, const void *key, size_t keyLen, const void *value, size_t valueLen, int ttl)
+{
+    int retval = -1;
+    unsigned int hash;
+    ODCacheEntry *entry = NULL;
+    void *valueCopy = NULL;
+
+    if (cache == NULL || key == NULL || (value == NULL && valueLen > 0))
+        return -1;
+
+    if (ttl <= 0)
+        return 0;
+
+    hash = ODCacheHash(key, keyLen);
+
+    /* allocate outside the lock */
+    valueCopy = malloc(valueLen > 0 ? valueLen : 1);
+    if (valueCopy == NULL)
+        return -1;
+    if (valueLen > 0)
+        memcpy(valueCopy, value, valueLen);
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->maxEntries == 0) {
+        retval = 0;
+        goto failure;
+    }
+
+    if (cache->buckets == NULL) {
+        /* about one entry per bucket when full */
+        cache->bucketCount = cache->maxEntries | 1;
+        cache->buckets = calloc(cache->bucketCount, sizeof(*cache->buckets));
+        if (cache->buckets == NULL) {
+            cache->bucketCount = 0;
+            goto failure;
+        }
+    }
+
+    entry = ODCacheFind(cache, key, keyLen, hash);
+    if (entry != NULL) {
+        free(entry->value);
+        ODCacheUnlinkLRU(cache, entry);
+    }
+    else {
+        while (cache->count >= cache->maxEntries && cache->lru != NULL) {
+            ODCacheRemoveEntry(cache, cache->lru);
+            ++cache->evictions;
+        }
+
+        entry = calloc(1, sizeof(*entry));
+        if (entry == NULL)
+            goto failure;
+        entry->key = malloc(keyLen > 0 ? keyLen : 1);
+        if (entry->key == NULL) {
+            free(entry);
+            goto failure;
+        }
+        if (keyLen > 0)
+            memcpy(entry->key, key, keyLen);
+        entry->keyLen = keyLen;
+        entry->hash = hash;
+        entry->hashNext = cache->buckets[hash % cache->bucketCount];
+        cache->buckets[hash % cache->bucketCount] = entry;
+        ++cache->count;
+    }
+
+    entry->value = valueCopy;
+    entry->valueLen = valueLen;
+    entry->expires = time(NULL) + ttl;
+    valueCopy = NULL;
+    ODCachePushMRU(cache, entry);
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&cache->lock);
+    free(valueCopy);
+    return retval;
+}
+
+int
+ODCacheRemove(ODCache *cache, const void *key, size_t keyLen)
+{
+    ODCacheEntry *entry;
+
+    if (cache == NULL || key == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    entry = ODCacheFind(cache, key, keyLen, ODCacheHash(key, keyLen));
+    if (entry != NULL)
+        ODCacheRemoveEntry(cache, entry);
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
+
+int
+ODCacheFlush(ODCache *cache)
+{
+    if (cache == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    ODCacheFlushLocked(cache);
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
+
+int
+ODCacheGetStats(ODCache *cache, ODCacheStats *statsOut)
+{
+    if (cache == NULL || statsOut == NULL)
+        return -1;
+
+    pthread_mutex_lock(&cache->lock);
+    statsOut->hits = cache->hits;
+    statsOut->misses = cache->misses;
+    statsOut->evictions = cache->evictions;
+    statsOut->entries = cache->count;
+    pthread_mutex_unlock(&cache->lock);
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ *  odcache.h
+ *
+ *  small thread-safe TTL/LRU cache for directory answers
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODCACHE_H__
+#define __ODCACHE_H__
+
+#include <stddef.h>
+
+typedef struct ODCache ODCache;
+
+typedef struct ODCacheStats {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    int entries;
+} ODCacheStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* keys and values are opaque byte strings, copied in and out under the
+ * cache lock; a maxEntries of 0 makes every lookup miss */
+int ODCacheCreate(int maxEntries, ODCache **cacheOut);
+int ODCacheDelete(ODCache **cacheOut);
+
+int ODCacheSetMaxEntries(ODCache *cache, int maxEntries);
+
+/* returns 0 on a hit (value copied to valueOut, length to *valueLenOut), -1 on a miss */
+int ODCacheGet(ODCache *cache, const void *key, size_t keyLen, void *valueOut, size_t valueSize, size_t *valueLenOut);
+int ODCacheSet(ODCache *cache, const void *key, size_t keyLen, const void *value, size_t valueLen, int ttl);
+int ODCacheRemove(ODCache *cache, const void *key, size_t keyLen);
+int ODCacheFlush(ODCache *cache);
+
+int ODCacheGetStats(ODCache *cache, ODCacheStats *statsOut);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
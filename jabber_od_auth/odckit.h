@@ -11,6 +11,15 @@
 
 typedef struct ODCKSession ODCKSession;
 
+#define kODCKDefaultSessionPoolSize     16
+
+typedef struct ODCKSessionPoolStats {
+    unsigned long hits;         /* sessions handed out again */
+    unsigned long misses;       /* sessions created */
+    unsigned long evictions;    /* sessions deleted instead of pooled */
+    unsigned long pooled;       /* sessions waiting in the pool */
+} ODCKSessionPoolStats;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -18,8 +27,19 @@ extern "C" {
 int ODCKCreateSession(/*const char *applicationName, const char *serviceName, const char *hostName,*/ ODCKSession **sessionOut);
 int ODCKDeleteSession(ODCKSession **sessionOut);
 
+/* forgets the exchange but keeps the directory session for reuse */
 int ODCKFlushSession(ODCKSession *session);
 
+/* a bounded pool of flushed sessions; size 0 turns pooling off */
+int ODCKConfigureSessionPool(int size);
+int ODCKAcquireSession(ODCKSession **sessionOut);
+/* flushes the session back into the pool, or deletes it if the exchange
+ * failed or the pool is full */
+int ODCKReleaseSession(ODCKSession **sessionInOut, int failed);
+void ODCKFlushSessionPool(void);
+int ODCKGetSessionPoolStats(ODCKSessionPoolStats *statsOut);
+void ODCKLogSessionPoolStats(void);
+
 int ODCKGetServerChallenge(ODCKSession *session, const char *authMethod, const char *userName, char **serverChallengeOut, unsigned int *serverChallengeLenOut);
 int ODCKSetServerChallenge(ODCKSession *session, const char *authMethod, const char *userName, const char *serverChallenge, unsigned int serverChallengeLen);
 int ODCKVerifyClientRequest(ODCKSession *session, const char *clientRequest, unsigned int clientRequestLen);
@@ -8,6 +8,8 @@
 
 #include "odckit.h"
 #include "odkit.h"
+#include <pthread.h>
+#include <syslog.h>
 #include <ServerFoundation/ServerFoundation.h>
 #include <Foundation/Foundation.h>
 
@@ -47,6 +49,23 @@ typedef struct ODCKSessionPriv {
 #define CF_SAFE_RELEASE(cfobj) \
         do { if ((cfobj) != NULL) CFRelease((cfobj)); cfobj = NULL; } while (0)
 
+/* sessions that have been flushed and can be handed out again, so a
+ * reconnect storm doesn't build and tear down directory session state
+ * for every DIGEST-MD5 exchange */
+typedef struct ODCKSessionPool {
+    pthread_mutex_t        lock;
+    ODCKSessionPriv      **sessions;
+    int                    count;
+    int                    size;
+    ODCKSessionPoolStats   stats;
+} ODCKSessionPool;
+
+static ODCKSessionPool gSessionPool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    NULL,
+    0,
+    kODCKDefaultSessionPoolSize,
+};
 
 static ODCKSessionPriv* ODCKSessionOpaque(ODCKSession *session);
 static int ODCKCreateSessionFlushable(ODCKSessionPriv *session, ODCKSessionFlushable **out);
@@ -205,21 +224,181 @@ ODCKFlushSession(ODCKSession *session)
 {
     int retval = -1;
     ODCKSessionPriv *_session = ODCK_SESSION_PRIV(session);
-    char *error = 0;
 
     ODCK_PARAM_ASSERT(session != 0);
 
-    error = ODKGetError(ODCK_ODKSESSION(_session));
-    if (error)
-        _session->error = strdup(error);
+    /* keep the directory session itself, only the exchange is forgotten */
+    if (_session->flushable != 0) {
+        if (ODKResetSession(ODCK_ODKSESSION(_session)) != 0)
+            goto done;
+        memset(ODCK_SERVER_CHALLENGE_CSTR(_session), 0, sizeof(ODCK_SERVER_CHALLENGE_CSTR(_session)));
+        memset(ODCK_USERNAME_CSTR(_session), 0, sizeof(ODCK_USERNAME_CSTR(_session)));
+    }
 
-    (void)ODCKDeleteSessionFlushable(&_session->flushable);
+    memset(ODCK_SERVER_RESPONSE_CSTR(_session), 0, sizeof(ODCK_SERVER_RESPONSE_CSTR(_session)));
+    _session->badParameter = 0;
+    if (_session->error != 0) {
+        free(_session->error);
+        _session->error = 0;
+    }
 
     retval = 0;
 done:
     return retval;
 }
 
+int
+ODCKConfigureSessionPool(int size)
+{
+    ODCKSessionPriv **sessions = 0;
+    ODCKSessionPriv **old = 0;
+    int kept, count;
+    int i;
+
+    if (size < 0)
+        size = 0;
+
+    if (size > 0) {
+        sessions = (void*)calloc((size_t)size, sizeof(*sessions));
+        if (sessions == 0) {
+            syslog(LOG_ERR, "%s: unable to allocate a pool of %d sessions", __PRETTY_FUNCTION__, size);
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&gSessionPool.lock);
+    old = gSessionPool.sessions;
+    count = gSessionPool.count;
+    kept = (count < size) ? count : size;
+    for (i = 0; i < kept; ++i)
+        sessions[i] = old[i];
+    gSessionPool.sessions = sessions;
+    gSessionPool.count = kept;
+    gSessionPool.size = size;
+    gSessionPool.stats.evictions += count - kept;
+    pthread_mutex_unlock(&gSessionPool.lock);
+
+    /* deleted outside the lock, they may hold directory state */
+    for (i = kept; i < count; ++i)
+        (void)ODCKDeleteSession((ODCKSession**)&old[i]);
+    free(old);
+
+    return 0;
+}
+
+int
+ODCKAcquireSession(ODCKSession **out)
+{
+    ODCKSessionPriv *session = 0;
+
+    if (out == 0)
+        return -1;
+
+    pthread_mutex_lock(&gSessionPool.lock);
+    if (gSessionPool.count > 0) {
+        session = gSessionPool.sessions[--gSessionPool.count];
+        gSessionPool.sessions[gSessionPool.count] = 0;
+        ++gSessionPool.stats.hits;
+    }
+    else
+        ++gSessionPool.stats.misses;
+    pthread_mutex_unlock(&gSessionPool.lock);
+
+    if (session != 0) {
+        *out = (ODCKSession*)session;
+        return 0;
+    }
+
+    return ODCKCreateSession(out);
+}
+
+int
+ODCKReleaseSession(ODCKSession **inout, int failed)
+{
+    ODCKSessionPriv *session = 0;
+    int pooled = 0;
+
+    if (inout == 0)
+        return -1;
+
+    session = *(ODCKSessionPriv**)inout;
+    *inout = 0;
+    if (session == 0)
+        return 0;
+
+    /* a session whose exchange went wrong may be holding on to a node or
+     * record that has gone bad, so it is never reused */
+    if (!failed && ODCKFlushSession((ODCKSession*)session) == 0) {
+        pthread_mutex_lock(&gSessionPool.lock);
+        if (gSessionPool.count < gSessionPool.size) {
+            if (gSessionPool.sessions == 0)
+                gSessionPool.sessions = (void*)calloc((size_t)gSessionPool.size, sizeof(*gSessionPool.sessions));
+            if (gSessionPool.sessions != 0) {
+                gSessionPool.sessions[gSessionPool.count++] = session;
+                pooled = 1;
+            }
+        }
+        pthread_mutex_unlock(&gSessionPool.lock);
+    }
+
+    if (!pooled) {
+        pthread_mutex_lock(&gSessionPool.lock);
+        ++gSessionPool.stats.evictions;
+        pthread_mutex_unlock(&gSessionPool.lock);
+
+        (void)ODCKDeleteSession((ODCKSession**)&session);
+    }
+
+    return 0;
+}
+
+void
+ODCKFlushSessionPool(void)
+{
+    ODCKSessionPriv **sessions;
+    int count;
+    int i;
+
+    pthread_mutex_lock(&gSessionPool.lock);
+    sessions = gSessionPool.sessions;
+    count = gSessionPool.count;
+    gSessionPool.sessions = 0;
+    gSessionPool.count = 0;
+    pthread_mutex_unlock(&gSessionPool.lock);
+
+    for (i = 0; i < count; ++i)
+        (void)ODCKDeleteSession((ODCKSession**)&sessions[i]);
+    free(sessions);
+}
+
+int
+ODCKGetSessionPoolStats(ODCKSessionPoolStats *statsOut)
+{
+    if (statsOut == 0)
+        return -1;
+
+    pthread_mutex_lock(&gSessionPool.lock);
+    *statsOut = gSessionPool.stats;
+    statsOut->pooled = (unsigned long)gSessionPool.count;
+    pthread_mutex_unlock(&gSessionPool.lock);
+
+    return 0;
+}
+
+void
+ODCKLogSessionPoolStats(void)
+{
+    ODCKSessionPoolStats stats;
+
+    ODCKGetSessionPoolStats(&stats);
+    /* nothing to say in processes that never do DIGEST-MD5 */
+    if (stats.hits == 0 && stats.misses == 0)
+        return;
+
+    syslog(LOG_NOTICE, "digest session pool: %lu reused, %lu created, %lu evicted, %lu pooled",
+           stats.hits, stats.misses, stats.evictions, stats.pooled);
+}
+
 int
 ODCKGetServerChallenge(ODCKSession *session, const char *authMethod, const char *userName, char **serverChallengeOut, unsigned int *serverChallengeLenOut)
 {
@@ -0,0 +1,255 @@
+/*
+ *  odguard.c
+ *
+ *  deadlines and a circuit breaker for directory calls
+ *
+ *  The directory APIs (dsDoDirNodeAuth, ODQueryCopyResults, the mbr_*
+ *  calls) can't be cancelled, so a call is never abandoned half way.
+ *  Instead each call has a deadline: a call that overruns it counts as
+ *  a failure, and when enough of the calls in a window fail the breaker
+ *  opens.  While it is open callers fail fast instead of queueing up
+ *  behind a sick directory server.  After the open time one probe call
+ *  is let through (half-open); if it succeeds the breaker closes again.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "odguard.h"
+
+typedef struct ODGuard {
+    pthread_mutex_t lock;
+    int deadline;
+    int failureRate;
+    int minCalls;
+    int window;
+    int openTime;
+    int state;
+    time_t windowStart;
+    unsigned long windowCalls;
+    unsigned long windowFailures;
+    time_t openedAt;
+    time_t lastRejectLog;
+    int probeInFlight;
+    ODGuardStats stats;
+} ODGuard;
+
+static ODGuard gGuard = {
+    PTHREAD_MUTEX_INITIALIZER,
+    kODGuardDefaultDeadline,
+    kODGuardDefaultFailureRate,
+    kODGuardDefaultMinCalls,
+    kODGuardDefaultWindow,
+    kODGuardDefaultOpenTime,
+    kODGuardClosed,
+};
+
+static const char *ODGuardStateName(int state);
+static void ODGuardSetStateLocked(int state, const char *what, time_t now);
+static void ODGuardLogStatsLocked(int priority);
+
+const char *
+ODGuardStateName(int state)
+{
+    switch (state) {
+    case kODGuardClosed:    return "closed";
+    case kODGuardOpen:      return "open";
+    case kODGuardHalfOpen:  return "half-open";
+    }
+    return "unknown";
+}
+
+void
+ODGuardSetStateLocked(int state, const char *what, time_t now)
+{
+    if (state == gGuard.state)
+        return;
+
+    gGuard.state = state;
+    gGuard.stats.state = state;
+    gGuard.windowStart = now;
+    gGuard.windowCalls = 0;
+    gGuard.windowFailures = 0;
+
+    if (state == kODGuardOpen) {
+        gGuard.openedAt = now;
+        gGuard.lastRejectLog = now;
+        ++gGuard.stats.trips;
+        syslog(LOG_ERR, "directory circuit breaker open after %s failed; failing directory calls for %d seconds",
+               what ? what : "a call", gGuard.openTime);
+        ODGuardLogStatsLocked(LOG_ERR);
+    }
+    else {
+        syslog(LOG_NOTICE, "directory circuit breaker %s", ODGuardStateName(state));
+        if (state == kODGuardClosed)
+            ODGuardLogStatsLocked(LOG_NOTICE);
+    }
+}
+
+void
+ODGuardLogStatsLocked(int priority)
+{
+    syslog(priority, "directory calls: %lu, failures: %lu, overruns: %lu, rejected: %lu, trips: %lu, max latency: %lums, breaker %s",
+           gGuard.stats.calls, gGuard.stats.failures, gGuard.stats.overruns, gGuard.stats.rejected,
+           gGuard.stats.trips, gGuard.stats.maxLatency, ODGuardStateName(gGuard.state));
+}
+
+int
+ODGuardConfigure(int deadline, int failureRate, int minCalls, int window, int openTime)
+{
+    pthread_mutex_lock(&gGuard.lock);
+    gGuard.deadline = deadline > 0 ? deadline : kODGuardDefaultDeadline;
+    /* a failure rate above 100% can never be reached, which disables the breaker */
+    gGuard.failureRate = failureRate > 0 ? failureRate : kODGuardDefaultFailureRate;
+    gGuard.minCalls = minCalls > 0 ? minCalls : kODGuardDefaultMinCalls;
+    gGuard.window = window > 0 ? window : kODGuardDefaultWindow;
+    gGuard.openTime = openTime > 0 ? openTime : kODGuardDefaultOpenTime;
+    pthread_mutex_unlock(&gGuard.lock);
+
+    return 0;
+}
+
+int
+ODGuardBegin(ODGuardCall *call, const char *what)
+{
+    int retval = -1;
+    time_t now = time(NULL);
+
+    if (call == NULL)
+        return -1;
+
+    memset(call, 0, sizeof(*call));
+    call->what = what;
+
+    pthread_mutex_lock(&gGuard.lock);
+
+    if (gGuard.state == kODGuardOpen && now - gGuard.openedAt >= gGuard.openTime)
+        ODGuardSetStateLocked(kODGuardHalfOpen, what, now);
+
+    if (gGuard.state == kODGuardOpen || (gGuard.state == kODGuardHalfOpen && gGuard.probeInFlight)) {
+        ++gGuard.stats.rejected;
+        if (now - gGuard.lastRejectLog >= gGuard.openTime) {
+            gGuard.lastRejectLog = now;
+            syslog(LOG_ERR, "directory circuit breaker %s, failing %s", ODGuardStateName(gGuard.state), what ? what : "call");
+            ODGuardLogStatsLocked(LOG_ERR);
+        }
+        goto failure;
+    }
+
+    if (gGuard.state == kODGuardHalfOpen) {
+        gGuard.probeInFlight = 1;
+        call->probe = 1;
+    }
+
+    ++gGuard.stats.calls;
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gGuard.lock);
+
+    if (retval == 0)
+        gettimeofday(&call->start, NULL);
+
+    return retval;
+}
+
+int
+ODGuardEnd(ODGuardCall *call, int failed)
+{
+    struct timeval end;
+    unsigned long elapsed;
+    int overrun;
+    time_t now;
+
+    if (call == NULL)
+        return 0;
+
+    gettimeofday(&end, NULL);
+    elapsed = (end.tv_sec - call->start.tv_sec) * 1000 + (end.tv_usec - call->start.tv_usec) / 1000;
+    now = end.tv_sec;
+
+    pthread_mutex_lock(&gGuard.lock);
+
+    overrun = elapsed > (unsigned long)gGuard.deadline;
+    if (overrun) {
+        ++gGuard.stats.overruns;
+        syslog(LOG_ERR, "directory call %s took %lums (deadline %dms)",
+               call->what ? call->what : "", elapsed, gGuard.deadline);
+        failed = 1;
+    }
+    if (failed)
+        ++gGuard.stats.failures;
+    if (elapsed > gGuard.stats.maxLatency)
+        gGuard.stats.maxLatency = elapsed;
+
+    if (call->probe) {
+        gGuard.probeInFlight = 0;
+        ODGuardSetStateLocked(failed ? kODGuardOpen : kODGuardClosed, call->what, now);
+    }
+    else if (gGuard.state == kODGuardClosed) {
+        if (now - gGuard.windowStart >= gGuard.window) {
+            gGuard.windowStart = now;
+            gGuard.windowCalls = 0;
+            gGuard.windowFailures = 0;
+        }
+
+        ++gGuard.windowCalls;
+        if (failed)
+            ++gGuard.windowFailures;
+
+        if (failed && gGuard.windowCalls >= (unsigned long)gGuard.minCalls
+            && gGuard.windowFailures * 100 >= gGuard.windowCalls * gGuard.failureRate)
+            ODGuardSetStateLocked(kODGuardOpen, call->what, now);
+    }
+    /* calls that were already in flight when the breaker opened don't
+     * move it */
+
+    pthread_mutex_unlock(&gGuard.lock);
+
+    call->probe = 0;
+    return overrun;
+}
+
+long
+ODGuardRemaining(const ODGuardCall *call)
+{
+    struct timeval now;
+    long elapsed, deadline;
+
+    if (call == NULL)
+        return 0;
+
+    gettimeofday(&now, NULL);
+    elapsed = (now.tv_sec - call->start.tv_sec) * 1000 + (now.tv_usec - call->start.tv_usec) / 1000;
+
+    pthread_mutex_lock(&gGuard.lock);
+    deadline = gGuard.deadline;
+    pthread_mutex_unlock(&gGuard.lock);
+
+    return elapsed < deadline ? deadline - elapsed : 0;
+}
+
+int
+ODGuardGetStats(ODGuardStats *statsOut)
+{
+    if (statsOut == NULL)
+        return -1;
+
+    pthread_mutex_lock(&gGuard.lock);
+    *statsOut = gGuard.stats;
+    statsOut->state = gGuard.state;
+    pthread_mutex_unlock(&gGuard.lock);
+
+    return 0;
+}
+
+void
+ODGuardLogStats(void)
+{
+    pthread_mutex_lock(&gGuard.lock);
+    ODGuardLogStatsLocked(LOG_NOTICE);
+    pthread_mutex_unlock(&gGuard.lock);
+}
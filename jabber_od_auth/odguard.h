@@ -0,0 +1,68 @@
+/*
+ *  odguard.h
+ *
+ *  deadlines and a circuit breaker for directory calls
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODGUARD_H__
+#define __ODGUARD_H__
+
+#include <sys/time.h>
+
+/* breaker states */
+enum {
+    kODGuardClosed = 0,     /* calls go through */
+    kODGuardOpen,           /* calls fail fast */
+    kODGuardHalfOpen        /* one probe call at a time goes through */
+};
+
+#define kODGuardDefaultDeadline     5000    /* milliseconds per call */
+#define kODGuardDefaultFailureRate  50      /* percent of calls in a window */
+#define kODGuardDefaultMinCalls     10      /* per window, before tripping */
+#define kODGuardDefaultWindow       30      /* seconds */
+#define kODGuardDefaultOpenTime     30      /* seconds before a probe */
+
+typedef struct ODGuardCall {
+    const char *what;
+    struct timeval start;
+    int probe;
+} ODGuardCall;
+
+typedef struct ODGuardStats {
+    unsigned long calls;
+    unsigned long failures;     /* includes overruns */
+    unsigned long overruns;     /* calls that took longer than the deadline */
+    unsigned long rejected;     /* calls failed fast while open */
+    unsigned long trips;
+    unsigned long maxLatency;   /* milliseconds */
+    int state;
+} ODGuardStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* one breaker per process, shared by every directory caller */
+int ODGuardConfigure(int deadline, int failureRate, int minCalls, int window, int openTime);
+
+/* 0 = make the call, then ODGuardEnd(); -1 = the directory is considered
+ * down, fail the request without calling it */
+int ODGuardBegin(ODGuardCall *call, const char *what);
+
+/* failed is for directory trouble (not "bad password" or "no such user");
+ * returns 1 if the call overran its deadline, which also counts as a failure */
+int ODGuardEnd(ODGuardCall *call, int failed);
+
+/* milliseconds left before call's deadline (never negative) */
+long ODGuardRemaining(const ODGuardCall *call);
+
+int ODGuardGetStats(ODGuardStats *statsOut);
+void ODGuardLogStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -17,27 +17,58 @@
 #include <OpenDirectory/OpenDirectory.h>
 #include <OpenDirectory/OpenDirectoryPriv.h>
 #include <DirectoryService/DirectoryService.h>
+#include <pthread.h>
 #include "odkerb.h"
+#include "odcache.h"
 #include "dserr.h"
+#include "odguard.h"
 #include <membership.h>
 
 static ODNodeRef gSearchNode = NULL;
 
+/* (principal, realm, im type) -> IM handle; see odkerb_get_im_handle() */
+typedef struct odkerb_cached_handle {
+    int retval;
+    char im_handle[256];
+} odkerb_cached_handle;
+
+static pthread_once_t gCacheOnce = PTHREAD_ONCE_INIT;
+static ODCache *gCache = NULL;
+static int gCacheMaxEntries = kODKerbCacheDefaultSize;
+static int gCacheTTL = kODKerbCacheDefaultTTL;
+static int gCacheNegativeTTL = kODKerbCacheDefaultNegativeTTL;
+
+/* Kerberos realm -> configuration record name and the node it names, so a
+ * user who isn't found by principal can be looked up by short name without
+ * first fetching the configuration record; see odkerb_copy_search_node_for_realm() */
+typedef struct odkerb_realm {
+    char name[256];
+    CFStringRef config_record_name;
+    ODNodeRef search_node;          /* NULL until found, and after a reset */
+} odkerb_realm;
+
+static pthread_mutex_t gRealmLock = PTHREAD_MUTEX_INITIALIZER;
+static odkerb_realm gRealms[kODKerbRealmTableSize];
+static int gRealmCount = 0;
+static int gRealmNext = 0;          /* replaced next once the table is full */
+
 static Boolean odkerb_CFStringHasPrefixWithOptions(CFStringRef theString, CFStringRef prefix, CFOptionFlags searchOptions);
 static Boolean odkerb_CFStringHasSuffixWithOptions(CFStringRef theString, CFStringRef suffix, CFOptionFlags searchOptions);
 
-static CFStringRef odkerb_create_alleged_principal_id(char *service_principal_id);
-static CFStringRef odkerb_create_config_record_name(CFStringRef cfPrincipalID);
-static CFStringRef odkerb_create_short_name(char *service_principal_id);
+static CFStringRef odkerb_create_config_record_name(const char *realm, size_t realm_len);
 static CFStringRef odkerb_create_alleged_alt_security_identity(CFStringRef principalID);
 
-static int odkerb_has_foreign_realm(char *service_principal_id);
-
-static int odkerb_copy_user_record_with_alt_security_identity(CFStringRef principalID, ODRecordRef *out);
-static int odkerb_copy_search_node_with_config_record_name(CFStringRef configRecordName, ODNodeRef *out);
+static int odkerb_copy_user_record_with_alt_security_identity(CFStringRef principalID, ODRecordRef *out, int *dir_error);
+static int odkerb_copy_search_node_with_config_record_name(CFStringRef configRecordName, ODNodeRef *out, int *dir_error);
+static int odkerb_copy_search_node_for_realm(const char *realm, size_t realm_len, ODNodeRef *out, int *dir_error);
+static odkerb_realm *odkerb_find_realm_locked(const char *realm, size_t realm_len);
+static int odkerb_flush_realms(int nodes_only);
 static int odkerb_copy_user_record_with_short_name(CFStringRef shortName, ODNodeRef searchNode, ODRecordRef *out);
 static int odkerb_get_im_handle_with_user_record(ODRecordRef userRecord, CFStringRef imType, CFStringRef realm, CFStringRef allegedShortName, char im_handle[], size_t im_handle_size);
 static int odkerb_get_fabricated_im_handle(ODRecordRef userRecord, CFStringRef allegedShortName, CFStringRef realm, char im_handle[], size_t im_handle_size);
+static int odkerb_lookup_im_handle(const odkerb_principal *principal, const char *realm, const char *im_type, char im_handle[], size_t im_handle_size, int *from_directory);
+
+static void odkerb_cache_init(void);
 
 static void odkerb_log_debug(char *fmt, ...);
 static void odkerb_log(int priority, char *fmt, ...);
@@ -134,45 +165,46 @@ odkerb_CFStringHasSuffixWithOptions(CFStringRef theString, CFStringRef suffix, C
                                    searchOptions, NULL);
 }
 
+/* one pass: the short name runs to the first '@' and the default realm
+ * follows the last; anything in between is a cross-realm user's own realm */
 int
-odkerb_has_foreign_realm(char *service_principal_id)
+odkerb_parse_principal(const char *s, size_t len, odkerb_principal *out)
 {
-    /* if it has 2 '@' signs */
-
-    char *c = strchr(service_principal_id, '@');
-    if (c) {
-        c = strchr(c+1, '@');
-        if (c)
-            return 1;
-    }
+    const char *first = NULL;
+    const char *last = NULL;
+    size_t i;
 
-    return 0;
-}
-
-CFStringRef
-odkerb_create_alleged_principal_id(char *service_principal_id)
-{
-    CFStringRef cfPrincipalID = NULL;
+    ODKERB_PARAM_ASSERT(s != 0);
+    ODKERB_PARAM_ASSERT(out != 0);
 
-    assert(service_principal_id != 0);
+    memset(out, 0, sizeof(*out));
 
-    char *s = strdup(service_principal_id);
-    if (s) {
-        char *c = strrchr(s, '@');
-        if (c)
-            *c = '\0';
-        else
-            ODKERB_LOG1(LOG_WARNING, "Bad service principal: %s", service_principal_id);
-
-        cfPrincipalID = CFStringCreateWithCString(kCFAllocatorDefault, s, kCFStringEncodingUTF8);
+    for (i = 0; i < len; ++i) {
+        if (s[i] == '@') {
+            if (first == NULL)
+                first = &s[i];
+            last = &s[i];
+        }
+        else if (s[i] == '\0') {
+            break;
+        }
+    }
 
-        free(s);
+    if (i < len || first == s || len == 0) {
+        odkerb_log(LOG_WARNING, "Bad service principal: %.*s", (int) len, s);
+        return -1;
     }
 
-    if (cfPrincipalID == NULL)
-        ODKERB_LOG_ERRNO(LOG_ERR, ENOMEM);
+    out->short_name = s;
+    out->short_name_len = (first != NULL) ? (size_t) (first - s) : len;
+    out->default_realm = (last != NULL) ? last + 1 : s + len;
+    out->default_realm_len = (size_t) (s + len - out->default_realm);
+    if (first != last) {
+        out->foreign_realm = first + 1;
+        out->foreign_realm_len = (size_t) (last - out->foreign_realm);
+    }
 
-    return cfPrincipalID;
+    return 0;
 }
 
 CFStringRef
@@ -191,56 +223,27 @@ odkerb_create_alleged_alt_security_identity(CFStringRef principalID)
 }
 
 CFStringRef
-odkerb_create_config_record_name(CFStringRef principalID)
+odkerb_create_config_record_name(const char *realm, size_t realm_len)
 {
     CFStringRef cfConfigRecordName = NULL;
     char buffer[1024];
 
-    assert(principalID != NULL);
+    assert(realm != 0);
 
-    if (CFStringGetCString(principalID, buffer, sizeof(buffer)-1, kCFStringEncodingUTF8) == FALSE)
+    if (realm_len == 0 || realm_len >= sizeof(buffer)) {
+        odkerb_log(LOG_WARNING, "Bad realm: %.*s", (int) realm_len, realm);
         return NULL;
-
-    /* use everything after the '@' sign */
-    char *c = strchr(buffer, '@');
-    if (c != 0) {
-        ++c;
-
-        cfConfigRecordName = CFStringCreateWithFormat(kCFAllocatorDefault, NULL,
-                                                      CFSTR("Kerberos:%s"), c);
-        if (cfConfigRecordName == NULL)
-           ODKERB_LOG_ERRNO(LOG_ERR, ENOMEM);
-    }
-    else {
-        ODKERB_LOG_CFSTRING(LOG_WARNING, "Bad principal", principalID);
     }
 
-    return cfConfigRecordName;
-}
+    memcpy(buffer, realm, realm_len);
+    buffer[realm_len] = '\0';
 
-CFStringRef
-odkerb_create_short_name(char *service_principal_id)
-{
-    CFStringRef cfShortName = NULL;
-
-    assert(service_principal_id != 0);
-
-    /* chop off everything after the first '@' sign */
-    char *s = strdup(service_principal_id);
-    if (s != 0) {
-        char *c = strchr(s, '@');
-        if (c != 0)
-            *c = '\0';
-
-        cfShortName = CFStringCreateWithCString(kCFAllocatorDefault, s, kCFStringEncodingUTF8);
-
-        free(s);
-    }
-
-    if (cfShortName == NULL)
+    cfConfigRecordName = CFStringCreateWithFormat(kCFAllocatorDefault, NULL,
+                                                  CFSTR("Kerberos:%s"), buffer);
+    if (cfConfigRecordName == NULL)
         ODKERB_LOG_ERRNO(LOG_ERR, ENOMEM);
 
-    return cfShortName;
+    return cfConfigRecordName;
 }
 
 int
@@ -272,23 +275,27 @@ failure:
     return retval;
 }
 
+/* returns 1 if the error was an unexpected one, i.e. the directory failed */
 int
 odkerb_possibly_reset_search_node(CFErrorRef error)
 {
-    if (error != NULL && gSearchNode != NULL) {
-        if (! IS_EXPECTED_DS_ERROR(CFErrorGetCode(error))) {
+    if (error != NULL && ! IS_EXPECTED_DS_ERROR(CFErrorGetCode(error))) {
+        if (gSearchNode != NULL) {
             /* this is an unexpected error, let's flush the search node */
             ODKERB_LOG_CFERROR(LOG_DEBUG, "Flushing search node because of unexpected error", error);
             CF_SAFE_RELEASE(gSearchNode);
             gSearchNode = NULL;
+            /* the realms' nodes are probably no better off */
+            odkerb_flush_realms(1);
         }
+        return 1;
     }
 
     return 0;
 }
 
 int
-odkerb_copy_user_record_with_alt_security_identity(CFStringRef principalID, ODRecordRef *out)
+odkerb_copy_user_record_with_alt_security_identity(CFStringRef principalID, ODRecordRef *out, int *dir_error)
 {
     int retval = -1;
     CFStringRef cfAltSecurityIdentity = NULL;
@@ -306,8 +313,11 @@ odkerb_copy_user_record_with_alt_security_identity(CFStringRef principalID, ODRe
 
     *out = NULL;
 
-    if (odkerb_configure_search_node() != 0)
+    if (odkerb_configure_search_node() != 0) {
+        if (dir_error != NULL)
+            *dir_error = 1;
         goto failure;
+    }
 
     CFStringGetCString(principalID, principal, sizeof(principal), kCFStringEncodingUTF8);
     mbrErr = mbr_identifier_to_uuid(ID_TYPE_KERBEROS, principal, strlen(principal), user_uuid);
@@ -347,8 +357,8 @@ odkerb_copy_user_record_with_alt_security_identity(CFStringRef principalID, ODRe
 
     retval = 0;
 failure:
-    if (cfError != NULL)
-        odkerb_possibly_reset_search_node(cfError);
+    if (odkerb_possibly_reset_search_node(cfError) && dir_error != NULL)
+        *dir_error = 1;
     CF_SAFE_RELEASE(cfError);
     CF_SAFE_RELEASE(cfAltSecurityIdentity);
     CF_SAFE_RELEASE(cfQueryRef);
@@ -359,7 +369,7 @@ failure:
 }
 
 int
-odkerb_copy_search_node_with_config_record_name(CFStringRef configRecordName, ODNodeRef *out)
+odkerb_copy_search_node_with_config_record_name(CFStringRef configRecordName, ODNodeRef *out, int *dir_error)
 {
     static CFTypeRef cfVals[2];
     static CFArrayRef cfReqAttrs = NULL;
@@ -373,8 +383,11 @@ odkerb_copy_search_node_with_config_record_name(CFStringRef configRecordName, OD
 
     *out = NULL;
 
-    if (odkerb_configure_search_node() != 0)
+    if (odkerb_configure_search_node() != 0) {
+        if (dir_error != NULL)
+            *dir_error = 1;
         goto failure;
+    }
 
     if (cfReqAttrs == NULL) {
         /* hint for should be fetched */
@@ -420,8 +433,8 @@ odkerb_copy_search_node_with_config_record_name(CFStringRef configRecordName, OD
 
     retval = 0;
 failure:
-    if (cfError != NULL)
-        odkerb_possibly_reset_search_node(cfError);
+    if (odkerb_possibly_reset_search_node(cfError) && dir_error != NULL)
+        *dir_error = 1;
     CF_SAFE_RELEASE(cfError);
     CF_SAFE_RELEASE(cfOriginalNodeNames);
     CF_SAFE_RELEASE(cfConfigRecord);
@@ -429,6 +442,118 @@ failure:
     return retval;
 }
 
+odkerb_realm *
+odkerb_find_realm_locked(const char *realm, size_t realm_len)
+{
+    int i;
+
+    for (i = 0; i < gRealmCount; ++i) {
+        if (strncmp(gRealms[i].name, realm, realm_len) == 0 && gRealms[i].name[realm_len] == '\0')
+            return &gRealms[i];
+    }
+
+    return NULL;
+}
+
+/* the node named by a realm's configuration record, from the realm table
+ * if it's been found before; the caller releases it */
+int
+odkerb_copy_search_node_for_realm(const char *realm, size_t realm_len, ODNodeRef *out, int *dir_error)
+{
+    int retval = -1;
+    odkerb_realm *entry;
+    CFStringRef cfConfigRecordName = NULL;
+    ODNodeRef cfSearchNode = NULL;
+
+    ODKERB_PARAM_ASSERT(realm != 0);
+    ODKERB_PARAM_ASSERT(out != 0);
+
+    *out = NULL;
+
+    pthread_mutex_lock(&gRealmLock);
+    entry = odkerb_find_realm_locked(realm, realm_len);
+    if (entry != NULL) {
+        /* a node that has gone away is found again, as in odkerb_configure_search_node() */
+        if (entry->search_node != NULL && ODNodeGetName(entry->search_node) == NULL)
+            CF_SAFE_RELEASE(entry->search_node);
+        if (entry->search_node != NULL)
+            cfSearchNode = (ODNodeRef) CFRetain(entry->search_node);
+        cfConfigRecordName = (CFStringRef) CFRetain(entry->config_record_name);
+    }
+    pthread_mutex_unlock(&gRealmLock);
+
+    if (cfSearchNode != NULL) {
+        *out = cfSearchNode;
+        retval = 0;
+        goto failure;
+    }
+
+    if (cfConfigRecordName == NULL) {
+        cfConfigRecordName = odkerb_create_config_record_name(realm, realm_len);
+        if (cfConfigRecordName == NULL)
+            goto failure;
+    }
+
+    /* the directory is asked without the lock held */
+    if (odkerb_copy_search_node_with_config_record_name(cfConfigRecordName, &cfSearchNode, dir_error) != 0)
+        goto failure;
+
+    if (realm_len < sizeof(gRealms[0].name)) {
+        pthread_mutex_lock(&gRealmLock);
+        entry = odkerb_find_realm_locked(realm, realm_len);
+        if (entry == NULL) {
+            if (gRealmCount < kODKerbRealmTableSize) {
+                entry = &gRealms[gRealmCount++];
+            }
+            else {
+                entry = &gRealms[gRealmNext];
+                gRealmNext = (gRealmNext + 1) % kODKerbRealmTableSize;
+                CF_SAFE_RELEASE(entry->config_record_name);
+                CF_SAFE_RELEASE(entry->search_node);
+            }
+            memcpy(entry->name, realm, realm_len);
+            entry->name[realm_len] = '\0';
+            entry->config_record_name = (CFStringRef) CFRetain(cfConfigRecordName);
+        }
+        if (entry->search_node == NULL)
+            entry->search_node = (ODNodeRef) CFRetain(cfSearchNode);
+        pthread_mutex_unlock(&gRealmLock);
+    }
+
+    *out = cfSearchNode;
+    cfSearchNode = NULL;
+
+    retval = 0;
+failure:
+    CF_SAFE_RELEASE(cfSearchNode);
+    CF_SAFE_RELEASE(cfConfigRecordName);
+
+    return retval;
+}
+
+/* drops every realm, or only their nodes so they're found again next time */
+int
+odkerb_flush_realms(int nodes_only)
+{
+    int flushed;
+    int i;
+
+    pthread_mutex_lock(&gRealmLock);
+    flushed = gRealmCount;
+    for (i = 0; i < gRealmCount; ++i) {
+        CF_SAFE_RELEASE(gRealms[i].search_node);
+        if (! nodes_only)
+            CF_SAFE_RELEASE(gRealms[i].config_record_name);
+    }
+    if (! nodes_only) {
+        gRealmCount = 0;
+        gRealmNext = 0;
+    }
+    pthread_mutex_unlock(&gRealmLock);
+
+    return flushed;
+}
+
 int
 odkerb_copy_user_record_with_short_name(CFStringRef shortName, ODNodeRef searchNode, ODRecordRef *out)
 {
@@ -635,30 +760,44 @@ failure:
 }
 
 int
-odkerb_get_im_handle(char *service_principal_id, char *realm, char *im_type, char im_handle[], size_t im_handle_size)
+odkerb_lookup_im_handle(const odkerb_principal *principal, const char *realm, const char *im_type, char im_handle[], size_t im_handle_size, int *from_directory)
 {
     int retval = -1;
     int is_cross_realm;
+    const char *user_realm;
+    size_t user_realm_len;
+    char principal_id[1024];
+    int principal_id_len;
     CFStringRef cfAllegedShortName = NULL;
     CFStringRef cfRealm = NULL;
     CFStringRef cfPrincipalID = NULL;
     ODRecordRef cfUserRecord = NULL;
-    CFStringRef cfConfigRecordName = NULL;
     ODNodeRef cfSearchNode = NULL;
     CFStringRef cfIMType = NULL;
+    ODGuardCall guard;
+    int guarded = 0;
+    int dir_error = 0;
 
-    ODKERB_PARAM_ASSERT(service_principal_id != 0);
+    ODKERB_PARAM_ASSERT(principal != 0);
     ODKERB_PARAM_ASSERT(realm != 0);
     ODKERB_PARAM_ASSERT(im_type != 0);
     ODKERB_PARAM_ASSERT(im_handle != 0);
     ODKERB_PARAM_ASSERT(im_handle_size > 0);
 
     *im_handle = '\0';
+    *from_directory = 0;
+
+    /* a cross-realm user is known to the directory by their own realm,
+     * everyone else by the default one */
+    is_cross_realm = (principal->foreign_realm != NULL);
+    user_realm = is_cross_realm ? principal->foreign_realm : principal->default_realm;
+    user_realm_len = is_cross_realm ? principal->foreign_realm_len : principal->default_realm_len;
 
     /* configure the short name and realm first because they may be used
      * in the failure handler to fabricate the IM handle */
 
-    cfAllegedShortName = odkerb_create_short_name(service_principal_id);
+    cfAllegedShortName = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *) principal->short_name,
+                                                 principal->short_name_len, kCFStringEncodingUTF8, false);
     if (cfAllegedShortName == NULL) {
         ODKERB_LOG_ERRNO(LOG_ERR, ENOMEM);
         goto failure;
@@ -670,22 +809,29 @@ odkerb_get_im_handle(char *service_principal_id, char *realm, char *im_type, cha
         goto failure;
     }
 
-    is_cross_realm = odkerb_has_foreign_realm(service_principal_id);
-    if (is_cross_realm) {
-         cfPrincipalID = odkerb_create_alleged_principal_id(service_principal_id);
-    }
-    else {
-         cfPrincipalID = CFStringCreateWithCString(kCFAllocatorDefault, service_principal_id, kCFStringEncodingUTF8);
-         if (cfPrincipalID == 0)
-            ODKERB_LOG_ERRNO(LOG_ERR, ENOMEM);
+    principal_id_len = snprintf(principal_id, sizeof(principal_id), "%.*s%s%.*s",
+                                (int) principal->short_name_len, principal->short_name,
+                                user_realm_len > 0 ? "@" : "", (int) user_realm_len, user_realm);
+    if (principal_id_len < 0 || (size_t) principal_id_len >= sizeof(principal_id)) {
+        ODKERB_LOG1(LOG_WARNING, "Bad service principal: %s", principal_id);
+        goto failure;
     }
-    if (cfPrincipalID == 0)
+
+    cfPrincipalID = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *) principal_id,
+                                            principal_id_len, kCFStringEncodingUTF8, false);
+    if (cfPrincipalID == NULL) {
+        ODKERB_LOG_ERRNO(LOG_ERR, ENOMEM);
         goto failure;
+    }
 
-    if (odkerb_copy_user_record_with_alt_security_identity(cfPrincipalID, &cfUserRecord) != 0) {
-        cfConfigRecordName = odkerb_create_config_record_name(cfPrincipalID);
+    /* while the directory is considered down, go straight to the
+     * fabricated handle */
+    if (ODGuardBegin(&guard, "odkerb_lookup_im_handle") != 0)
+        goto failure;
+    guarded = 1;
 
-        if (odkerb_copy_search_node_with_config_record_name(cfConfigRecordName, &cfSearchNode) != 0)
+    if (odkerb_copy_user_record_with_alt_security_identity(cfPrincipalID, &cfUserRecord, &dir_error) != 0) {
+        if (odkerb_copy_search_node_for_realm(user_realm, user_realm_len, &cfSearchNode, &dir_error) != 0)
             goto failure;
 
         if (odkerb_copy_user_record_with_short_name(cfAllegedShortName, cfSearchNode, &cfUserRecord) != 0)
@@ -701,13 +847,18 @@ odkerb_get_im_handle(char *service_principal_id, char *realm, char *im_type, cha
     if (odkerb_get_im_handle_with_user_record(cfUserRecord, cfIMType, cfRealm, cfAllegedShortName, im_handle, im_handle_size) != 0)
         goto failure;
 
+    *from_directory = 1;
     retval = 0;
 failure:
+    /* only unexpected directory errors count against the directory */
+    if (guarded)
+        ODGuardEnd(&guard, dir_error);
+
     if (retval != 0) {
         if (is_cross_realm) {
-            ODKERB_LOG_CFSTRING(LOG_WARNING, "Unable to construct IM handle for cross-realm user", cfPrincipalID);
+            ODKERB_LOG1(LOG_WARNING, "Unable to construct IM handle for cross-realm user: %s", principal_id);
         }
-        else {
+        else if (cfAllegedShortName != NULL && cfRealm != NULL) {
             if (odkerb_get_fabricated_im_handle(cfUserRecord, cfAllegedShortName, cfRealm, im_handle, im_handle_size) == 0)
                 retval = 0;
         }
@@ -716,7 +867,6 @@ failure:
     CF_SAFE_RELEASE(cfIMType);
     CF_SAFE_RELEASE(cfUserRecord);
     CF_SAFE_RELEASE(cfSearchNode);
-    CF_SAFE_RELEASE(cfConfigRecordName);
     CF_SAFE_RELEASE(cfPrincipalID);
     CF_SAFE_RELEASE(cfRealm);
     CF_SAFE_RELEASE(cfAllegedShortName);
@@ -724,3 +874,121 @@ failure:
     return retval;
 }
 
+void
+odkerb_cache_init(void)
+{
+    if (ODCacheCreate(gCacheMaxEntries, &gCache) != 0)
+        ODKERB_LOG(LOG_ERR, "Unable to create IM handle cache");
+}
+
+int
+odkerb_configure_cache(int max_entries, int ttl, int negative_ttl)
+{
+    gCacheMaxEntries = max_entries > 0 ? max_entries : 0;
+    gCacheTTL = ttl > 0 ? ttl : 0;
+    gCacheNegativeTTL = negative_ttl > 0 ? negative_ttl : 0;
+
+    pthread_once(&gCacheOnce, odkerb_cache_init);
+    return ODCacheSetMaxEntries(gCache, gCacheMaxEntries);
+}
+
+int
+odkerb_flush_cache(void)
+{
+    ODCacheStats stats;
+
+    pthread_once(&gCacheOnce, odkerb_cache_init);
+    if (ODCacheGetStats(gCache, &stats) != 0)
+        return -1;
+
+    odkerb_log(LOG_NOTICE, "flushing %d cached IM handles (hits: %lu, misses: %lu) and %d realms",
+               stats.entries, stats.hits, stats.misses, odkerb_flush_realms(0));
+    return ODCacheFlush(gCache);
+}
+
+int
+odkerb_get_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+    ODCacheStats stats;
+
+    pthread_once(&gCacheOnce, odkerb_cache_init);
+    if (ODCacheGetStats(gCache, &stats) != 0)
+        return -1;
+
+    if (hits != NULL)
+        *hits = stats.hits;
+    if (misses != NULL)
+        *misses = stats.misses;
+
+    return 0;
+}
+
+/* Kerberos clients reconnect a lot, so answers are cached.  Handles found
+ * in the directory are kept for gCacheTTL seconds; fabricated handles and
+ * failures only for gCacheNegativeTTL, so that a newly added record or
+ * fixed directory is noticed reasonably soon. */
+int
+odkerb_get_im_handle_for_principal(const odkerb_principal *principal, const char *realm, const char *im_type, char im_handle[], size_t im_handle_size)
+{
+    int retval = -1;
+    int from_directory = 0;
+    char key[1024];
+    int key_len;
+    odkerb_cached_handle cached;
+
+    ODKERB_PARAM_ASSERT(principal != 0);
+    ODKERB_PARAM_ASSERT(principal->short_name != 0);
+    ODKERB_PARAM_ASSERT(principal->default_realm != 0);
+    ODKERB_PARAM_ASSERT(realm != 0);
+    ODKERB_PARAM_ASSERT(im_type != 0);
+    ODKERB_PARAM_ASSERT(im_handle != 0);
+    ODKERB_PARAM_ASSERT(im_handle_size > 0);
+
+    pthread_once(&gCacheOnce, odkerb_cache_init);
+
+    /* key is "principal\0realm\0im_type"; don't cache what doesn't fit */
+    key_len = snprintf(key, sizeof(key), "%.*s%s%.*s%s%.*s%c%s%c%s",
+                       (int) principal->short_name_len, principal->short_name,
+                       principal->foreign_realm != NULL ? "@" : "",
+                       (int) principal->foreign_realm_len, principal->foreign_realm != NULL ? principal->foreign_realm : "",
+                       principal->default_realm_len > 0 ? "@" : "",
+                       (int) principal->default_realm_len, principal->default_realm,
+                       0, realm, 0, im_type);
+    if (key_len < 0 || (size_t)key_len >= sizeof(key))
+        return odkerb_lookup_im_handle(principal, realm, im_type, im_handle, im_handle_size, &from_directory);
+
+    if (ODCacheGet(gCache, key, key_len, &cached, sizeof(cached), NULL) == 0) {
+        *im_handle = '\0';
+        if (cached.retval == 0 && strlcpy(im_handle, cached.im_handle, im_handle_size) >= im_handle_size) {
+            *im_handle = '\0';
+            return -1;
+        }
+        return cached.retval;
+    }
+
+    retval = odkerb_lookup_im_handle(principal, realm, im_type, im_handle, im_handle_size, &from_directory);
+
+    memset(&cached, 0, sizeof(cached));
+    cached.retval = retval;
+    if (retval != 0 || strlcpy(cached.im_handle, im_handle, sizeof(cached.im_handle)) < sizeof(cached.im_handle))
+        ODCacheSet(gCache, key, key_len, &cached, sizeof(cached), (retval == 0 && from_directory) ? gCacheTTL : gCacheNegativeTTL);
+
+    return retval;
+}
+
+int
+odkerb_get_im_handle(char *service_principal_id, char *realm, char *im_type, char im_handle[], size_t im_handle_size)
+{
+    odkerb_principal principal;
+
+    ODKERB_PARAM_ASSERT(service_principal_id != 0);
+    ODKERB_PARAM_ASSERT(im_handle != 0);
+    ODKERB_PARAM_ASSERT(im_handle_size > 0);
+
+    *im_handle = '\0';
+
+    if (odkerb_parse_principal(service_principal_id, strlen(service_principal_id), &principal) != 0)
+        return -1;
+
+    return odkerb_get_im_handle_for_principal(&principal, realm, im_type, im_handle, im_handle_size);
+}
@@ -13,6 +13,33 @@
 
 #define kIMTypeJABBER "JABBER:"
 
+/* IM handle cache defaults (entries, seconds) */
+#define kODKerbCacheDefaultSize         1024
+#define kODKerbCacheDefaultTTL          600
+#define kODKerbCacheDefaultNegativeTTL  60
+
+/* realms whose configuration record and search node are kept */
+#define kODKerbRealmTableSize           16
+
+/* a service principal, "name@REALM" or for a cross-realm user
+ * "name@FOREIGN.REALM@REALM", as slices of the caller's string; nothing
+ * is copied, so the string has to outlive the struct */
+typedef struct odkerb_principal {
+    const char *short_name;
+    size_t short_name_len;
+    const char *default_realm;
+    size_t default_realm_len;
+    const char *foreign_realm;      /* NULL unless cross-realm */
+    size_t foreign_realm_len;
+} odkerb_principal;
+
+int odkerb_parse_principal(const char *s, size_t len, odkerb_principal *out);
+
 int odkerb_get_im_handle(char *service_principal_id, char *realm, char *im_type, char im_handle[], size_t im_handle_size);
+int odkerb_get_im_handle_for_principal(const odkerb_principal *principal, const char *realm, const char *im_type, char im_handle[], size_t im_handle_size);
+
+int odkerb_configure_cache(int max_entries, int ttl, int negative_ttl);
+int odkerb_flush_cache(void);
+int odkerb_get_cache_stats(unsigned long *hits, unsigned long *misses);
 
 #endif
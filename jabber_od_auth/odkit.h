@@ -26,6 +26,9 @@ int ODKVerifyClientRequest(ODKSession *session, CFDataRef clientRequest);
 int ODKCopyServerResponse(ODKSession *session, CFStringRef *userNameOut, CFDataRef *serverResponseOut);
 int ODKFlushSession(ODKSession *session);
 
+/* drop all per-exchange state so the session can be used again */
+int ODKResetSession(ODKSession *session);
+
 char *ODKGetError(ODKSession *session);
 
 int ODKMaybeCreateString(ODKSession *session, CFStringRef *dst, const char *src);
@@ -545,6 +545,34 @@ done:
     return retval;    
 }
 
+int
+ODKResetSession(ODKSession *session)
+{
+    int retval = -1;
+    ODKSessionPriv *_session = ODK_SESSION_PRIV(session);
+
+    ODK_PARAM_ASSERT(session != 0);
+
+    /* forget everything about the previous exchange ... */
+    CF_SAFE_RELEASE(_session->authMethod);
+    CF_SAFE_RELEASE(_session->userName);
+    CF_SAFE_RELEASE(_session->userRecord);
+    CF_SAFE_RELEASE(_session->serverChallenge);
+    CF_SAFE_RELEASE(_session->serverResponse);
+    CF_SAFE_RELEASE(_session->adNode);
+    *_session->buffer = '\0';
+    *_session->error = '\0';
+
+    /* ... and pick up the current AD node, as ODKCreateSession does */
+    _session->useActiveDirectory = kODKActiveDirectoryUnknown;
+    _session->adNode = ODKGetADInfo(session)->adNode;
+    if (_session->adNode)
+        CFRetain(_session->adNode);
+
+    retval = 0;
+    return retval;
+}
+
 int
 ODKDeleteSession(ODKSession **out)
 {
@@ -824,47 +852,42 @@ ODKParseUsername(ODKSession *session, CFStringRef client, CFStringRef *userNameO
 {
     ODKSessionPriv *_session = ODK_SESSION_PRIV(session);
     int retval = -1;
-    char *in = 0;
+    const char *in = 0;
+    ODKDigestPair pair;
 
     *userNameOut = 0;
 
-    _session->buffer[0] = '\0';
+    /* the parser doesn't modify its input, so only copy when we have to */
+    in = CFStringGetCStringPtr(client, kCFStringEncodingUTF8);
+    if (in == NULL) {
+        _session->buffer[0] = '\0';
+        if (!CFStringGetCString(client, _session->buffer, sizeof(_session->buffer), kCFStringEncodingUTF8)) {
+            ODK_LOG(LOG_ERR, "Parse failure");
+            goto done;
+        }
+        in = _session->buffer;
+    }
 
-    if (!CFStringGetCString(client, _session->buffer, sizeof(_session->buffer), kCFStringEncodingUTF8)) {
-        ODK_LOG(LOG_ERR, "Parse failure");
+    /* no username, or not a directive list: leave it to the caller */
+    if (ODKDigestFindPair(in, strlen(in), "username", &pair) != 1) {
+        retval = 0;
         goto done;
     }
 
-    in = _session->buffer;
-
-    /* parse what we got */
-    while (in[0] != '\0') {
-        char *name = 0;
-        char *value = 0;
-
-        ODKGetPair(&in, &name, &value);
-        if (name == 0)
-            break;
-
-        if (value == 0)
-            continue;
+    if (pair.escaped) {
+        char value[256];
 
-        if (strcasecmp(name, "username") == 0) {
-            *userNameOut  = CFStringCreateWithCString(kCFAllocatorDefault, value, kCFStringEncodingUTF8);
-            if (*userNameOut == NULL) {
-                ODK_LOG(LOG_ERR, "Re-encoding failure");
-                goto done;
-            }
-
-#if 1
-            break;
-#else
-        } else if (strcasecmp(name, "authzid") == 0) {
-            *authzidOut = strdup(value);
-        } else if (strcasecmp(name, "algorithm") == 0) {
-            *algorithmOut = strdup(value);
-#endif
+        if (ODKDigestCopyValue(&pair, value, sizeof(value)) < 0) {
+            ODK_LOG(LOG_ERR, "Username too long");
+            goto done;
         }
+        *userNameOut = CFStringCreateWithCString(kCFAllocatorDefault, value, kCFStringEncodingUTF8);
+    } else {
+        *userNameOut = CFStringCreateWithBytes(kCFAllocatorDefault, (const UInt8 *) pair.value, pair.valueLen, kCFStringEncodingUTF8, false);
+    }
+    if (*userNameOut == NULL) {
+        ODK_LOG(LOG_ERR, "Re-encoding failure");
+        goto done;
     }
 
     retval = 0;
@@ -0,0 +1,419 @@
+/*
+ *  odnonce.c
+ *
+ *  random bytes for challenges, nonces and stream ids, and a record of
+ *  the CRAM-MD5 challenges that are waiting for an answer
+ *
+ *  Each thread keeps a buffer of random bytes which it refills from
+ *  arc4random_buf() a page at a time, so handing out a nonce is a copy
+ *  rather than a trip to the kernel.  Bytes are wiped from the buffer as
+ *  they're handed out, and a child process throws its parent's buffer
+ *  away rather than repeat it.
+ *
+ *  Every CRAM-MD5 challenge is remembered until it's answered or its ttl
+ *  runs out, and a response to anything else is refused before it gets
+ *  to the directory, so a captured challenge and response can't be
+ *  played back.  The record is a bounded table of keyed hashes; when it
+ *  fills up the challenge closest to expiring is forgotten, and whoever
+ *  was sent it has to ask again.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "odnonce.h"
+
+#define kODNonceBufferSize      4096
+#define kODNonceProbeLimit      32
+#define kODNonceMinSize         64
+
+typedef struct ODNonceBuffer {
+    pid_t pid;
+    size_t used;
+    unsigned char bytes[kODNonceBufferSize];
+} ODNonceBuffer;
+
+typedef struct ODNonceChallenge {
+    uint64_t key;               /* 0 = free */
+    time_t expires;
+} ODNonceChallenge;
+
+typedef struct ODNonce {
+    pthread_mutex_t lock;
+    int ttl;
+    int size;
+    uint64_t secret;
+    ODNonceChallenge *challenges;
+    unsigned int mask;
+    ODNonceStats stats;
+} ODNonce;
+
+static ODNonce gNonce = {
+    PTHREAD_MUTEX_INITIALIZER,
+    kODNonceDefaultTTL,
+    kODNonceDefaultSize,
+};
+
+static pthread_once_t gNonceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t gNonceKey;
+static uint16_t gNonceHex[256];
+
+static const char gNonceBase64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static void ODNonceInit(void);
+static void ODNonceFreeBuffer(void *buffer);
+static ODNonceBuffer *ODNonceGetBuffer(void);
+static int ODNonceAllocateLocked(void);
+static uint64_t ODNonceHashLocked(const char *challenge);
+
+void
+ODNonceInit(void)
+{
+    static const char hex[] = "0123456789abcdef";
+    char pair[2];
+    int i;
+
+    pthread_key_create(&gNonceKey, ODNonceFreeBuffer);
+
+    /* two characters a byte in one store */
+    for (i = 0; i < 256; ++i) {
+        pair[0] = hex[i >> 4];
+        pair[1] = hex[i & 0xf];
+        memcpy(&gNonceHex[i], pair, sizeof(gNonceHex[i]));
+    }
+}
+
+void
+ODNonceFreeBuffer(void *buffer)
+{
+    memset(buffer, 0, sizeof(ODNonceBuffer));
+    free(buffer);
+}
+
+ODNonceBuffer *
+ODNonceGetBuffer(void)
+{
+    ODNonceBuffer *buffer;
+
+    pthread_once(&gNonceOnce, ODNonceInit);
+
+    buffer = (ODNonceBuffer *) pthread_getspecific(gNonceKey);
+    if (buffer == NULL) {
+        buffer = (ODNonceBuffer *) malloc(sizeof(*buffer));
+        if (buffer == NULL)
+            return NULL;
+        buffer->pid = 0;
+        if (pthread_setspecific(gNonceKey, buffer) != 0) {
+            free(buffer);
+            return NULL;
+        }
+    }
+
+    /* a fresh buffer, or one inherited across fork() */
+    if (buffer->pid != getpid()) {
+        buffer->pid = getpid();
+        buffer->used = kODNonceBufferSize;
+    }
+
+    return buffer;
+}
+
+int
+ODNonceBytes(void *out, size_t len)
+{
+    unsigned char *p = (unsigned char *) out;
+    ODNonceBuffer *buffer;
+    size_t n;
+
+    if (out == NULL)
+        return -1;
+
+    buffer = ODNonceGetBuffer();
+    if (buffer == NULL)
+        return -1;
+
+    /* too big to be worth buffering */
+    if (len > kODNonceBufferSize / 4) {
+        arc4random_buf(out, len);
+        return 0;
+    }
+
+    while (len > 0) {
+        if (buffer->used == kODNonceBufferSize) {
+            arc4random_buf(buffer->bytes, kODNonceBufferSize);
+            buffer->used = 0;
+
+            pthread_mutex_lock(&gNonce.lock);
+            ++gNonce.stats.refills;
+            pthread_mutex_unlock(&gNonce.lock);
+        }
+
+        n = kODNonceBufferSize - buffer->used;
+        if (n > len)
+            n = len;
+
+        memcpy(p, &buffer->bytes[buffer->used], n);
+        memset(&buffer->bytes[buffer->used], 0, n);
+        buffer->used += n;
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int
+ODNonceHexEncode(const void *in, size_t inLen, char *out, size_t outLen)
+{
+    const unsigned char *p = (const unsigned char *) in;
+    size_t i;
+
+    if (out == NULL || outLen < ODNonceHexLength(inLen))
+        return -1;
+
+    pthread_once(&gNonceOnce, ODNonceInit);
+
+    for (i = 0; i < inLen; ++i)
+        memcpy(&out[2 * i], &gNonceHex[p[i]], 2);
+    out[2 * inLen] = '\0';
+
+    return (int) (2 * inLen);
+}
+
+int
+ODNonceBase64Encode(const void *in, size_t inLen, char *out, size_t outLen)
+{
+    const unsigned char *p = (const unsigned char *) in;
+    char *o = out;
+    uint32_t v;
+    size_t i;
+
+    if (out == NULL || outLen < ODNonceBase64Length(inLen))
+        return -1;
+
+    /* whole groups of three bytes */
+    for (i = 0; i + 3 <= inLen; i += 3) {
+        v = ((uint32_t) p[i] << 16) | ((uint32_t) p[i + 1] << 8) | p[i + 2];
+        o[0] = gNonceBase64[v >> 18];
+        o[1] = gNonceBase64[(v >> 12) & 0x3f];
+        o[2] = gNonceBase64[(v >> 6) & 0x3f];
+        o[3] = gNonceBase64[v & 0x3f];
+        o += 4;
+    }
+
+    /* and what's left, padded */
+    if (i < inLen) {
+        v = (uint32_t) p[i] << 16;
+        if (i + 1 < inLen)
+            v |= (uint32_t) p[i + 1] << 8;
+        o[0] = gNonceBase64[v >> 18];
+        o[1] = gNonceBase64[(v >> 12) & 0x3f];
+        o[2] = (i + 1 < inLen) ? gNonceBase64[(v >> 6) & 0x3f] : '=';
+        o[3] = '=';
+        o += 4;
+    }
+    *o = '\0';
+
+    return (int) (o - out);
+}
+
+int
+ODNonceHex(char *out, size_t outLen, size_t len)
+{
+    unsigned char bytes[kODNonceBufferSize / 4];
+    int retval;
+
+    if (len > sizeof(bytes) || ODNonceBytes(bytes, len) != 0)
+        return -1;
+
+    retval = ODNonceHexEncode(bytes, len, out, outLen);
+    memset(bytes, 0, len);
+
+    return retval;
+}
+
+int
+ODNonceAllocateLocked(void)
+{
+    ODNonceChallenge *challenges;
+    unsigned int slots = 1;
+
+    /* at most a quarter full, so probes stay short and nothing live is pushed out */
+    while (slots < (unsigned int) gNonce.size * 4)
+        slots <<= 1;
+
+    challenges = (ODNonceChallenge *) calloc(slots, sizeof(*challenges));
+    if (challenges == NULL)
+        return -1;
+
+    free(gNonce.challenges);
+    gNonce.challenges = challenges;
+    gNonce.mask = slots - 1;
+
+    return 0;
+}
+
+uint64_t
+ODNonceHashLocked(const char *challenge)
+{
+    const unsigned char *p = (const unsigned char *) challenge;
+    uint64_t h = 14695981039346656037ULL ^ gNonce.secret;  /* FNV-1a, keyed */
+
+    for (; *p != '\0'; ++p)
+        h = (h ^ *p) * 1099511628211ULL;
+
+    return h != 0 ? h : 1;
+}
+
+int
+ODNonceConfigure(int ttl, int size)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&gNonce.lock);
+
+    gNonce.ttl = ttl > 0 ? ttl : kODNonceDefaultTTL;
+
+    if (size <= 0)
+        size = kODNonceDefaultSize;
+    if (size < kODNonceMinSize)
+        size = kODNonceMinSize;
+    if (size != gNonce.size) {
+        gNonce.size = size;
+        /* challenges already out are forgotten, so those logins start over */
+        if (gNonce.challenges != NULL && ODNonceAllocateLocked() != 0)
+            goto failure;
+    }
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gNonce.lock);
+
+    return retval;
+}
+
+int
+ODNonceIssueChallenge(char *out, size_t outLen)
+{
+    unsigned char bytes[kODNonceChallengeBytes];
+    ODNonceChallenge *entry, *victim = NULL;
+    time_t now = time(NULL);
+    uint64_t key;
+    int retval = -1;
+    int i;
+
+    if (out == NULL || outLen < kODNonceChallengeBufferSize)
+        return -1;
+
+    if (ODNonceBytes(bytes, sizeof(bytes)) != 0)
+        return -1;
+    ODNonceHexEncode(bytes, sizeof(bytes), out, outLen);
+    memset(bytes, 0, sizeof(bytes));
+
+    pthread_mutex_lock(&gNonce.lock);
+
+    if (gNonce.challenges == NULL) {
+        if (ODNonceAllocateLocked() != 0)
+            goto failure;
+        arc4random_buf(&gNonce.secret, sizeof(gNonce.secret));
+    }
+
+    /* a free slot, an expired one, or failing those the one closest to expiring */
+    key = ODNonceHashLocked(out);
+    for (i = 0; i < kODNonceProbeLimit; ++i) {
+        entry = &gNonce.challenges[(key + i) & gNonce.mask];
+        if (entry->key == 0 || entry->expires < now) {
+            victim = entry;
+            break;
+        }
+        if (victim == NULL || entry->expires < victim->expires)
+            victim = entry;
+    }
+    if (victim->key != 0 && victim->expires >= now)
+        ++gNonce.stats.evicted;
+
+    victim->key = key;
+    victim->expires = now + gNonce.ttl;
+    ++gNonce.stats.issued;
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gNonce.lock);
+
+    if (retval != 0)
+        out[0] = '\0';
+
+    return retval;
+}
+
+int
+ODNonceRedeemChallenge(const char *challenge)
+{
+    ODNonceChallenge *entry;
+    time_t now = time(NULL);
+    uint64_t key;
+    int retval = kODNonceUnknown;
+    int i;
+
+    if (challenge == NULL || *challenge == '\0')
+        return kODNonceUnknown;
+
+    pthread_mutex_lock(&gNonce.lock);
+
+    if (gNonce.challenges != NULL) {
+        key = ODNonceHashLocked(challenge);
+        for (i = 0; i < kODNonceProbeLimit; ++i) {
+            entry = &gNonce.challenges[(key + i) & gNonce.mask];
+            if (entry->key != key)
+                continue;
+
+            retval = (entry->expires >= now) ? kODNonceValid : kODNonceExpired;
+            entry->key = 0;
+            break;
+        }
+    }
+
+    if (retval == kODNonceValid)
+        ++gNonce.stats.redeemed;
+    else if (retval == kODNonceExpired)
+        ++gNonce.stats.expired;
+    else
+        ++gNonce.stats.unknown;
+
+    pthread_mutex_unlock(&gNonce.lock);
+
+    return retval;
+}
+
+int
+ODNonceGetStats(ODNonceStats *statsOut)
+{
+    if (statsOut == NULL)
+        return -1;
+
+    pthread_mutex_lock(&gNonce.lock);
+    *statsOut = gNonce.stats;
+    pthread_mutex_unlock(&gNonce.lock);
+
+    return 0;
+}
+
+void
+ODNonceLogStats(void)
+{
+    ODNonceStats stats;
+
+    ODNonceGetStats(&stats);
+    /* nothing to say in processes that never issue challenges */
+    if (stats.issued == 0 && stats.unknown == 0 && stats.expired == 0)
+        return;
+
+    syslog(LOG_NOTICE, "challenges: %lu issued, %lu answered, %lu unknown or replayed, %lu expired, %lu forgotten; %lu random buffer refills",
+           stats.issued, stats.redeemed, stats.unknown, stats.expired, stats.evicted, stats.refills);
+}
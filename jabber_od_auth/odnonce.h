@@ -0,0 +1,67 @@
+/*
+ *  odnonce.h
+ *
+ *  random bytes for challenges, nonces and stream ids, and a record of
+ *  the CRAM-MD5 challenges that are waiting for an answer
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODNONCE_H__
+#define __ODNONCE_H__
+
+#include <stddef.h>
+
+/* ODNonceRedeemChallenge() results */
+enum {
+    kODNonceValid = 0,
+    kODNonceUnknown,            /* never issued, already answered or forgotten */
+    kODNonceExpired
+};
+
+#define kODNonceDefaultTTL          300     /* seconds a challenge can be answered in */
+#define kODNonceDefaultSize         4096    /* challenges waiting for an answer */
+
+/* random bytes in a challenge, and the hex characters plus nul they take */
+#define kODNonceChallengeBytes      32
+#define kODNonceChallengeBufferSize (2 * kODNonceChallengeBytes + 1)
+
+/* characters, plus a nul, needed to encode len bytes */
+#define ODNonceHexLength(len)       (2 * (len) + 1)
+#define ODNonceBase64Length(len)    (4 * (((len) + 2) / 3) + 1)
+
+typedef struct ODNonceStats {
+    unsigned long refills;      /* times a thread's buffer of random bytes ran out */
+    unsigned long issued;
+    unsigned long redeemed;
+    unsigned long unknown;
+    unsigned long expired;
+    unsigned long evicted;      /* forgotten while still waiting, to make room */
+} ODNonceStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int ODNonceConfigure(int ttl, int size);
+
+/* from a per-thread buffer, refilled in bulk */
+int ODNonceBytes(void *out, size_t len);
+int ODNonceHex(char *out, size_t outLen, size_t len);
+
+/* both return the characters written, not counting the nul, or -1 if out is too small */
+int ODNonceHexEncode(const void *in, size_t inLen, char *out, size_t outLen);
+int ODNonceBase64Encode(const void *in, size_t inLen, char *out, size_t outLen);
+
+/* a challenge can only be redeemed once */
+int ODNonceIssueChallenge(char *out, size_t outLen);
+int ODNonceRedeemChallenge(const char *challenge);
+
+int ODNonceGetStats(ODNonceStats *statsOut);
+void ODNonceLogStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
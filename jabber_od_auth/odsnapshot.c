@@ -0,0 +1,878 @@
+/*
+ *  odsnapshot.c
+ *
+ *  read-only, memory-mapped snapshot of directory users, UUIDs, groups
+ *  and (flattened) group memberships
+ *
+ *  The file is a header followed by fixed-size user and group records,
+ *  hash bucket arrays, member records and a string table.  Every lookup
+ *  is a hash probe into the mapping; nothing is copied or allocated.
+ *  Group membership is stored already flattened (nested groups resolved),
+ *  so a membership check is one probe in the group's member table.
+ *
+ *  Snapshots are replaced by writing a new file and renaming it over the
+ *  old one.  ODSnapshotRefresh() notices the new inode and maps it; the
+ *  old mapping is unmapped once the last reader using it is done.
+ *
+ *  This file only uses POSIX so the snapshot can be built and served on
+ *  hosts without Open Directory.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "odsnapshot.h"
+
+#define kODSnapshotMagic        "ODSNAP01"
+#define kODSnapshotByteOrder    0x01020304
+#define kODSnapshotMaxFileSize  0x7fffffff
+
+typedef struct ODSnapshotHeader {
+    char magic[8];
+    uint32_t byteOrder;
+    uint32_t fileSize;
+    uint32_t userCount;
+    uint32_t userBucketCount;
+    uint32_t usersOffset;
+    uint32_t userBucketsOffset;
+    uint32_t groupCount;
+    uint32_t groupBucketCount;
+    uint32_t groupsOffset;
+    uint32_t groupBucketsOffset;
+    uint32_t memberCount;
+    uint32_t membersOffset;
+    uint32_t memberBucketCount;
+    uint32_t memberBucketsOffset;
+    uint32_t stringsOffset;
+    uint32_t stringsSize;
+} ODSnapshotHeader;
+
+/* chains hold record index + 1; 0 ends a chain */
+typedef struct ODSnapshotUser {
+    uint32_t hash;
+    uint32_t name;          /* offset into the string table */
+    uint32_t next;
+    unsigned char uuid[16];
+} ODSnapshotUser;
+
+typedef struct ODSnapshotGroup {
+    uint32_t hash;
+    uint32_t name;
+    uint32_t next;
+    uint32_t memberCount;
+    uint32_t firstBucket;   /* this group's slice of the member buckets */
+    uint32_t bucketCount;
+} ODSnapshotGroup;
+
+typedef struct ODSnapshotMember {
+    uint32_t user;          /* user record index */
+    uint32_t next;
+} ODSnapshotMember;
+
+typedef struct ODSnapshotMap {
+    int refCount;
+    void *base;
+    size_t length;
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+} ODSnapshotMap;
+
+struct ODSnapshot {
+    pthread_mutex_t lock;
+    char *path;
+    ODSnapshotMap *map;
+    time_t lastCheck;
+};
+
+typedef struct ODSnapshotBuilderUser {
+    char *name;
+    unsigned char uuid[16];
+} ODSnapshotBuilderUser;
+
+typedef struct ODSnapshotBuilderGroup {
+    char *name;
+    char **members;
+    int memberCount;
+    int memberCapacity;
+} ODSnapshotBuilderGroup;
+
+struct ODSnapshotBuilder {
+    ODSnapshotBuilderUser *users;
+    int userCount;
+    int userCapacity;
+    ODSnapshotBuilderGroup *groups;
+    int groupCount;
+    int groupCapacity;
+};
+
+static uint32_t ODSnapshotHash(const char *s);
+static int ODSnapshotMapFile(const char *path, ODSnapshotMap **mapOut);
+static void ODSnapshotReleaseMap(ODSnapshot *snapshot, ODSnapshotMap *map);
+static ODSnapshotMap *ODSnapshotRetainMap(ODSnapshot *snapshot);
+static const ODSnapshotUser *ODSnapshotLookupUser(const ODSnapshotMap *map, const char *userName, uint32_t *indexOut);
+static const ODSnapshotGroup *ODSnapshotLookupGroup(const ODSnapshotMap *map, const char *groupName);
+static ODSnapshotBuilderGroup *ODSnapshotBuilderFindGroup(ODSnapshotBuilder *builder, const char *groupName);
+static int ODSnapshotParseUUID(const char *s, unsigned char uuid[16]);
+
+uint32_t
+ODSnapshotHash(const char *s)
+{
+    uint32_t h = 5381;
+
+    for (; *s != '\0'; ++s)
+        h = ((h << 5) + h) + (unsigned char)*s;
+
+    return h;
+}
+
+/* sizes and offsets are checked once here so lookups need only check
+ * record indexes against the counts in the header */
+int
+ODSnapshotMapFile(const char *path, ODSnapshotMap **mapOut)
+{
+    int retval = -1;
+    int fd = -1;
+    struct stat sb;
+    void *base = MAP_FAILED;
+    const ODSnapshotHeader *hdr;
+    ODSnapshotMap *map = NULL;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        goto failure;
+
+    if (fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(*hdr) || sb.st_size > kODSnapshotMaxFileSize)
+        goto failure;
+
+    base = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+        goto failure;
+
+    hdr = base;
+    if (memcmp(hdr->magic, kODSnapshotMagic, sizeof(hdr->magic)) != 0
+        || hdr->byteOrder != kODSnapshotByteOrder
+        || hdr->fileSize != (uint32_t)sb.st_size
+        || hdr->userBucketCount == 0 || hdr->groupBucketCount == 0)
+        goto failure;
+
+#define REGION_OK(off, count, size) \
+    ((off) <= hdr->fileSize && (uint64_t)(count) * (size) <= hdr->fileSize - (off) && (off) % sizeof(uint32_t) == 0)
+
+    if (!REGION_OK(hdr->usersOffset, hdr->userCount, sizeof(ODSnapshotUser))
+        || !REGION_OK(hdr->userBucketsOffset, hdr->userBucketCount, sizeof(uint32_t))
+        || !REGION_OK(hdr->groupsOffset, hdr->groupCount, sizeof(ODSnapshotGroup))
+        || !REGION_OK(hdr->groupBucketsOffset, hdr->groupBucketCount, sizeof(uint32_t))
+        || !REGION_OK(hdr->membersOffset, hdr->memberCount, sizeof(ODSnapshotMember))
+        || !REGION_OK(hdr->memberBucketsOffset, hdr->memberBucketCount, sizeof(uint32_t))
+        || hdr->stringsOffset > hdr->fileSize || hdr->stringsSize > hdr->fileSize - hdr->stringsOffset
+        || hdr->stringsSize == 0
+        || ((const char *)base)[hdr->stringsOffset + hdr->stringsSize - 1] != '\0')
+        goto failure;
+
+#undef REGION_OK
+
+    map = calloc(1, sizeof(*map));
+    if (map == NULL)
+        goto failure;
+
+    map->refCount = 1;
+    map->base = base;
+    map->length = (size_t)sb.st_size;
+    map->dev = sb.st_dev;
+    map->ino = sb.st_ino;
+    map->mtime = sb.st_mtime;
+    base = MAP_FAILED;
+
+    *mapOut = map;
+    retval = 0;
+failure:
+    if (base != MAP_FAILED)
+        munmap(base, (size_t)sb.st_size);
+    if (fd >= 0)
+        close(fd);
+    return retval;
+}
+
+ODSnapshotMap *
+ODSnapshotRetainMap(ODSnapshot *snapshot)
+{
+    ODSnapshotMap *map;
+
+    pthread_mutex_lock(&snapshot->lock);
+    map = snapshot->map;
+    if (map != NULL)
+        ++map->refCount;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    return map;
+}
+
+void
+ODSnapshotReleaseMap(ODSnapshot *snapshot, ODSnapshotMap *map)
+{
+    int last;
+
+    if (map == NULL)
+        return;
+
+    pthread_mutex_lock(&snapshot->lock);
+    last = (--map->refCount == 0);
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (last) {
+        munmap(map->base, map->length);
+        free(map);
+    }
+}
+
+const ODSnapshotUser *
+ODSnapshotLookupUser(const ODSnapshotMap *map, const char *userName, uint32_t *indexOut)
+{
+    const char *base = map->base;
+    const ODSnapshotHeader *hdr = map->base;
+    const ODSnapshotUser *users = (const ODSnapshotUser *)(base + hdr->usersOffset);
+    const uint32_t *buckets = (const uint32_t *)(base + hdr->userBucketsOffset);
+    const char *strings = base + hdr->stringsOffset;
+    uint32_t hash = ODSnapshotHash(userName);
+    uint32_t i, steps;
+
+    /* the step count bounds the walk if a chain was corrupted into a loop */
+    for (i = buckets[hash % hdr->userBucketCount], steps = 0; i != 0 && i <= hdr->userCount && steps < hdr->userCount; i = users[i - 1].next, ++steps) {
+        const ODSnapshotUser *user = &users[i - 1];
+        if (user->hash == hash && user->name < hdr->stringsSize && strcmp(strings + user->name, userName) == 0) {
+            if (indexOut != NULL)
+                *indexOut = i - 1;
+            return user;
+        }
+    }
+
+    return NULL;
+}
+
+const ODSnapshotGroup *
+ODSnapshotLookupGroup(const ODSnapshotMap *map, const char *groupName)
+{
+    const char *base = map->base;
+    const ODSnapshotHeader *hdr = map->base;
+    const ODSnapshotGroup *groups = (const ODSnapshotGroup *)(base + hdr->groupsOffset);
+    const uint32_t *buckets = (const uint32_t *)(base + hdr->groupBucketsOffset);
+    const char *strings = base + hdr->stringsOffset;
+    uint32_t hash = ODSnapshotHash(groupName);
+    uint32_t i, steps;
+
+    for (i = buckets[hash % hdr->groupBucketCount], steps = 0; i != 0 && i <= hdr->groupCount && steps < hdr->groupCount; i = groups[i - 1].next, ++steps) {
+        const ODSnapshotGroup *group = &groups[i - 1];
+        if (group->hash == hash && group->name < hdr->stringsSize && strcmp(strings + group->name, groupName) == 0)
+            return group;
+    }
+
+    return NULL;
+}
+
+int
+ODSnapshotOpen(const char *path, ODSnapshot **snapshotOut)
+{
+    int retval = -1;
+    ODSnapshot *snapshot = NULL;
+
+    if (path == NULL || snapshotOut == NULL)
+        goto failure;
+
+    snapshot = calloc(1, sizeof(*snapshot));
+    if (snapshot == NULL)
+        goto failure;
+
+    snapshot->path = strdup(path);
+    if (snapshot->path == NULL || pthread_mutex_init(&snapshot->lock, NULL) != 0) {
+        free(snapshot->path);
+        free(snapshot);
+        snapshot = NULL;
+        goto failure;
+    }
+
+    /* a missing or bad file is not fatal; lookups fall through until a
+     * good snapshot shows up */
+    (void)ODSnapshotMapFile(path, &snapshot->map);
+    snapshot->lastCheck = time(NULL);
+
+    *snapshotOut = snapshot;
+    retval = 0;
+failure:
+    return retval;
+}
+
+int
+ODSnapshotClose(ODSnapshot **snapshotOut)
+{
+    ODSnapshot *snapshot;
+
+    if (snapshotOut == NULL || *snapshotOut == NULL)
+        return -1;
+
+    snapshot = *snapshotOut;
+    ODSnapshotReleaseMap(snapshot, snapshot->map);
+    pthread_mutex_destroy(&snapshot->lock);
+    free(snapshot->path);
+    free(snapshot);
+    *snapshotOut = NULL;
+
+    return 0;
+}
+
+int
+ODSnapshotRefresh(ODSnapshot *snapshot)
+{
+    struct stat sb;
+    time_t now = time(NULL);
+    ODSnapshotMap *map = NULL;
+    ODSnapshotMap *old = NULL;
+    int changed;
+
+    if (snapshot == NULL)
+        return -1;
+
+    pthread_mutex_lock(&snapshot->lock);
+    if (now - snapshot->lastCheck < kODSnapshotCheckInterval) {
+        pthread_mutex_unlock(&snapshot->lock);
+        return 0;
+    }
+    snapshot->lastCheck = now;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (stat(snapshot->path, &sb) != 0)
+        return -1;
+
+    pthread_mutex_lock(&snapshot->lock);
+    changed = (snapshot->map == NULL || snapshot->map->dev != sb.st_dev
+               || snapshot->map->ino != sb.st_ino || snapshot->map->mtime != sb.st_mtime);
+    pthread_mutex_unlock(&snapshot->lock);
+
+    if (!changed)
+        return 0;
+
+    /* keep serving the old snapshot if the new one is unreadable */
+    if (ODSnapshotMapFile(snapshot->path, &map) != 0)
+        return -1;
+
+    pthread_mutex_lock(&snapshot->lock);
+    old = snapshot->map;
+    snapshot->map = map;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    ODSnapshotReleaseMap(snapshot, old);
+
+    return 0;
+}
+
+/* skip the kODSnapshotCheckInterval throttle */
+int
+ODSnapshotForceRefresh(ODSnapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return -1;
+
+    pthread_mutex_lock(&snapshot->lock);
+    snapshot->lastCheck = 0;
+    pthread_mutex_unlock(&snapshot->lock);
+
+    return ODSnapshotRefresh(snapshot);
+}
+
+int
+ODSnapshotFindUser(ODSnapshot *snapshot, const char *userName, unsigned char uuidOut[16])
+{
+    int retval = -1;
+    ODSnapshotMap *map;
+    const ODSnapshotUser *user;
+
+    if (snapshot == NULL || userName == NULL)
+        return -1;
+
+    map = ODSnapshotRetainMap(snapshot);
+    if (map == NULL)
+        return -1;
+
+    user = ODSnapshotLookupUser(map, userName, NULL);
+    if (user != NULL) {
+        if (uuidOut != NULL)
+            memcpy(uuidOut, user->uuid, sizeof(user->uuid));
+        retval = 0;
+    }
+
+    ODSnapshotReleaseMap(snapshot, map);
+    return retval;
+}
+
+int
+ODSnapshotCheckGroupMembership(ODSnapshot *snapshot, const char *userName, const char *groupName, int *isMemberOut)
+{
+    int retval = -1;
+    ODSnapshotMap *map;
+    const ODSnapshotHeader *hdr;
+    const ODSnapshotGroup *group;
+    const ODSnapshotMember *members;
+    const uint32_t *buckets;
+    uint32_t userIndex, i, steps;
+
+    if (snapshot == NULL || userName == NULL || groupName == NULL || isMemberOut == NULL)
+        return -1;
+
+    map = ODSnapshotRetainMap(snapshot);
+    if (map == NULL)
+        return -1;
+
+    hdr = map->base;
+
+    if (ODSnapshotLookupUser(map, userName, &userIndex) == NULL)
+        goto failure;
+
+    group = ODSnapshotLookupGroup(map, groupName);
+    if (group == NULL) {
+        retval = ENOENT;
+        goto failure;
+    }
+
+    *isMemberOut = 0;
+    retval = 0;
+
+    if (group->bucketCount == 0 || group->firstBucket > hdr->memberBucketCount
+        || group->bucketCount > hdr->memberBucketCount - group->firstBucket)
+        goto failure;
+
+    members = (const ODSnapshotMember *)((const char *)map->base + hdr->membersOffset);
+    buckets = (const uint32_t *)((const char *)map->base + hdr->memberBucketsOffset) + group->firstBucket;
+
+    for (i = buckets[userIndex % group->bucketCount], steps = 0; i != 0 && i <= hdr->memberCount && steps < group->memberCount; i = members[i - 1].next, ++steps) {
+        if (members[i - 1].user == userIndex) {
+            *isMemberOut = 1;
+            break;
+        }
+    }
+
+failure:
+    ODSnapshotReleaseMap(snapshot, map);
+    return retval;
+}
+
+int
+ODSnapshotBuilderCreate(ODSnapshotBuilder **builderOut)
+{
+    if (builderOut == NULL)
+        return -1;
+
+    *builderOut = calloc(1, sizeof(**builderOut));
+
+    return *builderOut != NULL ? 0 : -1;
+}
+
+int
+ODSnapshotBuilderDelete(ODSnapshotBuilder **builderOut)
+{
+    ODSnapshotBuilder *builder;
+    int i, j;
+
+    if (builderOut == NULL || *builderOut == NULL)
+        return -1;
+
+    builder = *builderOut;
+    for (i = 0; i < builder->userCount; ++i)
+        free(builder->users[i].name);
+    for (i = 0; i < builder->groupCount; ++i) {
+        for (j = 0; j < builder->groups[i].memberCount; ++j)
+            free(builder->groups[i].members[j]);
+        free(builder->groups[i].members);
+        free(builder->groups[i].name);
+    }
+    free(builder->users);
+    free(builder->groups);
+    free(builder);
+    *builderOut = NULL;
+
+    return 0;
+}
+
+int
+ODSnapshotBuilderAddUser(ODSnapshotBuilder *builder, const char *userName, const unsigned char uuid[16])
+{
+    ODSnapshotBuilderUser *users;
+
+    if (builder == NULL || userName == NULL || uuid == NULL)
+        return -1;
+
+    if (builder->userCount == builder->userCapacity) {
+        int capacity = builder->userCapacity ? builder->userCapacity * 2 : 64;
+        users = realloc(builder->users, capacity * sizeof(*users));
+        if (users == NULL)
+            return -1;
+        builder->users = users;
+        builder->userCapacity = capacity;
+    }
+
+    builder->users[builder->userCount].name = strdup(userName);
+    if (builder->users[builder->userCount].name == NULL)
+        return -1;
+    memcpy(builder->users[builder->userCount].uuid, uuid, 16);
+    ++builder->userCount;
+
+    return 0;
+}
+
+ODSnapshotBuilderGroup *
+ODSnapshotBuilderFindGroup(ODSnapshotBuilder *builder, const char *groupName)
+{
+    int i;
+
+    for (i = 0; i < builder->groupCount; ++i)
+        if (strcmp(builder->groups[i].name, groupName) == 0)
+            return &builder->groups[i];
+
+    return NULL;
+}
+
+int
+ODSnapshotBuilderAddGroup(ODSnapshotBuilder *builder, const char *groupName)
+{
+    ODSnapshotBuilderGroup *groups;
+
+    if (builder == NULL || groupName == NULL)
+        return -1;
+
+    if (ODSnapshotBuilderFindGroup(builder, groupName) != NULL)
+        return 0;
+
+    if (builder->groupCount == builder->groupCapacity) {
+        int capacity = builder->groupCapacity ? builder->groupCapacity * 2 : 16;
+        groups = realloc(builder->groups, capacity * sizeof(*groups));
+        if (groups == NULL)
+            return -1;
+        builder->groups = groups;
+        builder->groupCapacity = capacity;
+    }
+
+    memset(&builder->groups[builder->groupCount], 0, sizeof(builder->groups[0]));
+    builder->groups[builder->groupCount].name = strdup(groupName);
+    if (builder->groups[builder->groupCount].name == NULL)
+        return -1;
+    ++builder->groupCount;
+
+    return 0;
+}
+
+/* members are expected to be flattened already: add every user who is a
+ * member directly or through nested groups */
+int
+ODSnapshotBuilderAddGroupMember(ODSnapshotBuilder *builder, const char *groupName, const char *userName)
+{
+    ODSnapshotBuilderGroup *group;
+    char **members;
+
+    if (builder == NULL || groupName == NULL || userName == NULL)
+        return -1;
+
+    group = ODSnapshotBuilderFindGroup(builder, groupName);
+    if (group == NULL) {
+        if (ODSnapshotBuilderAddGroup(builder, groupName) != 0)
+            return -1;
+        group = ODSnapshotBuilderFindGroup(builder, groupName);
+    }
+
+    if (group->memberCount == group->memberCapacity) {
+        int capacity = group->memberCapacity ? group->memberCapacity * 2 : 16;
+        members = realloc(group->members, capacity * sizeof(*members));
+        if (members == NULL)
+            return -1;
+        group->members = members;
+        group->memberCapacity = capacity;
+    }
+
+    group->members[group->memberCount] = strdup(userName);
+    if (group->members[group->memberCount] == NULL)
+        return -1;
+    ++group->memberCount;
+
+    return 0;
+}
+
+int
+ODSnapshotBuilderWrite(ODSnapshotBuilder *builder, const char *path)
+{
+    int retval = -1;
+    ODSnapshotHeader hdr;
+    ODSnapshotUser *users = NULL;
+    ODSnapshotGroup *groups = NULL;
+    ODSnapshotMember *members = NULL;
+    uint32_t *userBuckets = NULL;
+    uint32_t *groupBuckets = NULL;
+    uint32_t *memberBuckets = NULL;
+    char *strings = NULL;
+    char *tmpPath = NULL;
+    FILE *fp = NULL;
+    uint64_t stringsSize = 1;
+    uint64_t memberTotal = 0, memberBucketTotal = 0, offset;
+    uint32_t pos = 1, m = 0, b = 0;
+    int i, j;
+
+    if (builder == NULL || path == NULL)
+        goto failure;
+
+    for (i = 0; i < builder->userCount; ++i)
+        stringsSize += strlen(builder->users[i].name) + 1;
+    for (i = 0; i < builder->groupCount; ++i) {
+        stringsSize += strlen(builder->groups[i].name) + 1;
+        memberTotal += builder->groups[i].memberCount;
+        memberBucketTotal += builder->groups[i].memberCount | 1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, kODSnapshotMagic, sizeof(hdr.magic));
+    hdr.byteOrder = kODSnapshotByteOrder;
+    hdr.userCount = builder->userCount;
+    hdr.userBucketCount = builder->userCount | 1;
+    hdr.groupCount = builder->groupCount;
+    hdr.groupBucketCount = builder->groupCount | 1;
+    hdr.memberCount = (uint32_t)memberTotal;
+    hdr.memberBucketCount = (uint32_t)memberBucketTotal;
+
+    offset = sizeof(hdr);
+    hdr.usersOffset = (uint32_t)offset;
+    offset += (uint64_t)hdr.userCount * sizeof(*users);
+    hdr.userBucketsOffset = (uint32_t)offset;
+    offset += (uint64_t)hdr.userBucketCount * sizeof(uint32_t);
+    hdr.groupsOffset = (uint32_t)offset;
+    offset += (uint64_t)hdr.groupCount * sizeof(*groups);
+    hdr.groupBucketsOffset = (uint32_t)offset;
+    offset += (uint64_t)hdr.groupBucketCount * sizeof(uint32_t);
+    hdr.membersOffset = (uint32_t)offset;
+    offset += memberTotal * sizeof(*members);
+    hdr.memberBucketsOffset = (uint32_t)offset;
+    offset += memberBucketTotal * sizeof(uint32_t);
+    hdr.stringsOffset = (uint32_t)offset;
+    hdr.stringsSize = (uint32_t)stringsSize;
+    offset += stringsSize;
+    if (offset > kODSnapshotMaxFileSize)
+        goto failure;
+    hdr.fileSize = (uint32_t)offset;
+
+    users = calloc(hdr.userCount + 1, sizeof(*users));
+    userBuckets = calloc(hdr.userBucketCount, sizeof(*userBuckets));
+    groups = calloc(hdr.groupCount + 1, sizeof(*groups));
+    groupBuckets = calloc(hdr.groupBucketCount, sizeof(*groupBuckets));
+    members = calloc(memberTotal + 1, sizeof(*members));
+    memberBuckets = calloc(memberBucketTotal + 1, sizeof(*memberBuckets));
+    strings = calloc(1, (size_t)stringsSize);
+    if (users == NULL || userBuckets == NULL || groups == NULL || groupBuckets == NULL
+        || members == NULL || memberBuckets == NULL || strings == NULL)
+        goto failure;
+
+    /* records are chained at the head, so add in reverse to keep the
+     * first occurrence of a duplicate name in front */
+    for (i = builder->userCount - 1; i >= 0; --i) {
+        ODSnapshotUser *user = &users[i];
+        size_t len = strlen(builder->users[i].name) + 1;
+        uint32_t bucket;
+
+        user->hash = ODSnapshotHash(builder->users[i].name);
+        user->name = pos;
+        memcpy(strings + pos, builder->users[i].name, len);
+        pos += len;
+        memcpy(user->uuid, builder->users[i].uuid, sizeof(user->uuid));
+
+        bucket = user->hash % hdr.userBucketCount;
+        user->next = userBuckets[bucket];
+        userBuckets[bucket] = i + 1;
+    }
+
+    for (i = 0; i < builder->groupCount; ++i) {
+        ODSnapshotGroup *group = &groups[i];
+        size_t len = strlen(builder->groups[i].name) + 1;
+        uint32_t bucket;
+
+        group->hash = ODSnapshotHash(builder->groups[i].name);
+        group->name = pos;
+        memcpy(strings + pos, builder->groups[i].name, len);
+        pos += len;
+
+        bucket = group->hash % hdr.groupBucketCount;
+        group->next = groupBuckets[bucket];
+        groupBuckets[bucket] = i + 1;
+
+        group->firstBucket = b;
+        group->bucketCount = builder->groups[i].memberCount | 1;
+        b += group->bucketCount;
+
+        for (j = 0; j < builder->groups[i].memberCount; ++j) {
+            const char *member = builder->groups[i].members[j];
+            uint32_t hash = ODSnapshotHash(member);
+            uint32_t k, userIndex = UINT32_MAX;
+
+            /* resolve against the user table built above; members that
+             * are not users in this snapshot are dropped */
+            for (k = userBuckets[hash % hdr.userBucketCount]; k != 0; k = users[k - 1].next) {
+                if (users[k - 1].hash == hash && strcmp(strings + users[k - 1].name, member) == 0) {
+                    userIndex = k - 1;
+                    break;
+                }
+            }
+            if (userIndex == UINT32_MAX)
+                continue;
+
+            members[m].user = userIndex;
+            bucket = group->firstBucket + userIndex % group->bucketCount;
+            members[m].next = memberBuckets[bucket];
+            memberBuckets[bucket] = m + 1;
+            ++m;
+            ++group->memberCount;
+        }
+    }
+
+    tmpPath = malloc(strlen(path) + sizeof(".XXXXXX"));
+    if (tmpPath == NULL)
+        goto failure;
+    strcpy(tmpPath, path);
+    strcat(tmpPath, ".XXXXXX");
+    {
+        int fd = mkstemp(tmpPath);
+        if (fd < 0)
+            goto failure;
+        fchmod(fd, 0644);
+        fp = fdopen(fd, "w");
+        if (fp == NULL) {
+            close(fd);
+            unlink(tmpPath);
+            goto failure;
+        }
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1
+        || fwrite(users, sizeof(*users), hdr.userCount, fp) != hdr.userCount
+        || fwrite(userBuckets, sizeof(*userBuckets), hdr.userBucketCount, fp) != hdr.userBucketCount
+        || fwrite(groups, sizeof(*groups), hdr.groupCount, fp) != hdr.groupCount
+        || fwrite(groupBuckets, sizeof(*groupBuckets), hdr.groupBucketCount, fp) != hdr.groupBucketCount
+        || fwrite(members, sizeof(*members), hdr.memberCount, fp) != hdr.memberCount
+        || fwrite(memberBuckets, sizeof(*memberBuckets), hdr.memberBucketCount, fp) != hdr.memberBucketCount
+        || fwrite(strings, 1, hdr.stringsSize, fp) != hdr.stringsSize
+        || fflush(fp) != 0 || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        fp = NULL;
+        unlink(tmpPath);
+        goto failure;
+    }
+
+    if (fclose(fp) != 0) {
+        fp = NULL;
+        unlink(tmpPath);
+        goto failure;
+    }
+    fp = NULL;
+
+    if (rename(tmpPath, path) != 0) {
+        unlink(tmpPath);
+        goto failure;
+    }
+
+    retval = 0;
+failure:
+    free(tmpPath);
+    free(users);
+    free(userBuckets);
+    free(groups);
+    free(groupBuckets);
+    free(members);
+    free(memberBuckets);
+    free(strings);
+    return retval;
+}
+
+int
+ODSnapshotParseUUID(const char *s, unsigned char uuid[16])
+{
+    int i = 0;
+
+    for (; *s != '\0' && i < 32; ++s) {
+        int v;
+        if (*s == '-')
+            continue;
+        if (!isxdigit((unsigned char)*s))
+            return -1;
+        v = isdigit((unsigned char)*s) ? *s - '0' : tolower((unsigned char)*s) - 'a' + 10;
+        if (i % 2 == 0)
+            uuid[i / 2] = (unsigned char)(v << 4);
+        else
+            uuid[i / 2] |= (unsigned char)v;
+        ++i;
+    }
+
+    return (i == 32 && *s == '\0') ? 0 : -1;
+}
+
+int
+ODSnapshotBuildFromText(FILE *in, const char *path)
+{
+    int retval = -1;
+    ODSnapshotBuilder *builder = NULL;
+    char line[1024];
+
+    if (in == NULL || path == NULL)
+        goto failure;
+
+    if (ODSnapshotBuilderCreate(&builder) != 0)
+        goto failure;
+
+    while (fgets(line, sizeof(line), in) != NULL) {
+        char *word[3] = { NULL, NULL, NULL };
+        char *p = line;
+        int n;
+
+        for (n = 0; n < 3; ++n) {
+            while (isspace((unsigned char)*p))
+                ++p;
+            if (*p == '\0')
+                break;
+            word[n] = p;
+            while (*p != '\0' && !isspace((unsigned char)*p))
+                ++p;
+            if (*p != '\0')
+                *p++ = '\0';
+        }
+
+        if (word[0] == NULL || word[0][0] == '#')
+            continue;
+
+        if (strcmp(word[0], "user") == 0 && word[2] != NULL) {
+            unsigned char uuid[16];
+            if (ODSnapshotParseUUID(word[2], uuid) != 0
+                || ODSnapshotBuilderAddUser(builder, word[1], uuid) != 0)
+                goto failure;
+        }
+        else if (strcmp(word[0], "group") == 0 && word[1] != NULL) {
+            if (ODSnapshotBuilderAddGroup(builder, word[1]) != 0)
+                goto failure;
+        }
+        else if (strcmp(word[0], "member") == 0 && word[2] != NULL) {
+            if (ODSnapshotBuilderAddGroupMember(builder, word[1], word[2]) != 0)
+                goto failure;
+        }
+        else
+            goto failure;
+    }
+
+    if (ferror(in))
+        goto failure;
+
+    retval = ODSnapshotBuilderWrite(builder, path);
+failure:
+    ODSnapshotBuilderDelete(&builder);
+    return retval;
+}
@@ -0,0 +1,60 @@
+/*
+ *  odsnapshot.h
+ *
+ *  read-only, memory-mapped snapshot of directory users, UUIDs, groups
+ *  and (flattened) group memberships
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODSNAPSHOT_H__
+#define __ODSNAPSHOT_H__
+
+#include <stdio.h>
+
+typedef struct ODSnapshot ODSnapshot;
+typedef struct ODSnapshotBuilder ODSnapshotBuilder;
+
+/* how often ODSnapshotRefresh() actually looks at the file, in seconds */
+#define kODSnapshotCheckInterval    5
+
+/* SACL groups are named kODSnapshotServiceGroupPrefix<service> */
+#define kODSnapshotServiceGroupPrefix   "com.apple.access_"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* reading; safe to use from several threads */
+int ODSnapshotOpen(const char *path, ODSnapshot **snapshotOut);
+int ODSnapshotClose(ODSnapshot **snapshotOut);
+int ODSnapshotRefresh(ODSnapshot *snapshot);
+int ODSnapshotForceRefresh(ODSnapshot *snapshot);
+
+/* 0 = found, -1 = not in the snapshot (or no snapshot loaded) */
+int ODSnapshotFindUser(ODSnapshot *snapshot, const char *userName, unsigned char uuidOut[16]);
+
+/* 0 = answered (*isMemberOut set), ENOENT = no such group,
+ * -1 = user not in the snapshot (or no snapshot loaded) */
+int ODSnapshotCheckGroupMembership(ODSnapshot *snapshot, const char *userName, const char *groupName, int *isMemberOut);
+
+/* writing; the file is written next to path and renamed into place */
+int ODSnapshotBuilderCreate(ODSnapshotBuilder **builderOut);
+int ODSnapshotBuilderDelete(ODSnapshotBuilder **builderOut);
+int ODSnapshotBuilderAddUser(ODSnapshotBuilder *builder, const char *userName, const unsigned char uuid[16]);
+int ODSnapshotBuilderAddGroup(ODSnapshotBuilder *builder, const char *groupName);
+int ODSnapshotBuilderAddGroupMember(ODSnapshotBuilder *builder, const char *groupName, const char *userName);
+int ODSnapshotBuilderWrite(ODSnapshotBuilder *builder, const char *path);
+
+/* build a snapshot from lines of text (for testing and for non-OD hosts):
+ *     user <name> <uuid>
+ *     group <name>
+ *     member <group> <user>
+ * blank lines and lines starting with '#' are ignored */
+int ODSnapshotBuildFromText(FILE *in, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
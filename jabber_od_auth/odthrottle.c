@@ -0,0 +1,351 @@
+/*
+ *  odthrottle.c
+ *
+ *  per-client-address and per-username authentication failure throttling
+ *
+ *  Failed attempts are counted per client address, and per username from
+ *  each client address, in a fixed-size open addressing table.  Counting a
+ *  username per address means a client that keeps failing as someone only
+ *  locks itself out, not the account's owner; the address limit still
+ *  catches it spraying many usernames.  Entries only hold a 64-bit hash
+ *  of the key and two counters: failures in the current window and in the
+ *  one before it.  The failure rate is estimated with a sliding window
+ *  (the previous window's count, weighted by how much of it still
+ *  overlaps, plus the current count), so there is no burst allowance at
+ *  window boundaries.  Once an address or username is over its limit
+ *  attempts are refused before any directory call is made; this keeps a
+ *  password-spraying client from using up the directory capacity that
+ *  other users need, while the firewall catches up with it.
+ *
+ *  When the probe range for a new key is full the entry that failed least
+ *  recently is reused, so the table stays bounded under a distributed
+ *  attack; the busiest offenders stay tracked.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "odthrottle.h"
+
+#define kODThrottleProbeLimit   16
+#define kODThrottleMinSize      64
+#define kODThrottleMaxCount     0xffff
+
+/* what an entry counts */
+enum {
+    kODThrottleKindAddress = 0,
+    kODThrottleKindUser,
+    kODThrottleKindCount
+};
+
+typedef struct ODThrottleEntry {
+    uint64_t key;               /* 0 = never used */
+    uint32_t windowStart;
+    uint32_t lastFailure;
+    uint16_t current;           /* failures since windowStart */
+    uint16_t previous;          /* failures in the window before that */
+    uint8_t kind;
+    uint8_t reported;           /* over the limit has been logged */
+} ODThrottleEntry;
+
+typedef struct ODThrottle {
+    pthread_mutex_t lock;
+    int limit[kODThrottleKindCount];
+    int window[kODThrottleKindCount];
+    ODThrottleEntry *entries;
+    unsigned int mask;
+    int size;
+    ODThrottleStats stats;
+} ODThrottle;
+
+static ODThrottle gThrottle = {
+    PTHREAD_MUTEX_INITIALIZER,
+    { kODThrottleDefaultAddressFailures, kODThrottleDefaultUserFailures },
+    { kODThrottleDefaultAddressWindow, kODThrottleDefaultUserWindow },
+    NULL,
+    0,
+    kODThrottleDefaultSize,
+};
+
+static const char *kODThrottleKindName[kODThrottleKindCount] = { "client address", "user" };
+
+static uint64_t ODThrottleHash(int kind, const char *key, const char *address);
+static int ODThrottleAllocateLocked(void);
+static ODThrottleEntry *ODThrottleFindLocked(int kind, const char *key, const char *address, uint32_t now, int create);
+static unsigned int ODThrottleEstimateLocked(ODThrottleEntry *entry, uint32_t now);
+static int ODThrottleCheckLocked(int kind, const char *key, const char *address, uint32_t now);
+static void ODThrottleFailLocked(int kind, const char *key, const char *address, uint32_t now);
+
+/* address is only given for usernames, which are counted per client address */
+uint64_t
+ODThrottleHash(int kind, const char *key, const char *address)
+{
+    const unsigned char *p = (const unsigned char *)key;
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+
+    h = (h ^ (unsigned char)kind) * 1099511628211ULL;
+    for (; *p != '\0'; ++p) {
+        /* usernames are compared case-insensitively, as the directory does */
+        unsigned char c = (kind == kODThrottleKindUser) ? tolower(*p) : *p;
+        h = (h ^ c) * 1099511628211ULL;
+    }
+
+    if (address != NULL) {
+        h *= 1099511628211ULL;              /* a 0 byte between the two */
+        for (p = (const unsigned char *)address; *p != '\0'; ++p)
+            h = (h ^ *p) * 1099511628211ULL;
+    }
+
+    return h ? h : 1;
+}
+
+int
+ODThrottleAllocateLocked(void)
+{
+    ODThrottleEntry *entries;
+    unsigned int count = kODThrottleMinSize;
+
+    while (count < (unsigned int)gThrottle.size && count < 0x40000000)
+        count <<= 1;
+
+    entries = calloc(count, sizeof(*entries));
+    if (entries == NULL) {
+        syslog(LOG_ERR, "auth throttle: unable to allocate %u entries", count);
+        return -1;
+    }
+
+    free(gThrottle.entries);
+    gThrottle.entries = entries;
+    gThrottle.mask = count - 1;
+
+    return 0;
+}
+
+ODThrottleEntry *
+ODThrottleFindLocked(int kind, const char *key, const char *address, uint32_t now, int create)
+{
+    uint64_t hash = ODThrottleHash(kind, key, address);
+    ODThrottleEntry *entry, *victim = NULL;
+    int victimExpired = 0;
+    int i;
+
+    if (gThrottle.entries == NULL && (!create || ODThrottleAllocateLocked() != 0))
+        return NULL;
+
+    for (i = 0; i < kODThrottleProbeLimit; ++i) {
+        entry = &gThrottle.entries[(hash + i) & gThrottle.mask];
+
+        if (entry->key == hash && entry->kind == kind) {
+            /* roll the window forward */
+            if (now - entry->windowStart >= (uint32_t)gThrottle.window[kind]) {
+                if (now - entry->windowStart < 2 * (uint32_t)gThrottle.window[kind]) {
+                    entry->previous = entry->current;
+                    entry->windowStart += gThrottle.window[kind];
+                }
+                else {
+                    entry->previous = 0;
+                    entry->windowStart = now;
+                }
+                entry->current = 0;
+            }
+            return entry;
+        }
+
+        if (!create || victimExpired)
+            continue;
+
+        if (entry->key == 0
+            || now - entry->lastFailure >= 2 * (uint32_t)gThrottle.window[entry->kind]) {
+            victim = entry;
+            victimExpired = 1;
+        }
+        else if (victim == NULL || entry->lastFailure < victim->lastFailure)
+            victim = entry;
+    }
+
+    if (!create)
+        return NULL;
+
+    if (!victimExpired)
+        ++gThrottle.stats.evictions;
+
+    memset(victim, 0, sizeof(*victim));
+    victim->key = hash;
+    victim->kind = kind;
+    victim->windowStart = now;
+
+    return victim;
+}
+
+unsigned int
+ODThrottleEstimateLocked(ODThrottleEntry *entry, uint32_t now)
+{
+    uint32_t window = gThrottle.window[entry->kind];
+    uint32_t elapsed = now - entry->windowStart;
+
+    if (elapsed >= window)
+        return entry->current;
+
+    return entry->current + (entry->previous * (window - elapsed)) / window;
+}
+
+int
+ODThrottleCheckLocked(int kind, const char *key, const char *address, uint32_t now)
+{
+    ODThrottleEntry *entry;
+
+    if (key == NULL || *key == '\0' || gThrottle.limit[kind] <= 0)
+        return 0;
+
+    entry = ODThrottleFindLocked(kind, key, address, now, 0);
+    if (entry == NULL)
+        return 0;
+
+    if (ODThrottleEstimateLocked(entry, now) < (unsigned int)gThrottle.limit[kind]) {
+        entry->reported = 0;
+        return 0;
+    }
+
+    return 1;
+}
+
+void
+ODThrottleFailLocked(int kind, const char *key, const char *address, uint32_t now)
+{
+    ODThrottleEntry *entry;
+
+    if (key == NULL || *key == '\0' || gThrottle.limit[kind] <= 0)
+        return;
+
+    entry = ODThrottleFindLocked(kind, key, address, now, 1);
+    if (entry == NULL)
+        return;
+
+    if (entry->current < kODThrottleMaxCount)
+        ++entry->current;
+    entry->lastFailure = now;
+
+    if (!entry->reported && ODThrottleEstimateLocked(entry, now) >= (unsigned int)gThrottle.limit[kind]) {
+        entry->reported = 1;
+        syslog(LOG_NOTICE, "auth throttle: %d failed attempts in %d seconds for %s %s%s%s, refusing further attempts",
+               gThrottle.limit[kind], gThrottle.window[kind], kODThrottleKindName[kind], key,
+               address != NULL ? " from " : "", address != NULL ? address : "");
+    }
+}
+
+int
+ODThrottleConfigure(int addressFailures, int addressWindow, int userFailures, int userWindow, int size)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&gThrottle.lock);
+
+    /* a limit of 0 (or less) turns that half of the throttle off */
+    gThrottle.limit[kODThrottleKindAddress] = addressFailures;
+    gThrottle.window[kODThrottleKindAddress] = addressWindow > 0 ? addressWindow : kODThrottleDefaultAddressWindow;
+    gThrottle.limit[kODThrottleKindUser] = userFailures;
+    gThrottle.window[kODThrottleKindUser] = userWindow > 0 ? userWindow : kODThrottleDefaultUserWindow;
+
+    if (size <= 0)
+        size = kODThrottleDefaultSize;
+    if (size != gThrottle.size) {
+        gThrottle.size = size;
+        if (gThrottle.entries != NULL && ODThrottleAllocateLocked() != 0)
+            goto failure;
+    }
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gThrottle.lock);
+
+    return retval;
+}
+
+int
+ODThrottleCheck(const char *address, const char *username)
+{
+    uint32_t now = (uint32_t)time(NULL);
+    int retval = kODThrottleAllow;
+
+    pthread_mutex_lock(&gThrottle.lock);
+
+    ++gThrottle.stats.checks;
+    if (ODThrottleCheckLocked(kODThrottleKindAddress, address, NULL, now)) {
+        ++gThrottle.stats.addressThrottled;
+        retval = kODThrottleAddress;
+    }
+    else if (ODThrottleCheckLocked(kODThrottleKindUser, username, address, now)) {
+        ++gThrottle.stats.userThrottled;
+        retval = kODThrottleUser;
+    }
+
+    pthread_mutex_unlock(&gThrottle.lock);
+
+    return retval;
+}
+
+void
+ODThrottleRecord(const char *address, const char *username, int success)
+{
+    uint32_t now = (uint32_t)time(NULL);
+    ODThrottleEntry *entry;
+
+    pthread_mutex_lock(&gThrottle.lock);
+
+    if (success) {
+        if (username != NULL && (entry = ODThrottleFindLocked(kODThrottleKindUser, username, address, now, 0)) != NULL) {
+            entry->current = 0;
+            entry->previous = 0;
+            entry->reported = 0;
+        }
+    }
+    else {
+        ++gThrottle.stats.failures;
+        ODThrottleFailLocked(kODThrottleKindAddress, address, NULL, now);
+        ODThrottleFailLocked(kODThrottleKindUser, username, address, now);
+    }
+
+    pthread_mutex_unlock(&gThrottle.lock);
+}
+
+void
+ODThrottleFlush(void)
+{
+    pthread_mutex_lock(&gThrottle.lock);
+    if (gThrottle.entries != NULL)
+        memset(gThrottle.entries, 0, (gThrottle.mask + 1) * sizeof(*gThrottle.entries));
+    pthread_mutex_unlock(&gThrottle.lock);
+}
+
+int
+ODThrottleGetStats(ODThrottleStats *statsOut)
+{
+    if (statsOut == NULL)
+        return -1;
+
+    pthread_mutex_lock(&gThrottle.lock);
+    *statsOut = gThrottle.stats;
+    pthread_mutex_unlock(&gThrottle.lock);
+
+    return 0;
+}
+
+void
+ODThrottleLogStats(void)
+{
+    ODThrottleStats stats;
+
+    ODThrottleGetStats(&stats);
+    /* nothing to say in processes that never authenticate anyone */
+    if (stats.checks == 0 && stats.failures == 0)
+        return;
+
+    syslog(LOG_NOTICE, "auth throttle: %lu checks, %lu failures, %lu refused by client address, %lu refused by user, %lu evictions",
+           stats.checks, stats.failures, stats.addressThrottled, stats.userThrottled, stats.evictions);
+}
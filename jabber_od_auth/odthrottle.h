@@ -0,0 +1,58 @@
+/*
+ *  odthrottle.h
+ *
+ *  per-client-address and per-username authentication failure throttling;
+ *  usernames are counted separately for each client address
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODTHROTTLE_H__
+#define __ODTHROTTLE_H__
+
+/* ODThrottleCheck() results */
+enum {
+    kODThrottleAllow = 0,
+    kODThrottleAddress,         /* too many failures from the client address */
+    kODThrottleUser             /* too many failures for the username from this address */
+};
+
+#define kODThrottleDefaultAddressFailures   30      /* per address window, 0 = off */
+#define kODThrottleDefaultAddressWindow     60      /* seconds */
+#define kODThrottleDefaultUserFailures      10      /* per user and address window, 0 = off */
+#define kODThrottleDefaultUserWindow        300     /* seconds */
+#define kODThrottleDefaultSize              16384   /* tracked addresses and users */
+
+typedef struct ODThrottleStats {
+    unsigned long checks;
+    unsigned long failures;     /* failed attempts recorded */
+    unsigned long addressThrottled;
+    unsigned long userThrottled;
+    unsigned long evictions;    /* entries reused before they expired */
+} ODThrottleStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* one tracker per process; changing size drops what has been tracked so far */
+int ODThrottleConfigure(int addressFailures, int addressWindow, int userFailures, int userWindow, int size);
+
+/* call before doing any directory work for an attempt; either argument may
+ * be NULL when it isn't known yet, but the username's failures are counted
+ * with the address, so pass it whenever it is known */
+int ODThrottleCheck(const char *address, const char *username);
+
+/* the outcome of an attempt; a success clears the username's failures from
+ * that address but not the address's own */
+void ODThrottleRecord(const char *address, const char *username, int success);
+
+void ODThrottleFlush(void);
+int ODThrottleGetStats(ODThrottleStats *statsOut);
+void ODThrottleLogStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ *  odtoken.c
+ *
+ *  short-lived, signed tokens for re-authenticating without the directory
+ *
+ *  After a client has authenticated against the directory c2s can hand it
+ *  a token, which the client presents instead of its password the next
+ *  time it connects.  A token is the time it was issued, the time it
+ *  expires and a random nonce, signed with HMAC-SHA256 over those and the
+ *  (lowercased) username under a key that never leaves the process; so
+ *  checking one takes no directory call and no storage per token.
+ *
+ *  Revoking a user's tokens records the time of the revocation in a
+ *  bounded table, and any token issued up to then is refused.  A record
+ *  is only needed until the tokens it covers have expired; if the table
+ *  is full of records that are still needed the signing key is replaced
+ *  instead, which revokes every token at once.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <CommonCrypto/CommonHMAC.h>
+#include "odtoken.h"
+#include "odnonce.h"
+
+#define kODTokenVersion         1
+#define kODTokenKeyLength       32
+#define kODTokenNonceLength     8
+#define kODTokenSignedLength    (1 + 4 + 4 + kODTokenNonceLength)
+#define kODTokenLength          (kODTokenSignedLength + CC_SHA256_DIGEST_LENGTH)
+#define kODTokenMaxUsername     1024
+#define kODTokenClockSlack      60      /* seconds a token may be issued "in the future" */
+#define kODTokenProbeLimit      16
+#define kODTokenMinSize         64
+
+typedef struct ODTokenRevocation {
+    uint64_t key;               /* 0 = never used */
+    uint32_t revokedAt;         /* tokens issued up to and including this are refused */
+} ODTokenRevocation;
+
+typedef struct ODToken {
+    pthread_mutex_t lock;
+    int lifetime;
+    int size;
+    int haveKey;
+    unsigned char key[kODTokenKeyLength];
+    ODTokenRevocation *revocations;
+    unsigned int mask;
+    ODTokenStats stats;
+} ODToken;
+
+static ODToken gToken = {
+    PTHREAD_MUTEX_INITIALIZER,
+    kODTokenDefaultLifetime,
+    kODTokenDefaultSize,
+};
+
+static uint64_t ODTokenHash(const char *username);
+static void ODTokenNewKeyLocked(void);
+static int ODTokenAllocateLocked(void);
+static ODTokenRevocation *ODTokenFindLocked(uint64_t hash);
+static int ODTokenVerifyLocked(const unsigned char *bytes, const char *username, uint32_t now);
+static int ODTokenSign(const unsigned char *token, const char *username, unsigned char *macOut);
+static void ODTokenPut32(unsigned char *p, uint32_t value);
+static uint32_t ODTokenGet32(const unsigned char *p);
+
+uint64_t
+ODTokenHash(const char *username)
+{
+    const unsigned char *p = (const unsigned char *)username;
+    uint64_t h = 14695981039346656037ULL;   /* FNV-1a */
+
+    for (; *p != '\0'; ++p)
+        h = (h ^ (unsigned char)tolower(*p)) * 1099511628211ULL;
+
+    return h ? h : 1;
+}
+
+void
+ODTokenNewKeyLocked(void)
+{
+    arc4random_buf(gToken.key, sizeof(gToken.key));
+    gToken.haveKey = 1;
+
+    /* nothing issued under the old key can be used, so no revocation is
+     * needed any more */
+    if (gToken.revocations != NULL)
+        memset(gToken.revocations, 0, (gToken.mask + 1) * sizeof(*gToken.revocations));
+}
+
+int
+ODTokenAllocateLocked(void)
+{
+    ODTokenRevocation *revocations;
+    unsigned int count = kODTokenMinSize;
+
+    while (count < (unsigned int)gToken.size && count < 0x40000000)
+        count <<= 1;
+
+    revocations = calloc(count, sizeof(*revocations));
+    if (revocations == NULL) {
+        syslog(LOG_ERR, "reauth tokens: unable to allocate %u revocations", count);
+        return -1;
+    }
+
+    free(gToken.revocations);
+    gToken.revocations = revocations;
+    gToken.mask = count - 1;
+
+    return 0;
+}
+
+ODTokenRevocation *
+ODTokenFindLocked(uint64_t hash)
+{
+    ODTokenRevocation *entry;
+    int i;
+
+    if (gToken.revocations == NULL)
+        return NULL;
+
+    for (i = 0; i < kODTokenProbeLimit; ++i) {
+        entry = &gToken.revocations[(hash + i) & gToken.mask];
+        if (entry->key == hash)
+            return entry;
+        if (entry->key == 0)
+            break;
+    }
+
+    return NULL;
+}
+
+int
+ODTokenSign(const unsigned char *token, const char *username, unsigned char *macOut)
+{
+    char lowered[kODTokenMaxUsername];
+    CCHmacContext ctx;
+    size_t i;
+
+    for (i = 0; username[i] != '\0'; ++i) {
+        if (i == sizeof(lowered))
+            return -1;
+        lowered[i] = (char)tolower((unsigned char)username[i]);
+    }
+
+    CCHmacInit(&ctx, kCCHmacAlgSHA256, gToken.key, sizeof(gToken.key));
+    CCHmacUpdate(&ctx, token, kODTokenSignedLength);
+    CCHmacUpdate(&ctx, lowered, i);
+    CCHmacFinal(&ctx, macOut);
+
+    return 0;
+}
+
+void
+ODTokenPut32(unsigned char *p, uint32_t value)
+{
+    p[0] = (unsigned char)(value >> 24);
+    p[1] = (unsigned char)(value >> 16);
+    p[2] = (unsigned char)(value >> 8);
+    p[3] = (unsigned char)value;
+}
+
+uint32_t
+ODTokenGet32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+int
+ODTokenConfigure(int lifetime, int size)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&gToken.lock);
+
+    gToken.lifetime = lifetime > 0 ? lifetime : 0;
+
+    if (size <= 0)
+        size = kODTokenDefaultSize;
+    if (size != gToken.size) {
+        gToken.size = size;
+        /* the revocations are lost with the old table, so the tokens they
+         * covered have to go too */
+        if (gToken.revocations != NULL) {
+            if (ODTokenAllocateLocked() != 0)
+                goto failure;
+            ODTokenNewKeyLocked();
+            ++gToken.stats.keyChanges;
+        }
+    }
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gToken.lock);
+
+    return retval;
+}
+
+int
+ODTokenIssue(const char *username, char *tokenOut, size_t tokenOutLen, time_t *expiresOut)
+{
+    unsigned char token[kODTokenLength];
+    uint32_t now = (uint32_t)time(NULL);
+    uint32_t issued = now;
+    ODTokenRevocation *entry;
+    int retval = -1;
+
+    if (username == NULL || *username == '\0' || tokenOut == NULL || tokenOutLen < kODTokenBufferSize)
+        return -1;
+
+    pthread_mutex_lock(&gToken.lock);
+
+    if (gToken.lifetime <= 0)
+        goto failure;
+
+    if (!gToken.haveKey)
+        ODTokenNewKeyLocked();
+
+    /* a token issued in the same second as a revocation must outlive it */
+    entry = ODTokenFindLocked(ODTokenHash(username));
+    if (entry != NULL && entry->revokedAt >= issued)
+        issued = entry->revokedAt + 1;
+
+    token[0] = kODTokenVersion;
+    ODTokenPut32(&token[1], issued);
+    ODTokenPut32(&token[5], issued + (uint32_t)gToken.lifetime);
+    if (ODNonceBytes(&token[9], kODTokenNonceLength) != 0)
+        goto failure;
+    if (ODTokenSign(token, username, &token[kODTokenSignedLength]) != 0)
+        goto failure;
+
+    ODNonceHexEncode(token, kODTokenLength, tokenOut, tokenOutLen);
+
+    if (expiresOut != NULL)
+        *expiresOut = (time_t)(issued + (uint32_t)gToken.lifetime);
+
+    ++gToken.stats.issued;
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gToken.lock);
+
+    return retval;
+}
+
+int
+ODTokenVerifyLocked(const unsigned char *bytes, const char *username, uint32_t now)
+{
+    unsigned char mac[CC_SHA256_DIGEST_LENGTH];
+    unsigned char diff = 0;
+    uint32_t issued, expires;
+    ODTokenRevocation *entry;
+    int i;
+
+    if (!gToken.haveKey || ODTokenSign(bytes, username, mac) != 0)
+        return kODTokenBadSignature;
+
+    /* don't give away how much of the signature was right */
+    for (i = 0; i < CC_SHA256_DIGEST_LENGTH; ++i)
+        diff |= mac[i] ^ bytes[kODTokenSignedLength + i];
+    if (diff != 0)
+        return kODTokenBadSignature;
+
+    issued = ODTokenGet32(&bytes[1]);
+    expires = ODTokenGet32(&bytes[5]);
+
+    /* a shorter lifetime applies to tokens that are already out there */
+    if (expires - issued > (uint32_t)gToken.lifetime)
+        expires = issued + (uint32_t)gToken.lifetime;
+
+    if (issued > now + kODTokenClockSlack)
+        return kODTokenMalformed;
+    if (now >= expires)
+        return kODTokenExpired;
+
+    entry = ODTokenFindLocked(ODTokenHash(username));
+    if (entry != NULL && issued <= entry->revokedAt)
+        return kODTokenRevoked;
+
+    return kODTokenValid;
+}
+
+int
+ODTokenVerify(const char *username, const char *token, size_t tokenLen)
+{
+    unsigned char bytes[kODTokenLength];
+    uint32_t now = (uint32_t)time(NULL);
+    int retval = kODTokenMalformed;
+    int i;
+
+    if (username == NULL || *username == '\0' || token == NULL || tokenLen != 2 * kODTokenLength)
+        goto done;
+
+    for (i = 0; i < 2 * kODTokenLength; ++i) {
+        int c = tolower((unsigned char)token[i]);
+        int nibble;
+
+        if (c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if (c >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else
+            goto done;
+
+        if (i & 1)
+            bytes[i / 2] |= (unsigned char)nibble;
+        else
+            bytes[i / 2] = (unsigned char)(nibble << 4);
+    }
+
+    if (bytes[0] != kODTokenVersion)
+        goto done;
+
+    retval = -1;
+
+done:
+    pthread_mutex_lock(&gToken.lock);
+
+    if (retval == -1)
+        retval = ODTokenVerifyLocked(bytes, username, now);
+
+    if (retval == kODTokenValid)
+        ++gToken.stats.verified;
+    else if (retval == kODTokenRevoked)
+        ++gToken.stats.revoked;
+    else
+        ++gToken.stats.rejected;
+
+    pthread_mutex_unlock(&gToken.lock);
+
+    return retval;
+}
+
+void
+ODTokenRevoke(const char *username)
+{
+    uint32_t now = (uint32_t)time(NULL);
+    uint64_t hash;
+    ODTokenRevocation *entry, *victim = NULL;
+    int i;
+
+    if (username == NULL || *username == '\0')
+        return;
+
+    hash = ODTokenHash(username);
+
+    pthread_mutex_lock(&gToken.lock);
+
+    ++gToken.stats.revocations;
+
+    /* nothing has been issued, or can be verified, yet */
+    if (!gToken.haveKey)
+        goto done;
+
+    if (gToken.revocations == NULL && ODTokenAllocateLocked() != 0) {
+        ODTokenNewKeyLocked();
+        ++gToken.stats.keyChanges;
+        goto done;
+    }
+
+    for (i = 0; i < kODTokenProbeLimit; ++i) {
+        entry = &gToken.revocations[(hash + i) & gToken.mask];
+
+        if (entry->key == hash) {
+            /* also cover a token issued just after an earlier revocation
+             * in this same second */
+            entry->revokedAt = (entry->revokedAt >= now) ? entry->revokedAt + 1 : now;
+            goto done;
+        }
+
+        /* a record is no use once everything it covers has expired */
+        if (victim == NULL
+            && (entry->key == 0 || now - entry->revokedAt > (uint32_t)gToken.lifetime))
+            victim = entry;
+    }
+
+    if (victim == NULL) {
+        syslog(LOG_NOTICE, "reauth tokens: too many revocations, revoking every token");
+        ODTokenNewKeyLocked();
+        ++gToken.stats.keyChanges;
+        goto done;
+    }
+
+    victim->key = hash;
+    victim->revokedAt = now;
+
+done:
+    pthread_mutex_unlock(&gToken.lock);
+}
+
+void
+ODTokenRevokeAll(void)
+{
+    pthread_mutex_lock(&gToken.lock);
+    if (gToken.haveKey) {
+        ODTokenNewKeyLocked();
+        ++gToken.stats.keyChanges;
+    }
+    pthread_mutex_unlock(&gToken.lock);
+}
+
+int
+ODTokenGetStats(ODTokenStats *statsOut)
+{
+    if (statsOut == NULL)
+        return -1;
+
+    pthread_mutex_lock(&gToken.lock);
+    *statsOut = gToken.stats;
+    pthread_mutex_unlock(&gToken.lock);
+
+    return 0;
+}
+
+void
+ODTokenLogStats(void)
+{
+    ODTokenStats stats;
+
+    ODTokenGetStats(&stats);
+    /* nothing to say in processes that never issue tokens */
+    if (stats.issued == 0 && stats.verified == 0 && stats.rejected == 0 && stats.revoked == 0)
+        return;
+
+    syslog(LOG_NOTICE, "reauth tokens: %lu issued, %lu accepted, %lu rejected, %lu revoked, %lu revocations, %lu key changes",
+           stats.issued, stats.verified, stats.rejected, stats.revoked, stats.revocations, stats.keyChanges);
+}
@@ -0,0 +1,63 @@
+/*
+ *  odtoken.h
+ *
+ *  short-lived, signed tokens for re-authenticating without the directory
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODTOKEN_H__
+#define __ODTOKEN_H__
+
+#include <stddef.h>
+#include <time.h>
+
+/* ODTokenVerify() results */
+enum {
+    kODTokenValid = 0,
+    kODTokenMalformed,          /* not a token this process could have issued */
+    kODTokenBadSignature,       /* wrong user, tampered with or from an old key */
+    kODTokenExpired,
+    kODTokenRevoked
+};
+
+#define kODTokenMechanism           "X-APPLE-REAUTH"
+
+#define kODTokenDefaultLifetime     3600    /* seconds, 0 = don't issue tokens */
+#define kODTokenDefaultSize         4096    /* users whose revocations are remembered */
+
+/* hex characters in a token, plus a terminating nul */
+#define kODTokenBufferSize          99
+
+typedef struct ODTokenStats {
+    unsigned long issued;
+    unsigned long verified;
+    unsigned long rejected;     /* malformed, bad signature or expired */
+    unsigned long revoked;      /* rejected because they had been revoked */
+    unsigned long revocations;
+    unsigned long keyChanges;   /* every token was revoked at once */
+} ODTokenStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* one signing key per process, so restarting c2s revokes every token */
+int ODTokenConfigure(int lifetime, int size);
+
+/* only for users who have just authenticated against the directory */
+int ODTokenIssue(const char *username, char *tokenOut, size_t tokenOutLen, time_t *expiresOut);
+int ODTokenVerify(const char *username, const char *token, size_t tokenLen);
+
+/* every token issued to username so far stops working */
+void ODTokenRevoke(const char *username);
+void ODTokenRevokeAll(void);
+
+int ODTokenGetStats(ODTokenStats *statsOut);
+void ODTokenLogStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,577 @@
+/*
+ *  odverifier.c
+ *
+ *  local verifiers for PLAIN passwords, so logins don't wait on a slow
+ *  directory
+ *
+ *  After the directory accepts a PLAIN password, a verifier for it is
+ *  kept: a random salt and the scrypt hash of the password under it.
+ *  Logins still go to the directory first; only when it can't answer
+ *  (it failed, or the directory guard has tripped) is the password
+ *  checked against the verifier in-process.  Once a verifier is older
+ *  than the revalidation interval a hit still succeeds, but the password
+ *  is also handed to a background thread that asks the directory again;
+ *  if the directory rejects it the verifier is dropped, and if it accepts
+ *  it the verifier's age starts over.  A verifier the directory hasn't
+ *  agreed with for max-stale seconds isn't used at all, so a changed or
+ *  disabled password stops working within that time even when the user
+ *  keeps logging in while the directory is down.
+ *
+ *  scrypt is used so a dump of the process doesn't give up passwords
+ *  any faster than the directory would; the cost is around ten milliseconds
+ *  and a few megabytes per hash.  Callers may be on the c2s event loop, so
+ *  new verifiers are made on the background thread too, and a check only
+ *  costs a hash while the directory is unavailable.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <CommonCrypto/CommonKeyDerivation.h>
+#include "odcache.h"
+#include "odnonce.h"
+#include "odverifier.h"
+
+#define kODVerifierSaltLength   16
+#define kODVerifierHashLength   32
+#define kODVerifierBlockSize    8       /* scrypt r */
+#define kODVerifierMinCost      4
+#define kODVerifierMaxCost      20
+#define kODVerifierQueueSize    64
+#define kODVerifierMaxUsername  256
+#define kODVerifierMaxPassword  257
+
+typedef struct ODVerifierRecord {
+    unsigned char salt[kODVerifierSaltLength];
+    unsigned char hash[kODVerifierHashLength];
+    int cost;
+    time_t verified;            /* when the directory last accepted the password */
+    time_t queued;              /* when a revalidation was queued, 0 = none */
+} ODVerifierRecord;
+
+/* a revalidation, or with no directory function a new verifier to make */
+typedef struct ODVerifierJob {
+    ODVerifierDirectoryFunc directory;
+    unsigned char hash[kODVerifierHashLength];
+    int cost;
+    unsigned long generation;
+    char username[kODVerifierMaxUsername];
+    char password[kODVerifierMaxPassword];
+} ODVerifierJob;
+
+typedef struct ODVerifier {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    ODCache *cache;
+    int size;
+    int revalidate;
+    int maxStale;
+    int cost;
+    ODVerifierJob queue[kODVerifierQueueSize];
+    unsigned int head;
+    unsigned int count;
+    unsigned long generation;   /* bumped when verifiers are forgotten */
+    int workerRunning;
+    ODVerifierStats stats;
+} ODVerifier;
+
+static ODVerifier gVerifier = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    kODVerifierDefaultSize,
+    kODVerifierDefaultRevalidate,
+    kODVerifierDefaultMaxStale,
+    kODVerifierDefaultCost,
+};
+
+static pthread_once_t gVerifierWorkerOnce = PTHREAD_ONCE_INIT;
+
+static void ODVerifierSalsa208(uint32_t B[16]);
+static void ODVerifierBlockMix(uint32_t *B, uint32_t *Y, int r);
+static int ODVerifierScrypt(const char *password, size_t passwordLen, const unsigned char *salt, size_t saltLen,
+                            int cost, int r, int p, unsigned char *out, size_t outLen);
+static int ODVerifierDerive(const char *password, const unsigned char salt[kODVerifierSaltLength], int cost,
+                            unsigned char hash[kODVerifierHashLength]);
+static int ODVerifierEqual(const unsigned char *a, const unsigned char *b, size_t len);
+static int ODVerifierGetLocked(const char *username, ODVerifierRecord *record);
+static void ODVerifierPutLocked(const char *username, const ODVerifierRecord *record, time_t now);
+static int ODVerifierEnqueueLocked(const char *username, const char *password, const ODVerifierRecord *record,
+                                   ODVerifierDirectoryFunc directory);
+static void ODVerifierFinishLocked(ODVerifierJob *job, int result);
+static int ODVerifierMake(const char *password, int cost, ODVerifierRecord *record);
+static void ODVerifierStartWorker(void);
+static void *ODVerifierWorker(void *arg);
+
+#define ODV_R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+
+void
+ODVerifierSalsa208(uint32_t B[16])
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, B, sizeof(x));
+    for (i = 0; i < 8; i += 2) {
+        /* columns */
+        x[ 4] ^= ODV_R(x[ 0] + x[12],  7);  x[ 8] ^= ODV_R(x[ 4] + x[ 0],  9);
+        x[12] ^= ODV_R(x[ 8] + x[ 4], 13);  x[ 0] ^= ODV_R(x[12] + x[ 8], 18);
+        x[ 9] ^= ODV_R(x[ 5] + x[ 1],  7);  x[13] ^= ODV_R(x[ 9] + x[ 5],  9);
+        x[ 1] ^= ODV_R(x[13] + x[ 9], 13);  x[ 5] ^= ODV_R(x[ 1] + x[13], 18);
+        x[14] ^= ODV_R(x[10] + x[ 6],  7);  x[ 2] ^= ODV_R(x[14] + x[10],  9);
+        x[ 6] ^= ODV_R(x[ 2] + x[14], 13);  x[10] ^= ODV_R(x[ 6] + x[ 2], 18);
+        x[ 3] ^= ODV_R(x[15] + x[11],  7);  x[ 7] ^= ODV_R(x[ 3] + x[15],  9);
+        x[11] ^= ODV_R(x[ 7] + x[ 3], 13);  x[15] ^= ODV_R(x[11] + x[ 7], 18);
+
+        /* rows */
+        x[ 1] ^= ODV_R(x[ 0] + x[ 3],  7);  x[ 2] ^= ODV_R(x[ 1] + x[ 0],  9);
+        x[ 3] ^= ODV_R(x[ 2] + x[ 1], 13);  x[ 0] ^= ODV_R(x[ 3] + x[ 2], 18);
+        x[ 6] ^= ODV_R(x[ 5] + x[ 4],  7);  x[ 7] ^= ODV_R(x[ 6] + x[ 5],  9);
+        x[ 4] ^= ODV_R(x[ 7] + x[ 6], 13);  x[ 5] ^= ODV_R(x[ 4] + x[ 7], 18);
+        x[11] ^= ODV_R(x[10] + x[ 9],  7);  x[ 8] ^= ODV_R(x[11] + x[10],  9);
+        x[ 9] ^= ODV_R(x[ 8] + x[11], 13);  x[10] ^= ODV_R(x[ 9] + x[ 8], 18);
+        x[12] ^= ODV_R(x[15] + x[14],  7);  x[13] ^= ODV_R(x[12] + x[15],  9);
+        x[14] ^= ODV_R(x[13] + x[12], 13);  x[15] ^= ODV_R(x[14] + x[13], 18);
+    }
+    for (i = 0; i < 16; ++i)
+        B[i] += x[i];
+}
+
+/* B is 2r 64 byte blocks; Y is scratch the same size */
+void
+ODVerifierBlockMix(uint32_t *B, uint32_t *Y, int r)
+{
+    uint32_t X[16];
+    int i, j;
+
+    memcpy(X, &B[(2 * r - 1) * 16], sizeof(X));
+    for (i = 0; i < 2 * r; ++i) {
+        for (j = 0; j < 16; ++j)
+            X[j] ^= B[i * 16 + j];
+        ODVerifierSalsa208(X);
+        memcpy(&Y[i * 16], X, sizeof(X));
+    }
+
+    /* even blocks first, then odd */
+    for (i = 0; i < r; ++i) {
+        memcpy(&B[i * 16], &Y[2 * i * 16], sizeof(X));
+        memcpy(&B[(i + r) * 16], &Y[(2 * i + 1) * 16], sizeof(X));
+    }
+}
+
+/* scrypt (RFC 7914) with N = 2^cost */
+int
+ODVerifierScrypt(const char *password, size_t passwordLen, const unsigned char *salt, size_t saltLen,
+                 int cost, int r, int p, unsigned char *out, size_t outLen)
+{
+    size_t N = (size_t) 1 << cost;
+    size_t words = 32 * (size_t) r;
+    unsigned char *B = NULL;
+    uint32_t *V = NULL, *XY = NULL, *X, j;
+    size_t i, k;
+    int retval = -1;
+    int block;
+
+    B = (unsigned char *) malloc(128 * (size_t) r * p);
+    V = (uint32_t *) malloc(words * N * sizeof(uint32_t));
+    XY = (uint32_t *) malloc(2 * words * sizeof(uint32_t));
+    if (B == NULL || V == NULL || XY == NULL)
+        goto failure;
+    X = XY;
+
+    if (CCKeyDerivationPBKDF(kCCPBKDF2, password, passwordLen, salt, saltLen,
+                             kCCPRFHmacAlgSHA256, 1, B, 128 * (size_t) r * p) != 0)
+        goto failure;
+
+    for (block = 0; block < p; ++block) {
+        unsigned char *b = &B[128 * (size_t) r * block];
+
+        for (k = 0; k < words; ++k)
+            X[k] = (uint32_t) b[4 * k] | ((uint32_t) b[4 * k + 1] << 8) |
+                   ((uint32_t) b[4 * k + 2] << 16) | ((uint32_t) b[4 * k + 3] << 24);
+
+        for (i = 0; i < N; ++i) {
+            memcpy(&V[i * words], X, words * sizeof(uint32_t));
+            ODVerifierBlockMix(X, &XY[words], r);
+        }
+        for (i = 0; i < N; ++i) {
+            j = X[(2 * r - 1) * 16] & (uint32_t) (N - 1);
+            for (k = 0; k < words; ++k)
+                X[k] ^= V[j * words + k];
+            ODVerifierBlockMix(X, &XY[words], r);
+        }
+
+        for (k = 0; k < words; ++k) {
+            b[4 * k] = (unsigned char) X[k];
+            b[4 * k + 1] = (unsigned char) (X[k] >> 8);
+            b[4 * k + 2] = (unsigned char) (X[k] >> 16);
+            b[4 * k + 3] = (unsigned char) (X[k] >> 24);
+        }
+    }
+
+    if (CCKeyDerivationPBKDF(kCCPBKDF2, password, passwordLen, B, 128 * (size_t) r * p,
+                             kCCPRFHmacAlgSHA256, 1, out, outLen) != 0)
+        goto failure;
+
+    retval = 0;
+failure:
+    if (B != NULL) {
+        memset(B, 0, 128 * (size_t) r * p);
+        free(B);
+    }
+    if (V != NULL) {
+        memset(V, 0, words * N * sizeof(uint32_t));
+        free(V);
+    }
+    if (XY != NULL) {
+        memset(XY, 0, 2 * words * sizeof(uint32_t));
+        free(XY);
+    }
+
+    return retval;
+}
+
+int
+ODVerifierDerive(const char *password, const unsigned char salt[kODVerifierSaltLength], int cost,
+                 unsigned char hash[kODVerifierHashLength])
+{
+    return ODVerifierScrypt(password, strlen(password), salt, kODVerifierSaltLength,
+                            cost, kODVerifierBlockSize, 1, hash, kODVerifierHashLength);
+}
+
+int
+ODVerifierEqual(const unsigned char *a, const unsigned char *b, size_t len)
+{
+    unsigned char diff = 0;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+        diff |= a[i] ^ b[i];
+
+    return diff == 0;
+}
+
+int
+ODVerifierGetLocked(const char *username, ODVerifierRecord *record)
+{
+    size_t len;
+
+    if (gVerifier.cache == NULL || gVerifier.size <= 0)
+        return -1;
+
+    if (ODCacheGet(gVerifier.cache, username, strlen(username), record, sizeof(*record), &len) != 0)
+        return -1;
+
+    return (len == sizeof(*record)) ? 0 : -1;
+}
+
+/* the cache drops it once it's max-stale seconds past the directory's last word */
+void
+ODVerifierPutLocked(const char *username, const ODVerifierRecord *record, time_t now)
+{
+    int ttl = (int) (record->verified + gVerifier.maxStale - now);
+
+    if (ttl <= 0) {
+        ODCacheRemove(gVerifier.cache, username, strlen(username));
+        return;
+    }
+
+    ODCacheSet(gVerifier.cache, username, strlen(username), record, sizeof(*record), ttl);
+}
+
+int
+ODVerifierConfigure(int size, int revalidate, int maxStale, int cost)
+{
+    int retval = -1;
+
+    pthread_mutex_lock(&gVerifier.lock);
+
+    if (size < 0)
+        size = 0;
+    gVerifier.revalidate = revalidate > 0 ? revalidate : kODVerifierDefaultRevalidate;
+    gVerifier.maxStale = maxStale > 0 ? maxStale : kODVerifierDefaultMaxStale;
+    if (gVerifier.revalidate > gVerifier.maxStale)
+        gVerifier.revalidate = gVerifier.maxStale;
+
+    if (cost <= 0)
+        cost = kODVerifierDefaultCost;
+    if (cost < kODVerifierMinCost)
+        cost = kODVerifierMinCost;
+    if (cost > kODVerifierMaxCost)
+        cost = kODVerifierMaxCost;
+    gVerifier.cost = cost;
+
+    if (gVerifier.cache == NULL && size > 0) {
+        if (ODCacheCreate(size, &gVerifier.cache) != 0)
+            goto failure;
+    } else if (gVerifier.cache != NULL && size != gVerifier.size) {
+        ODCacheFlush(gVerifier.cache);
+        ODCacheSetMaxEntries(gVerifier.cache, size);
+        ++gVerifier.generation;
+    }
+    gVerifier.size = size;
+
+    retval = 0;
+failure:
+    pthread_mutex_unlock(&gVerifier.lock);
+
+    return retval;
+}
+
+int
+ODVerifierCheck(const char *username, const char *password, ODVerifierDirectoryFunc directory)
+{
+    unsigned char hash[kODVerifierHashLength];
+    ODVerifierRecord record;
+    time_t now = time(NULL);
+    int retval = kODVerifierMiss;
+
+    if (username == NULL || *username == '\0' || password == NULL)
+        return kODVerifierMiss;
+
+    pthread_mutex_lock(&gVerifier.lock);
+    if (gVerifier.cache == NULL || gVerifier.size <= 0) {
+        pthread_mutex_unlock(&gVerifier.lock);
+        return kODVerifierMiss;
+    }
+    if (ODVerifierGetLocked(username, &record) != 0 || now - record.verified > gVerifier.maxStale) {
+        ++gVerifier.stats.misses;
+        pthread_mutex_unlock(&gVerifier.lock);
+        return kODVerifierMiss;
+    }
+    pthread_mutex_unlock(&gVerifier.lock);
+
+    /* the expensive part, outside the lock */
+    if (ODVerifierDerive(password, record.salt, record.cost, hash) != 0)
+        return kODVerifierMiss;
+
+    pthread_mutex_lock(&gVerifier.lock);
+
+    if (!ODVerifierEqual(hash, record.hash, sizeof(hash))) {
+        ++gVerifier.stats.mismatches;
+        goto done;
+    }
+
+    ++gVerifier.stats.hits;
+    retval = kODVerifierHit;
+
+    /* time to ask the directory again; one revalidation per user at a time */
+    if (directory != NULL && ODVerifierGetLocked(username, &record) == 0
+        && ODVerifierEqual(hash, record.hash, sizeof(hash))
+        && now - record.verified >= gVerifier.revalidate
+        && (record.queued == 0 || now - record.queued >= gVerifier.revalidate)
+        && ODVerifierEnqueueLocked(username, password, &record, directory) == 0) {
+        record.queued = now;
+        ODVerifierPutLocked(username, &record, now);
+    }
+
+done:
+    pthread_mutex_unlock(&gVerifier.lock);
+    memset(hash, 0, sizeof(hash));
+
+    return retval;
+}
+
+void
+ODVerifierStore(const char *username, const char *password)
+{
+    if (username == NULL || *username == '\0' || password == NULL)
+        return;
+
+    /* hashing is left to the background thread */
+    pthread_mutex_lock(&gVerifier.lock);
+    if (gVerifier.cache != NULL && gVerifier.size > 0)
+        (void) ODVerifierEnqueueLocked(username, password, NULL, NULL);
+    pthread_mutex_unlock(&gVerifier.lock);
+}
+
+void
+ODVerifierForget(const char *username)
+{
+    if (username == NULL)
+        return;
+
+    pthread_mutex_lock(&gVerifier.lock);
+    if (gVerifier.cache != NULL)
+        ODCacheRemove(gVerifier.cache, username, strlen(username));
+    /* a verifier still being made may be for the password just rejected */
+    ++gVerifier.generation;
+    pthread_mutex_unlock(&gVerifier.lock);
+}
+
+int
+ODVerifierMake(const char *password, int cost, ODVerifierRecord *record)
+{
+    memset(record, 0, sizeof(*record));
+    if (ODNonceBytes(record->salt, sizeof(record->salt)) != 0
+        || ODVerifierDerive(password, record->salt, cost, record->hash) != 0)
+        return -1;
+    record->cost = cost;
+    record->verified = time(NULL);
+
+    return 0;
+}
+
+int
+ODVerifierEnqueueLocked(const char *username, const char *password, const ODVerifierRecord *record,
+                        ODVerifierDirectoryFunc directory)
+{
+    ODVerifierJob *job;
+
+    if (strlen(username) >= kODVerifierMaxUsername || strlen(password) >= kODVerifierMaxPassword)
+        return -1;
+
+    pthread_once(&gVerifierWorkerOnce, ODVerifierStartWorker);
+    if (!gVerifier.workerRunning || gVerifier.count == kODVerifierQueueSize) {
+        /* the next login will try again */
+        ++gVerifier.stats.skipped;
+        return -1;
+    }
+
+    job = &gVerifier.queue[(gVerifier.head + gVerifier.count) % kODVerifierQueueSize];
+    job->directory = directory;
+    if (record != NULL)
+        memcpy(job->hash, record->hash, sizeof(job->hash));
+    job->cost = gVerifier.cost;
+    job->generation = gVerifier.generation;
+    strcpy(job->username, username);
+    strcpy(job->password, password);
+    ++gVerifier.count;
+
+    pthread_cond_signal(&gVerifier.wakeup);
+
+    return 0;
+}
+
+/* only applies to the verifier the job was queued for; a newer one stands */
+void
+ODVerifierFinishLocked(ODVerifierJob *job, int result)
+{
+    ODVerifierRecord record;
+    time_t now = time(NULL);
+
+    if (ODVerifierGetLocked(job->username, &record) != 0
+        || !ODVerifierEqual(job->hash, record.hash, sizeof(record.hash)))
+        return;
+
+    switch (result) {
+    case kODVerifierAccepted:
+        record.verified = now;
+        record.queued = 0;
+        ODVerifierPutLocked(job->username, &record, now);
+        ++gVerifier.stats.revalidated;
+        break;
+    case kODVerifierRejected:
+        ODCacheRemove(gVerifier.cache, job->username, strlen(job->username));
+        ++gVerifier.stats.revoked;
+        break;
+    default:
+        /* no answer; it ages towards max-stale and the next hit retries */
+        record.queued = 0;
+        ODVerifierPutLocked(job->username, &record, now);
+        break;
+    }
+}
+
+void
+ODVerifierStartWorker(void)
+{
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, ODVerifierWorker, NULL) == 0)
+        gVerifier.workerRunning = 1;
+    else
+        syslog(LOG_ERR, "%s: unable to start the verifier thread (%s), verifiers won't be made or refreshed",
+               __PRETTY_FUNCTION__, strerror(errno));
+    pthread_attr_destroy(&attr);
+}
+
+void *
+ODVerifierWorker(void *arg)
+{
+    ODVerifierJob job;
+    ODVerifierRecord record;
+    int result;
+
+    pthread_mutex_lock(&gVerifier.lock);
+    for (;;) {
+        while (gVerifier.count == 0)
+            pthread_cond_wait(&gVerifier.wakeup, &gVerifier.lock);
+
+        job = gVerifier.queue[gVerifier.head];
+        memset(&gVerifier.queue[gVerifier.head], 0, sizeof(job));
+        gVerifier.head = (gVerifier.head + 1) % kODVerifierQueueSize;
+        --gVerifier.count;
+
+        pthread_mutex_unlock(&gVerifier.lock);
+        if (job.directory != NULL)
+            result = (job.directory)(job.username, job.password);
+        else
+            result = ODVerifierMake(job.password, job.cost, &record);
+        memset(job.password, 0, sizeof(job.password));
+        pthread_mutex_lock(&gVerifier.lock);
+
+        if (job.directory != NULL)
+            ODVerifierFinishLocked(&job, result);
+        else if (result == 0 && job.generation == gVerifier.generation
+                 && gVerifier.cache != NULL && gVerifier.size > 0) {
+            ODVerifierPutLocked(job.username, &record, record.verified);
+            ++gVerifier.stats.stored;
+        }
+        memset(&record, 0, sizeof(record));
+    }
+
+    return NULL;
+}
+
+void
+ODVerifierFlush(void)
+{
+    pthread_mutex_lock(&gVerifier.lock);
+    if (gVerifier.cache != NULL)
+        ODCacheFlush(gVerifier.cache);
+    ++gVerifier.generation;
+    pthread_mutex_unlock(&gVerifier.lock);
+}
+
+int
+ODVerifierGetStats(ODVerifierStats *statsOut)
+{
+    ODCacheStats cacheStats;
+
+    if (statsOut == NULL)
+        return -1;
+
+    pthread_mutex_lock(&gVerifier.lock);
+    *statsOut = gVerifier.stats;
+    statsOut->entries = 0;
+    if (gVerifier.cache != NULL && ODCacheGetStats(gVerifier.cache, &cacheStats) == 0)
+        statsOut->entries = cacheStats.entries;
+    pthread_mutex_unlock(&gVerifier.lock);
+
+    return 0;
+}
+
+void
+ODVerifierLogStats(void)
+{
+    ODVerifierStats stats;
+
+    ODVerifierGetStats(&stats);
+    /* nothing to say while verifiers are off */
+    if (stats.hits == 0 && stats.misses == 0 && stats.stored == 0)
+        return;
+
+    syslog(LOG_NOTICE, "plain verifiers: %d users, %lu hits, %lu misses, %lu mismatches, %lu stored, %lu revalidated, %lu revoked, %lu jobs skipped",
+           stats.entries, stats.hits, stats.misses, stats.mismatches, stats.stored,
+           stats.revalidated, stats.revoked, stats.skipped);
+}
@@ -0,0 +1,69 @@
+/*
+ *  odverifier.h
+ *
+ *  local verifiers for PLAIN passwords, so logins don't wait on a slow
+ *  directory
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __ODVERIFIER_H__
+#define __ODVERIFIER_H__
+
+/* ODVerifierCheck() results */
+enum {
+    kODVerifierMiss = 0,        /* ask the directory */
+    kODVerifierHit              /* the password matches what the directory last accepted */
+};
+
+/* what the directory said, from an ODVerifierDirectoryFunc */
+enum {
+    kODVerifierAccepted = 0,
+    kODVerifierRejected,        /* bad password or no such user */
+    kODVerifierUnavailable      /* the directory couldn't answer */
+};
+
+#define kODVerifierDefaultSize          0       /* users, 0 = off */
+#define kODVerifierDefaultRevalidate    300     /* seconds before a hit is rechecked in the background */
+#define kODVerifierDefaultMaxStale      3600    /* seconds without the directory's agreement before a verifier is unusable */
+#define kODVerifierDefaultCost          12      /* log2 of the scrypt N parameter; 4MB and about 10ms a check */
+
+typedef int (*ODVerifierDirectoryFunc)(const char *username, const char *password);
+
+typedef struct ODVerifierStats {
+    unsigned long hits;
+    unsigned long misses;       /* no verifier, or too stale to use */
+    unsigned long mismatches;   /* a verifier, but not for this password */
+    unsigned long stored;
+    unsigned long revalidated;
+    unsigned long revoked;      /* dropped because the directory rejected the password */
+    unsigned long skipped;      /* stores and revalidations dropped because the queue was full */
+    int entries;
+} ODVerifierStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* changing size drops every verifier */
+int ODVerifierConfigure(int size, int revalidate, int maxStale, int cost);
+
+/* costs a scrypt hash, so only for when the directory can't answer; a hit
+ * older than the revalidation interval is queued for directory, which is
+ * called on a background thread with a copy of the password */
+int ODVerifierCheck(const char *username, const char *password, ODVerifierDirectoryFunc directory);
+
+/* after the directory accepts or rejects the password; the verifier is made
+ * on the background thread, so it isn't there as soon as this returns */
+void ODVerifierStore(const char *username, const char *password);
+void ODVerifierForget(const char *username);
+
+void ODVerifierFlush(void);
+int ODVerifierGetStats(ODVerifierStats *statsOut);
+void ODVerifierLogStats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
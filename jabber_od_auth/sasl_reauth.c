@@ -0,0 +1,213 @@
+/*
+ *  sasl_reauth.c
+ *
+ *  SASL server mechanism for presenting a re-authentication token
+ *
+ *  X-APPLE-REAUTH looks like PLAIN, with a token from odtoken in place of
+ *  the password: the client sends [authzid] NUL authcid NUL token.  The
+ *  token is checked in-process, so a client that reconnects with one
+ *  doesn't cost a directory call; the username still goes through
+ *  canon_user and the authzid check, like every other mechanism.
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#include <stdio.h>
+#include <assert.h>
+#include <sasl/sasl.h>
+#include <sasl/saslplug.h>
+#include <sasl/saslutil.h>
+#include <string.h>
+
+#include "sasl_reauth.h"
+#include "odtoken.h"
+
+#define SETERROR(utils, msg) \
+        sasl_reauth_set_error((utils), (msg))
+
+static void sasl_reauth_set_error(const sasl_utils_t *utils, const char *msg);
+
+static int sasl_reauth_server_mech_new(void *glob_context,
+                                       sasl_server_params_t *sparams,
+                                       const char *challenge,
+                                       unsigned challen,
+                                       void **conn_context);
+static int sasl_reauth_server_mech_step(void *conn_context,
+                                        sasl_server_params_t *sparams,
+                                        const char *clientin,
+                                        unsigned clientinlen,
+                                        const char **serverout,
+                                        unsigned *serveroutlen,
+                                        sasl_out_params_t *oparams);
+static int sasl_reauth_server_plug_init(const sasl_utils_t *utils,
+                                        int maxversion,
+                                        int *out_version,
+                                        sasl_server_plug_t **pluglist,
+                                        int *plugcount);
+
+static sasl_server_plug_t sasl_reauth_server_plugins[] = {
+    {
+        kODTokenMechanism,              /* mech_name */
+        0,                              /* max_ssf */
+        SASL_SEC_NOANONYMOUS
+        | SASL_SEC_PASS_CREDENTIALS,    /* security_flags */
+        SASL_FEAT_WANT_CLIENT_FIRST
+        | SASL_FEAT_ALLOWS_PROXY,       /* features */
+        NULL,                           /* glob_context */
+        &sasl_reauth_server_mech_new,   /* mech_new */
+        &sasl_reauth_server_mech_step,  /* mech_step */
+        NULL,                           /* mech_dispose */
+        NULL,                           /* mech_free */
+        NULL,                           /* setpass */
+        NULL,                           /* user_query */
+        NULL,                           /* idle */
+        NULL,                           /* mech_avail */
+        NULL                            /* spare */
+    }
+};
+
+void
+sasl_reauth_set_error(const sasl_utils_t *utils, const char *msg)
+{
+    assert(utils != 0 && msg != 0);
+    if (utils != 0 && msg != 0)
+        utils->seterror(utils->conn, 0, "%s", msg);
+}
+
+int
+sasl_reauth_server_mech_new(void *glob_context __attribute__((unused)),
+                            sasl_server_params_t *sparams __attribute__((unused)),
+                            const char *challenge __attribute__((unused)),
+                            unsigned challen __attribute__((unused)),
+                            void **conn_context)
+{
+    /* there is nothing to keep between steps */
+    *conn_context = 0;
+
+    return SASL_OK;
+}
+
+int
+sasl_reauth_server_mech_step(void *conn_context __attribute__((unused)),
+                             sasl_server_params_t *sparams,
+                             const char *clientin,
+                             unsigned clientinlen,
+                             const char **serverout,
+                             unsigned *serveroutlen,
+                             sasl_out_params_t *oparams)
+{
+    const char *authzid, *authcid, *token;
+    unsigned int authzidlen, authcidlen, tokenlen;
+    char authcidbuf[1024];
+    const char *end = clientin + clientinlen;
+    int result;
+
+    *serverout = 0;
+    *serveroutlen = 0;
+
+    if (clientin == 0 || clientinlen == 0) {
+        SETERROR(sparams->utils, "Missing token");
+        return SASL_BADPROT;
+    }
+
+    /* [authzid] NUL authcid NUL token */
+    authzid = clientin;
+    authcid = memchr(authzid, '\0', (size_t)(end - authzid));
+    if (authcid == 0) {
+        SETERROR(sparams->utils, "Malformed token response");
+        return SASL_BADPROT;
+    }
+    authzidlen = (unsigned int)(authcid - authzid);
+    ++authcid;
+
+    token = memchr(authcid, '\0', (size_t)(end - authcid));
+    if (token == 0) {
+        SETERROR(sparams->utils, "Malformed token response");
+        return SASL_BADPROT;
+    }
+    authcidlen = (unsigned int)(token - authcid);
+    ++token;
+    tokenlen = (unsigned int)(end - token);
+
+    if (authcidlen == 0 || authcidlen >= sizeof(authcidbuf)) {
+        SETERROR(sparams->utils, "Bad username");
+        return SASL_BADPROT;
+    }
+    memcpy(authcidbuf, authcid, authcidlen);
+    authcidbuf[authcidlen] = '\0';
+
+    /* canon_user first, so a throttled user is refused before anything
+     * else happens */
+    if (authzidlen > 0) {
+        result = sparams->canon_user(sparams->utils->conn, authcid, authcidlen,
+                                     SASL_CU_AUTHID, oparams);
+        if (result == SASL_OK)
+            result = sparams->canon_user(sparams->utils->conn, authzid, authzidlen,
+                                         SASL_CU_AUTHZID, oparams);
+    }
+    else
+        result = sparams->canon_user(sparams->utils->conn, authcid, authcidlen,
+                                     SASL_CU_AUTHID | SASL_CU_AUTHZID, oparams);
+    if (result != SASL_OK)
+        return result;
+
+    switch (ODTokenVerify(authcidbuf, token, tokenlen)) {
+    case kODTokenValid:
+        break;
+    case kODTokenExpired:
+        SETERROR(sparams->utils, "Token expired");
+        return SASL_BADAUTH;
+    case kODTokenRevoked:
+        SETERROR(sparams->utils, "Token revoked");
+        return SASL_BADAUTH;
+    default:
+        SETERROR(sparams->utils, "Bad token");
+        return SASL_BADAUTH;
+    }
+
+    oparams->doneflag = 1;
+    oparams->mech_ssf = 0;
+    oparams->maxoutbuf = 0;
+    oparams->encode_context = NULL;
+    oparams->encode = NULL;
+    oparams->decode_context = NULL;
+    oparams->decode = NULL;
+    oparams->param_version = 0;
+
+    return SASL_OK;
+}
+
+int
+sasl_reauth_server_plug_init(const sasl_utils_t *utils __attribute__((unused)),
+                             int maxversion,
+                             int *out_version,
+                             sasl_server_plug_t **pluglist,
+                             int *plugcount)
+{
+    if (maxversion < SASL_SERVER_PLUG_VERSION)
+        return SASL_BADVERS;
+
+    *out_version = SASL_SERVER_PLUG_VERSION;
+    *pluglist = sasl_reauth_server_plugins;
+    *plugcount = 1;
+
+    return SASL_OK;
+}
+
+int
+sasl_reauth_register(void)
+{
+    static int done = 0;
+    int retval = SASL_OK;
+
+    if (! done) {
+        retval = sasl_server_add_plugin("apple-reauth", sasl_reauth_server_plug_init);
+        assert(retval == SASL_OK);
+
+        done = 1;
+    }
+
+    if (retval != SASL_OK)
+        return -1;
+    return 0;
+}
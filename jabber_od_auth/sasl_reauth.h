@@ -0,0 +1,13 @@
+/*
+ *  sasl_reauth.h
+ *
+ *  Copyright (c) 2012, Apple Inc. All rights reserved.
+ */
+
+#ifndef __SASL_REAUTH_H__
+#define __SASL_REAUTH_H__
+
+/* adds the X-APPLE-REAUTH mechanism (see odtoken.h) to the SASL server */
+int sasl_reauth_register(void);
+
+#endif
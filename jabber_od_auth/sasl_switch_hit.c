@@ -27,8 +27,10 @@
 typedef struct sasl_switch_hit_context {
     int            step;
     ODCKSession   *session;
+    int            failed;
     char           username[1024];
     unsigned int   usernamelen;
+    char           serverout[256];
     void          *conn_context;
 } sasl_switch_hit_context;
 
@@ -106,7 +108,7 @@ sasl_switch_hit_server_mech_new(void *glob_context,
         goto done;
     }
 
-    if (ODCKCreateSession(/*(char*)sparams->appname, (char*)sparams->service, 0,*/ &text->session)) {
+    if (ODCKAcquireSession(&text->session)) {
         SETERROR(sparams->utils, "Unable to create session");
         goto done;
     }
@@ -123,7 +125,7 @@ done:
     if (retval != SASL_OK) {
         if (text != 0) {
             if (text->session != 0) {
-                ODCKDeleteSession(&text->session);
+                ODCKReleaseSession(&text->session, 1);
             }
             sparams->utils->free(text);
         }
@@ -294,6 +296,15 @@ sasl_switch_hit_server_mech_step2(sasl_switch_hit_context *text,
         goto done;
     }
 
+    /* the session goes back to the pool below, so keep our own copy */
+    if (serverlen >= sizeof(text->serverout)) {
+        SETERROR(sparams->utils, "Server response too long");
+        goto done;
+    }
+    memcpy(text->serverout, *serverout, serverlen);
+    text->serverout[serverlen] = '\0';
+    *serverout = text->serverout;
+
     /* Before returning SASL_OK, mech_step must fill in the oparams fields for which it is
      * responsible, that is, doneflag (set to 1 to indicate a complete exchange), maxoutbuf,
      * or the maximum output size it can do at once for a security layer, mech_ssf or the
@@ -320,8 +331,9 @@ sasl_switch_hit_server_mech_step2(sasl_switch_hit_context *text,
 
     *serveroutlen = serverlen;
 
-    /* get rid of any expensive resources that are no longer needed */
-    (void)ODCKFlushSession(text->session);
+    /* the connection may stay up for hours; hand the session back for
+     * the next login instead of holding it until dispose */
+    (void)ODCKReleaseSession(&text->session, 0);
 
     retval = SASL_OK;
 done:
@@ -338,6 +350,7 @@ sasl_switch_hit_server_mech_step(void *conn_context,
                     sasl_out_params_t *oparams)
 {
     sasl_switch_hit_context *text = (sasl_switch_hit_context*)conn_context;
+    int retval;
 
     if (text == 0) {
         /* likely a failure occurred, and _step is being called
@@ -350,26 +363,36 @@ sasl_switch_hit_server_mech_step(void *conn_context,
 
     *serverout = 0;
     *serveroutlen = 0;
+
+    if (text->session == 0) {
+        /* the exchange has already completed */
+        SETERROR(sparams->utils, "Invalid DIGEST-MD5 server step");
+        return SASL_FAIL;
+    }
     
     switch (text->step) {
     case 0:
-        return sasl_switch_hit_server_mech_step1(text, sparams,
+        retval = sasl_switch_hit_server_mech_step1(text, sparams,
                                     clientin, clientinlen,
                                     serverout, serveroutlen, oparams);
-        /* should never get here */
         break;
     case 1:
-        return sasl_switch_hit_server_mech_step2(text, sparams,
+        retval = sasl_switch_hit_server_mech_step2(text, sparams,
                                     clientin, clientinlen,
                                     serverout, serveroutlen, oparams);
+        break;
+    default:
         /* should never get here */
+        SETERROR(sparams->utils, "Invalid DIGEST-MD5 server step");
+        retval = SASL_FAIL;
         break;
     }
 
-    /* should never get here */
+    /* don't let a failed exchange's session back into the pool */
+    if (retval != SASL_OK && retval != SASL_CONTINUE)
+        text->failed = 1;
 
-    SETERROR(sparams->utils, "Invalid DIGEST-MD5 server step");
-    return SASL_FAIL;
+    return retval;
 }
 
 void
@@ -380,7 +403,7 @@ sasl_switch_hit_server_mech_dispose(void *conn_context, const sasl_utils_t *util
         if (text->conn_context != 0)
             sasl_switch_hit_plugin_to_override->mech_dispose(text->conn_context, utils);
         if (text->session != 0)
-            ODCKDeleteSession(&text->session);
+            ODCKReleaseSession(&text->session, text->failed);
         utils->free(text);
     }
 
@@ -0,0 +1,388 @@
+#!/usr/bin/perl -w
+# Copyright (c) 2013 Apple Inc. All Rights Reserved.
+#
+# IMPORTANT NOTE: This file is licensed only for use on Apple-branded
+# computers and is subject to the terms and conditions of the Apple Software
+# License Agreement accompanying the package this file is a part of.
+# You may not port this file to another platform without Apple's written consent.
+
+# Search the jabberd router's message log.  The router writes the log as a
+# series of gzip compressed segments listed in a manifest, and as it seals
+# each segment it writes an index of the blocks (gzip members) each JID and
+# word appears in; see router.c.  Only the segments whose time range
+# matches are opened, and of those only the blocks the index says might
+# match are decompressed.  A segment without an index (one still being
+# written, or left open by a crash) is read from start to end.
+
+use Getopt::Long qw(:config bundling no_ignore_case);
+use File::Basename;
+use IO::Uncompress::Gunzip qw(gunzip $GunzipError);
+use Time::Local;
+use strict;
+
+my $LOG_PATH = "/Library/Server/Messages/Data/message_archives/jabberd_user_messages.log";
+my $INDEX_MAGIC = "JMLIDX1\n";
+my $HEADER_SIZE = 24;
+my $BLOCK_SIZE = 40;
+my $TERM_SIZE = 16;
+# words outside these lengths aren't in the index
+my $WORD_MIN = 2;
+my $WORD_MAX = 64;
+my %MONTHS = (Jan => 0, Feb => 1, Mar => 2, Apr => 3, May => 4, Jun => 5,
+	Jul => 6, Aug => 7, Sep => 8, Oct => 9, Nov => 10, Dec => 11);
+
+my %stats = (segments => 0, indexed => 0, scanned => 0, blocks => 0, blocks_read => 0, matches => 0);
+
+sub usage {
+	print "Searches the message log written by the jabberd router.\n\n";
+	print "Usage:  $0 [-v] [-l path] [-f jid] [-t jid] [-p jid [-p jid]] [-s time] [-e time] [word ...]\n";
+	print "Flags:\n";
+	print " -l <path>: The message log, as message_logging.file in router.xml.\n";
+	print "            Default $LOG_PATH\n";
+	print " -f <jid>: Messages from this JID.\n";
+	print " -t <jid>: Messages to this JID.\n";
+	print " -p <jid>: Messages from or to this JID; given twice, messages between the two.\n";
+	print " -s <time>: Messages at or after this time, as YYYY-MM-DD[ hh:mm[:ss]] or seconds since the epoch.\n";
+	print " -e <time>: Messages at or before this time; a date alone means the end of that day.\n";
+	print " -v: Say how much of the log was read, on stderr.\n";
+	print " -?, -h: Show usage info.\n";
+	print "Words are matched whole and without regard to case; every one given has to appear.\n";
+	print "JIDs are matched without their resource.\n";
+}
+
+# YYYY-MM-DD[ hh:mm[:ss]] or seconds since the epoch, in local time
+sub parse_time {
+	my ($s, $end) = @_;
+
+	return $s if ($s =~ /^\d+$/);
+	if ($s =~ /^(\d{4})-(\d\d)-(\d\d)(?:[ T](\d\d):(\d\d)(?::(\d\d))?)?$/) {
+		return timelocal(59, 59, 23, $3, $2 - 1, $1) if ($end && !defined $4);
+		return timelocal(defined $6 ? $6 : ($end ? 59 : 0), $5 || 0, $4 || 0, $3, $2 - 1, $1);
+	}
+	die "$0: can't make sense of the time \"$s\"\n";
+}
+
+# the record's date, as ctime() wrote it
+sub record_time {
+	my ($date) = @_;
+
+	return undef unless ($date =~ /^\w{3} (\w{3}) +(\d+) (\d\d):(\d\d):(\d\d) (\d{4})/ && exists $MONTHS{$1});
+	return timelocal($5, $4, $3, $2, $MONTHS{$1}, $6);
+}
+
+sub bare_jid {
+	my ($jid) = @_;
+
+	$jid =~ s{/.*}{};
+	$jid =~ tr/A-Z/a-z/;
+	return $jid;
+}
+
+# the body's words as the router indexes them: runs of letters and digits,
+# anything outside ASCII counting as a letter, with "\n" for a line end
+sub words {
+	my ($body) = @_;
+
+	$body =~ s/\\n/ /g;
+	$body =~ tr/A-Z/a-z/;
+	return ($body =~ /([0-9a-z\x80-\xff]+)/g);
+}
+
+# FNV-1a of the key's type and its lowercased text, as router.c hashes it
+sub key_hash {
+	my ($type, $key) = @_;
+	my $h = 2166136261;
+
+	$key =~ tr/A-Z/a-z/;
+	foreach my $c (unpack("C*", $type . $key)) {
+		$h = (($h ^ $c) * 16777619) & 0xffffffff;
+	}
+	return $h == 0 ? 1 : $h;
+}
+
+sub read_at {
+	my ($fh, $offset, $length) = @_;
+	my $data = "";
+
+	seek($fh, $offset, 0) || return undef;
+	return undef if (read($fh, $data, $length) != $length);
+	return $data;
+}
+
+# block numbers a key appears in, or undef if the index can't say
+sub postings {
+	my ($idx, $hash) = @_;
+	my ($lo, $hi) = (0, $idx->{terms} - 1);
+
+	while ($lo <= $hi) {
+		my $mid = int(($lo + $hi) / 2);
+		my $entry = read_at($idx->{fh}, $idx->{term_base} + $mid * $TERM_SIZE, $TERM_SIZE);
+		return undef unless defined $entry;
+		my ($h, $count, $offset) = unpack("V V Q<", $entry);
+		if ($h < $hash) {
+			$lo = $mid + 1;
+		} elsif ($h > $hash) {
+			$hi = $mid - 1;
+		} else {
+			# varint deltas, at most five bytes a block
+			my ($data, $block, $v, $shift, @blocks) = ("", 0, 0, 0);
+			seek($idx->{fh}, $idx->{postings_base} + $offset, 0) || return undef;
+			read($idx->{fh}, $data, $count * 5);
+			foreach my $c (unpack("C*", $data)) {
+				$v |= ($c & 0x7f) << $shift;
+				if ($c & 0x80) {
+					$shift += 7;
+					next;
+				}
+				$block += $v;
+				push(@blocks, $block);
+				($v, $shift) = (0, 0);
+				last if (@blocks == $count);
+			}
+			return undef if (@blocks != $count);
+			return \@blocks;
+		}
+	}
+	return [];
+}
+
+sub open_index {
+	my ($path) = @_;
+	my ($fh, %idx);
+
+	open($fh, "<", $path) || return undef;
+	binmode($fh);
+	my $header = read_at($fh, 0, $HEADER_SIZE);
+	if (!defined $header || substr($header, 0, 8) ne $INDEX_MAGIC) {
+		warn "$0: $path isn't a message log index, ignoring it\n";
+		close($fh);
+		return undef;
+	}
+	@idx{qw(blocks indexed terms)} = unpack("V V V", substr($header, 8));
+
+	my $table = read_at($fh, $HEADER_SIZE, $idx{blocks} * $BLOCK_SIZE);
+	if (!defined $table) {
+		warn "$0: $path is short, ignoring it\n";
+		close($fh);
+		return undef;
+	}
+	for (my $i = 0; $i < $idx{blocks}; $i++) {
+		my ($offset, $length, $first, $last, $records) = unpack("Q< Q< q< q< V", substr($table, $i * $BLOCK_SIZE, $BLOCK_SIZE));
+		push(@{$idx{block}}, { offset => $offset, length => $length, first => $first, last => $last, records => $records });
+	}
+	$idx{fh} = $fh;
+	$idx{term_base} = $HEADER_SIZE + $idx{blocks} * $BLOCK_SIZE;
+	$idx{postings_base} = $idx{term_base} + $idx{terms} * $TERM_SIZE;
+	return \%idx;
+}
+
+sub union {
+	my ($x, $y) = @_;
+	my %seen;
+
+	return [ sort { $a <=> $b } grep { !$seen{$_}++ } (@$x, @$y) ];
+}
+
+# the blocks of a segment that might hold a match
+sub candidate_blocks {
+	my ($idx, $q) = @_;
+	my %keep;
+
+	for (my $i = 0; $i < $idx->{blocks}; $i++) {
+		my $block = $idx->{block}[$i];
+		next if ($block->{records} == 0);
+		next if (defined $q->{start} && $block->{last} < $q->{start});
+		next if (defined $q->{end} && $block->{first} > $q->{end});
+		$keep{$i} = 1;
+	}
+
+	# each key narrows down the blocks the index covers
+	foreach my $set (@{$q->{sets}}) {
+		my $blocks = [];
+		foreach my $key (@$set) {
+			my $p = postings($idx, $key);
+			return [ sort { $a <=> $b } keys %keep ] unless defined $p;
+			$blocks = union($blocks, $p);
+		}
+		my %in = map { $_ => 1 } @$blocks;
+		foreach my $i (keys %keep) {
+			delete $keep{$i} if ($i < $idx->{indexed} && !$in{$i});
+		}
+	}
+
+	return [ sort { $a <=> $b } keys %keep ];
+}
+
+sub matches {
+	my ($line, $q) = @_;
+
+	return 0 if ($line =~ /^#/);
+	my ($date, $from, $to, $body) = split(/\t/, $line, 4);
+	return 0 unless defined $body;
+
+	$from = bare_jid($from);
+	$to = bare_jid($to);
+	return 0 if (defined $q->{from} && $from ne $q->{from});
+	return 0 if (defined $q->{to} && $to ne $q->{to});
+	foreach my $p (@{$q->{participants}}) {
+		return 0 if ($from ne $p && $to ne $p);
+	}
+	if (@{$q->{words}}) {
+		my %have = map { $_ => 1 } words($body);
+		foreach my $w (@{$q->{words}}) {
+			return 0 unless $have{$w};
+		}
+	}
+	if (defined $q->{start} || defined $q->{end}) {
+		my $t = record_time($date);
+		return 0 unless defined $t;
+		return 0 if (defined $q->{start} && $t < $q->{start});
+		return 0 if (defined $q->{end} && $t > $q->{end});
+	}
+	return 1;
+}
+
+sub print_matches {
+	my ($text, $q) = @_;
+
+	foreach my $line (split(/(?<=\n)/, $text)) {
+		if (matches($line, $q)) {
+			print $line;
+			$stats{matches}++;
+		}
+	}
+}
+
+sub search_indexed {
+	my ($path, $idx, $q) = @_;
+	my $fh;
+
+	$stats{indexed}++;
+	$stats{blocks} += $idx->{blocks};
+
+	my $blocks = candidate_blocks($idx, $q);
+	return unless @$blocks;
+
+	open($fh, "<", $path) || die "$0: cannot open $path: $!\n";
+	binmode($fh);
+	foreach my $i (@$blocks) {
+		my $block = $idx->{block}[$i];
+		my $data = read_at($fh, $block->{offset}, $block->{length});
+		if (!defined $data) {
+			warn "$0: $path is shorter than its index says\n";
+			last;
+		}
+		$stats{blocks_read}++;
+		if ($path =~ /\.gz$/) {
+			my $text;
+			if (!gunzip(\$data, \$text)) {
+				warn "$0: $path: block $i: $GunzipError\n";
+				next;
+			}
+			$data = $text;
+		}
+		print_matches($data, $q);
+	}
+	close($fh);
+}
+
+# no index; read the lot, stopping quietly at a member the router never finished
+sub search_whole {
+	my ($path, $q) = @_;
+	my $fh;
+
+	$stats{scanned}++;
+	if ($path =~ /\.gz$/) {
+		$fh = IO::Uncompress::Gunzip->new($path, MultiStream => 1) || die "$0: cannot open $path: $GunzipError\n";
+	} else {
+		open($fh, "<", $path) || die "$0: cannot open $path: $!\n";
+		binmode($fh);
+	}
+	while (defined(my $line = $fh->getline())) {
+		if (matches($line, $q)) {
+			print $line;
+			$stats{matches}++;
+		}
+	}
+	close($fh);
+}
+
+# the last line for each segment, in the order they were started
+sub read_manifest {
+	my ($path) = @_;
+	my ($fh, @order, %segments);
+
+	open($fh, "<", "$path.manifest") || die "$0: cannot open $path.manifest: $!\n";
+	while (my $line = <$fh>) {
+		next if ($line =~ /^#/);
+		chomp($line);
+		my ($name, $first, $last) = split(/\t/, $line);
+		next unless (defined $last && $first =~ /^\d+$/ && $last =~ /^\d+$/);
+		push(@order, $name) unless exists $segments{$name};
+		$segments{$name} = { first => $first, last => $last };
+	}
+	close($fh);
+	return map { { name => $_, %{$segments{$_}} } } @order;
+}
+
+
+############ MAIN
+my (%opts, @participants);
+GetOptions(\%opts, 'l=s', 'f=s', 't=s', 'p=s' => \@participants, 's=s', 'e=s', 'v', 'h|?') || do {
+	&usage;
+	exit 1;
+};
+
+if (defined $opts{'h'}) {
+	&usage;
+	exit 0;
+}
+
+my $log = defined $opts{'l'} ? $opts{'l'} : $LOG_PATH;
+my %q = (participants => [ map { bare_jid($_) } @participants ], words => [], sets => []);
+$q{from} = bare_jid($opts{'f'}) if defined $opts{'f'};
+$q{to} = bare_jid($opts{'t'}) if defined $opts{'t'};
+$q{start} = parse_time($opts{'s'}, 0) if defined $opts{'s'};
+$q{end} = parse_time($opts{'e'}, 1) if defined $opts{'e'};
+foreach my $arg (@ARGV) {
+	push(@{$q{words}}, words($arg));
+}
+
+# the index keys each match has to have; one of a set will do
+push(@{$q{sets}}, [ key_hash("f", $q{from}) ]) if defined $q{from};
+push(@{$q{sets}}, [ key_hash("t", $q{to}) ]) if defined $q{to};
+foreach my $p (@{$q{participants}}) {
+	push(@{$q{sets}}, [ key_hash("f", $p), key_hash("t", $p) ]);
+}
+foreach my $w (@{$q{words}}) {
+	push(@{$q{sets}}, [ key_hash("w", $w) ]) if (length($w) >= $WORD_MIN && length($w) <= $WORD_MAX);
+}
+
+my $dir = dirname($log);
+foreach my $segment (read_manifest($log)) {
+	# a last time of 0 is a segment that's open, or was never sealed
+	next if (defined $q{end} && $segment->{first} > $q{end});
+	next if (defined $q{start} && $segment->{last} != 0 && $segment->{last} < $q{start});
+
+	my $path = "$dir/$segment->{name}";
+	if (! -e $path) {
+		warn "$0: $path is in the manifest but not on disk\n";
+		next;
+	}
+	$stats{segments}++;
+
+	my $idx = ($segment->{last} != 0 && -e "$path.idx") ? open_index("$path.idx") : undef;
+	if (defined $idx) {
+		search_indexed($path, $idx, \%q);
+		close($idx->{fh});
+	} else {
+		search_whole($path, \%q);
+	}
+}
+
+if (defined $opts{'v'}) {
+	printf STDERR "%d matches; %d segments searched, %d with their index (%d of %d blocks read), %d read whole\n",
+		$stats{matches}, $stats{segments}, $stats{indexed}, $stats{blocks_read}, $stats{blocks}, $stats{scanned};
+}
+
+exit 0;